@@ -0,0 +1,47 @@
+#include <iostream>
+
+#include "listdb/listdb.h"
+#include "listdb/db_client.h"
+
+// Entries logged after a batch are replayed at Open
+int main() {
+  constexpr uint64_t kNumKeys = 300;
+  constexpr uint64_t kBatchSize = 32;
+
+  ListDB::Options options;
+  ListDB* db = new ListDB();
+  db->Init(options);
+  DBClient* client = new DBClient(db, 0, 0);
+  // Single Puts logged before and after a batch spanning shards
+  const uint64_t batch_begin = kNumKeys / 3 + 1;
+  const uint64_t batch_end = batch_begin + kBatchSize;
+  for (uint64_t i = 1; i < batch_begin; i++) {
+    client->Put(Key(i), i);
+  }
+  WriteBatch batch;
+  for (uint64_t i = batch_begin; i < batch_end; i++) {
+    batch.Put(Key(i), i);
+  }
+  client->Write(batch);
+  for (uint64_t i = batch_end; i <= kNumKeys; i++) {
+    client->Put(Key(i), i);
+  }
+  delete client;
+  delete db;
+
+  db = new ListDB();
+  db->Open(options);
+  client = new DBClient(db, 0, 0);
+  int bad = 0;
+  for (uint64_t i = 1; i <= kNumKeys; i++) {
+    Value val_read = 0;
+    if (!client->Get(Key(i), &val_read) || val_read != i) {
+      bad++;
+    }
+  }
+  std::cout << "bad=" << bad << std::endl;
+  delete client;
+
+  delete db;
+  return (bad == 0) ? 0 : 1;
+}
@@ -9,12 +9,12 @@
 #include <cassert>
 #include <cstdio>
 
-//#define GROUP_LOGGING
 //#define L1_COW
 #define L0_CACHE_T_SIMPLE 1
 #define L0_CACHE_T_STATIC 2
 #define L0_CACHE_T_DOUBLE_HASHING 3
 #define L0_CACHE_T_LINEAR_PROBING 4
+#define L0_CACHE_T_CUCKOO 5
 //#define LISTDB_L0_CACHE L0_CACHE_T_DOUBLE_HASHING
 
 #ifdef LISTDB_L0_CACHE
@@ -26,6 +26,10 @@
 #ifndef LISTDB_STRING_KEY
 #include "listdb/core/integer_key.h"
 #define Key IntegerKey
+#elif defined(LISTDB_VARIABLE_LENGTH_KEY)
+#include "listdb/core/variable_length_string_key.h"
+constexpr size_t kStringKeyLength = VariableLengthStringKey::kMaxLength;
+#define Key VariableLengthStringKey
 #else
 #include "listdb/core/fixed_length_string_key.h"
 constexpr size_t kStringKeyLength = 16;
@@ -56,6 +60,8 @@ constexpr int kMaxHeight = 15;
 #ifdef LISTDB_L1_LRU
 constexpr int kNumCachedLevels = 12;
 constexpr int kLruMaxHeight = 20;
+// DRAM budget of the LruSkipLists over all shards and regions
+constexpr size_t kLruCacheCapacity = (45ull << 20);
 #endif
 
 #ifdef LISTDB_SKIPLIST_CACHE
@@ -66,9 +72,18 @@ constexpr uint16_t kSkipListCacheMaxHeight = 15;
 constexpr uint16_t kSkipListCacheBranching = 4;
 
 constexpr int kSkipListCacheMinPmemHeight = 5;
+// DRAM budget of the SkipListCaches over all shards and regions
 constexpr size_t kSkipListCacheCapacity = (45ull << 20);
 #endif
 
+#ifdef LISTDB_DRAM_LAYERED_L1
+#if defined(LISTDB_L1_LRU) || defined(LISTDB_SKIPLIST_CACHE)
+#error "LISTDB_DRAM_LAYERED_L1 replaces the other L1 caches"
+#endif
+// L1 nodes of this height or more have their upper levels copied in DRAM
+constexpr int kDramLayerMinHeight = 3;
+#endif
+
 constexpr int kNumDramLevels = 1;
 constexpr int kNumPmemLevels = 1;
 constexpr int kNumLevels = kNumDramLevels + kNumPmemLevels;
@@ -76,6 +91,7 @@ constexpr int kNumLevels = kNumDramLevels + kNumPmemLevels;
 constexpr int kNumWorkers = 80;
 
 constexpr size_t kPmemLogBlockSize = 4 * (1ull << 20) / kNumShards;
+constexpr size_t kMinPmemLogBlockSize = 4 * 1024;
 constexpr size_t kPmemBlobBlockSize = kPmemLogBlockSize;
 
 // constexpr uint64_t kHTMask = 0x0fffffff;
@@ -90,16 +106,71 @@ constexpr size_t kHTSize = ((1024ull << 20) - kSkipListCacheCapacity) / 24;
 #endif
 #endif
 
+// DRAM budget of the L0 caches over all shards. The caches start at
+// kMinL0CacheSize entries and grow with the L0 tables they cover.
+#ifndef LISTDB_SKIPLIST_CACHE
+constexpr size_t kL0CacheBudget = kHTSize * 8;
+#else
+constexpr size_t kL0CacheBudget = (1024ull << 20) - kSkipListCacheCapacity;
+#endif
+constexpr size_t kMinL0CacheSize = 64 * 1024;
+
+// Bits per key of the DRAM filters of L0 tables, 0 for none
+constexpr int kL0FilterBitsPerKey = 10;
+
 enum ValueType {
   kTypeAnchor = 0x0,
   kTypeShortcut = 0x1,
   kTypeValue = 0x2,
-  kTypeDeletion = 0x3
+  kTypeDeletion = 0x3,
+  kTypeBatchHeader = 0x4,
+  kTypeInlineValue = 0x5
 };
 
+// Values up to this size can be stored inline in the IUL entry
+constexpr size_t kMaxInlineValueSize = 1024;
+
+// Node tag: seqorder (40-bit) | l0_id (16-bit) | op (4-bit) | height (4-bit)
+// Both seqorder and l0_id wrap around and are compared within a window.
+constexpr int kSeqBits = 40;
+constexpr uint64_t kSeqMask = (1ull << kSeqBits) - 1;
+
+inline uint64_t MakeTag(const uint64_t seq, const uint64_t l0_id, const ValueType type, const int height) {
+  return ((seq & kSeqMask) << 24) | ((l0_id & 0xffff) << 8) | (type << 4) | height;
+}
+
+// seqorder 0 is never assigned. Compaction clears the seqorder of versions
+// visible to every snapshot.
+inline bool SeqVisible(const uint64_t seq, const uint64_t snapshot_seq) {
+  return seq == 0 || ((snapshot_seq - seq) & kSeqMask) < (1ull << (kSeqBits - 1));
+}
+
+// Returns whether seqorder a is newer than b. A cleared seqorder is older
+// than any other.
+inline bool SeqNewer(const uint64_t a, const uint64_t b) {
+  if (a == 0 || b == 0) {
+    return a != 0;
+  }
+  const uint64_t d = (a - b) & kSeqMask;
+  return d != 0 && d < (1ull << (kSeqBits - 1));
+}
+
+// Order of the nodes of a skiplist: by key, and versions of a key newest
+// first
+template <typename Node>
+inline bool NodePrecedes(const Node* a, const Node* b) {
+  const int cmp = a->key.Compare(b->key);
+  return cmp < 0 || (cmp == 0 && SeqNewer(a->seq(), b->seq()));
+}
+
+// Returns <0, 0, >0 as l0 id a is older than, same as, or newer than b
+inline int CompareL0Id(const uint64_t a, const uint64_t b) {
+  return (int16_t) (uint16_t) (a - b);
+}
+
 enum class TableType { kMemTable, kPmemTable };
 
-enum class TaskType { kMemTableFlush, kL0Compaction };
+enum class TaskType { kMemTableFlush, kL0Compaction, kMemTablePrepare, kPmemLogRefill };
 
 inline void SetAffinity(int coreid) {
   coreid = coreid % sysconf(_SC_NPROCESSORS_ONLN);
@@ -0,0 +1,60 @@
+#include <iostream>
+#include <thread>
+#include <vector>
+
+#include "listdb/listdb.h"
+#include "listdb/db_client.h"
+
+// Writers log batches spanning shards while the shards stall on their
+// MemTable limit, then every batch is checked after a reopen
+int main() {
+  constexpr int kNumWriters = 16;
+  constexpr uint64_t kNumBatchesPerWriter = 4000;
+  constexpr uint64_t kBatchSize = 16;
+
+  ListDB::Options options;
+  options.memtable_capacity = 1ull << 20;
+  options.max_num_memtables = 2;
+  options.num_workers = 1;
+  ListDB* db = new ListDB();
+  db->Init(options);
+
+  std::vector<std::thread> writers;
+  for (int id = 0; id < kNumWriters; id++) {
+    writers.emplace_back([db, id] {
+      DBClient* client = new DBClient(db, id, 0);
+      for (uint64_t b = 0; b < kNumBatchesPerWriter; b++) {
+        WriteBatch batch;
+        for (uint64_t i = 1; i <= kBatchSize; i++) {
+          uint64_t key = (b * kBatchSize + i) * kNumWriters + id;
+          batch.Put(key, key);
+        }
+        client->Write(batch);
+      }
+      delete client;
+    });
+  }
+  for (auto& t : writers) {
+    t.join();
+  }
+  delete db;
+
+  db = new ListDB();
+  db->Open(options);
+  DBClient* client = new DBClient(db, 0, 0);
+  int bad = 0;
+  for (int id = 0; id < kNumWriters; id++) {
+    for (uint64_t i = 1; i <= kNumBatchesPerWriter * kBatchSize; i++) {
+      uint64_t key = i * kNumWriters + id;
+      Value val_read = 0;
+      if (!client->Get(key, &val_read) || val_read != key) {
+        bad++;
+      }
+    }
+  }
+  std::cout << "bad=" << bad << std::endl;
+  delete client;
+
+  delete db;
+  return (bad == 0) ? 0 : 1;
+}
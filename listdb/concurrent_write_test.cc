@@ -0,0 +1,56 @@
+#include <iostream>
+#include <thread>
+#include <vector>
+
+#include "listdb/listdb.h"
+#include "listdb/db_client.h"
+
+// Writers race the flushes of their MemTables, which are small enough to
+// fill up many times over
+int main() {
+  constexpr int kNumWriters = 4;
+  constexpr uint64_t kNumKeysPerWriter = 100000;
+
+  ListDB::Options options;
+  options.memtable_capacity = 1ull << 20;
+  ListDB* db = new ListDB();
+  db->Init(options);
+
+  std::vector<std::thread> writers;
+  for (int id = 0; id < kNumWriters; id++) {
+    writers.emplace_back([db, id] {
+      DBClient* client = new DBClient(db, id, 0);
+      for (uint64_t i = 1; i <= kNumKeysPerWriter; i++) {
+        uint64_t key = i * kNumWriters + id;
+        if (i % 64 == 0) {
+          WriteBatch batch;
+          batch.Put(key, key);
+          client->Write(batch);
+        } else {
+          client->Put(key, key);
+        }
+      }
+      delete client;
+    });
+  }
+  for (auto& t : writers) {
+    t.join();
+  }
+
+  DBClient* client = new DBClient(db, 0, 0);
+  int bad = 0;
+  for (int id = 0; id < kNumWriters; id++) {
+    for (uint64_t i = 1; i <= kNumKeysPerWriter; i++) {
+      uint64_t key = i * kNumWriters + id;
+      Value val_read = 0;
+      if (!client->Get(key, &val_read) || val_read != key) {
+        bad++;
+      }
+    }
+  }
+  std::cout << "bad=" << bad << std::endl;
+  delete client;
+
+  delete db;
+  return (bad == 0) ? 0 : 1;
+}
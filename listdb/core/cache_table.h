@@ -0,0 +1,22 @@
+#ifndef LISTDB_CORE_CACHE_TABLE_H_
+#define LISTDB_CORE_CACHE_TABLE_H_
+
+#include <cstddef>
+
+// Bucket array of an L0 cache. A resize replaces the array of a cache and
+// retires the old one through the epoch manager, so that a reader keeps
+// the array it loaded for the rest of its epoch.
+template <typename Bucket>
+struct CacheTable {
+  explicit CacheTable(const size_t n) : size(n), buckets(new Bucket[n]) { }
+
+  ~CacheTable() { delete[] buckets; }
+
+  CacheTable(const CacheTable&) = delete;
+  CacheTable& operator=(const CacheTable&) = delete;
+
+  const size_t size;
+  Bucket* const buckets;
+};
+
+#endif  // LISTDB_CORE_CACHE_TABLE_H_
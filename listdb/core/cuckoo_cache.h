@@ -0,0 +1,327 @@
+#pragma once
+
+#include <emmintrin.h>
+
+#include <algorithm>
+#include <atomic>
+
+#include "listdb/common.h"
+#include "listdb/core/cache_table.h"
+#include "listdb/index/braided_pmem_skiplist.h"
+#include "listdb/lib/epoch.h"
+#include "listdb/lib/murmur3.h"
+
+// Bucketized cuckoo hash table caching L0 nodes.
+// A bucket is a cache line holding kSlots 16-bit fingerprints of keys and
+// the nodes, so a probe compares every fingerprint of a bucket at once and
+// reads a node only on a fingerprint match. A key lives in one of two
+// buckets; the second is derived from the first and the fingerprint, so
+// that entries can be moved without rereading their keys.
+// Readers are optimistic: a bucket is read between two loads of its version,
+// which writers keep odd while they modify the bucket.
+class CuckooCache {
+ public:
+  using PmemNode = BraidedPmemSkipList::Node;
+
+  static constexpr int kSlots = 6;
+
+  struct alignas(64) Bucket {
+    uint16_t tags[kSlots];  // 0 for an empty slot
+    std::atomic<uint32_t> version;
+    std::atomic<PmemNode*> values[kSlots];
+
+    Bucket() : tags{}, version(0) {
+      for (auto& value : values) {
+        value.store(nullptr, std::memory_order_relaxed);
+      }
+    }
+  };
+  static_assert(sizeof(Bucket) == 64, "a bucket must fill a cache line");
+
+  using Table = CacheTable<Bucket>;
+
+  static constexpr size_t kEntrySize = sizeof(Bucket) / kSlots;
+
+  // Holds at most size entries
+  CuckooCache(size_t size, int shard);
+
+  ~CuckooCache();
+
+  // Replaces the cached node of the key if any
+  void Insert(const Key& key, PmemNode* const p);
+
+  PmemNode* Lookup(const Key& key);
+
+  // Drops the entry of the key if it still caches p
+  void Erase(const Key& key, PmemNode* const p);
+
+  size_t size() { return table_.load()->size * kSlots; }
+
+  // Rehashes the entries into a new table of the given size. Must not run
+  // concurrently with Insert or Erase.
+  void Resize(const size_t size, EpochManager* epoch_manager);
+
+ private:
+  void Insert(Table* table, const Key& key, PmemNode* const p);
+
+  uint64_t Hash(const Key& key);
+
+  static uint16_t Tag(const uint64_t h);
+
+  static size_t AltBucket(const Table* table, const size_t b, const uint16_t tag);
+
+  // Slots of the bucket holding the tag, two bits per slot
+  static uint32_t MatchTags(const Bucket* bucket, const uint16_t tag);
+
+  static int FindKey(Bucket* bucket, const uint16_t tag, const Key& key);
+
+  static int FindEmpty(Bucket* bucket);
+
+  static void Lock(Bucket* bucket);
+
+  static bool TryLock(Bucket* bucket);
+
+  static void Unlock(Bucket* bucket);
+
+  // Makes room in the bucket by moving one of its entries to its other
+  // bucket. Returns the freed slot, or -1.
+  static int Displace(Table* table, const size_t b, const size_t other);
+
+  const int shard_;
+  const uint64_t seed_;
+  std::atomic<Table*> table_;
+};
+
+CuckooCache::CuckooCache(size_t size, int shard)
+    : shard_(shard),
+      seed_(std::hash<int>()(shard_)),
+      table_(new Table(std::max<size_t>(size / kSlots, 1))) {
+  std::atomic_thread_fence(std::memory_order_seq_cst);
+}
+
+CuckooCache::~CuckooCache() {
+  delete table_.load();
+}
+
+inline uint64_t CuckooCache::Hash(const Key& key) {
+#ifndef LISTDB_STRING_KEY
+  uint64_t h = key.key_num() ^ seed_;
+  h = (h ^ (h >> 33)) * 0xff51afd7ed558ccdull;
+  h = (h ^ (h >> 33)) * 0xc4ceb9fe1a85ec53ull;
+  return h ^ (h >> 33);
+#else
+  uint64_t h[2];
+  MurmurHash3_x64_128(key.data(), key.size(), seed_, (void*) h);
+  return h[0];
+#endif
+}
+
+inline uint16_t CuckooCache::Tag(const uint64_t h) {
+  uint16_t tag = h >> 48;
+  return (tag == 0) ? 1 : tag;
+}
+
+// Maps each of the two buckets of a key to the other one
+inline size_t CuckooCache::AltBucket(const Table* table, const size_t b, const uint16_t tag) {
+  const size_t t = (tag * 0x5bd1e995ull) % table->size;
+  return (t >= b) ? t - b : t + table->size - b;
+}
+
+inline uint32_t CuckooCache::MatchTags(const Bucket* bucket, const uint16_t tag) {
+  // The last two lanes hold the version
+  __m128i tags = _mm_loadu_si128((const __m128i*) bucket->tags);
+  __m128i eq = _mm_cmpeq_epi16(tags, _mm_set1_epi16(tag));
+  return _mm_movemask_epi8(eq) & ((1u << (2 * kSlots)) - 1);
+}
+
+inline int CuckooCache::FindKey(Bucket* bucket, const uint16_t tag, const Key& key) {
+  uint32_t match = MatchTags(bucket, tag);
+  while (match) {
+    int i = __builtin_ctz(match) / 2;
+    match &= ~(3u << (2 * i));
+    if (bucket->values[i].load(std::memory_order_relaxed)->key.Compare(key) == 0) {
+      return i;
+    }
+  }
+  return -1;
+}
+
+inline int CuckooCache::FindEmpty(Bucket* bucket) {
+  uint32_t match = MatchTags(bucket, 0);
+  return (match) ? __builtin_ctz(match) / 2 : -1;
+}
+
+inline void CuckooCache::Lock(Bucket* bucket) {
+  while (!TryLock(bucket)) {
+    _mm_pause();
+  }
+}
+
+inline bool CuckooCache::TryLock(Bucket* bucket) {
+  uint32_t v = bucket->version.load(std::memory_order_relaxed);
+  if ((v & 1) || !bucket->version.compare_exchange_strong(v, v + 1, std::memory_order_acquire)) {
+    return false;
+  }
+  std::atomic_thread_fence(std::memory_order_release);
+  return true;
+}
+
+inline void CuckooCache::Unlock(Bucket* bucket) {
+  bucket->version.fetch_add(1, std::memory_order_release);
+}
+
+int CuckooCache::Displace(Table* table, const size_t b, const size_t other) {
+  Bucket* bucket = &table->buckets[b];
+  for (int i = 0; i < kSlots; i++) {
+    size_t alt = AltBucket(table, b, bucket->tags[i]);
+    if (alt == b || alt == other) {
+      continue;
+    }
+    // Another writer holds it. Evicting is fine for a cache.
+    Bucket* alt_bucket = &table->buckets[alt];
+    if (!TryLock(alt_bucket)) {
+      continue;
+    }
+    int j = FindEmpty(alt_bucket);
+    if (j >= 0) {
+      alt_bucket->values[j].store(bucket->values[i].load(std::memory_order_relaxed),
+                                  std::memory_order_relaxed);
+      alt_bucket->tags[j] = bucket->tags[i];
+    }
+    Unlock(alt_bucket);
+    if (j >= 0) {
+      return i;
+    }
+  }
+  return -1;
+}
+
+void CuckooCache::Insert(const Key& key, PmemNode* const p) {
+  Insert(table_.load(std::memory_order_acquire), key, p);
+}
+
+void CuckooCache::Insert(Table* table, const Key& key, PmemNode* const p) {
+  Bucket* buckets = table->buckets;
+  const uint64_t h = Hash(key);
+  const uint16_t tag = Tag(h);
+  const size_t b1 = h % table->size;
+  const size_t b2 = AltBucket(table, b1, tag);
+  // Lock in bucket order
+  Bucket* first = &buckets[std::min(b1, b2)];
+  Bucket* second = &buckets[std::max(b1, b2)];
+  Lock(first);
+  if (second != first) {
+    Lock(second);
+  }
+
+  Bucket* bucket = nullptr;
+  int slot = -1;
+  for (size_t b : {b1, b2}) {
+    slot = FindKey(&buckets[b], tag, key);
+    if (slot >= 0) {
+      bucket = &buckets[b];
+      break;
+    }
+  }
+  if (slot < 0) {
+    for (size_t b : {b1, b2}) {
+      slot = FindEmpty(&buckets[b]);
+      if (slot >= 0) {
+        bucket = &buckets[b];
+        break;
+      }
+    }
+  }
+  if (slot < 0) {
+    slot = Displace(table, b1, b2);
+    bucket = &buckets[b1];
+  }
+  if (slot < 0) {
+    slot = (h >> 32) % kSlots;
+  }
+  // Flushes of a shard may finish out of order. A newer version stays.
+  PmemNode* cached = bucket->values[slot].load(std::memory_order_relaxed);
+  const bool newer_cached = (bucket->tags[slot] == tag && cached &&
+                             SeqNewer(cached->seq(), p->seq()) && cached->key.Compare(key) == 0);
+  if (!newer_cached) {
+    bucket->values[slot].store(p, std::memory_order_relaxed);
+    bucket->tags[slot] = tag;
+  }
+
+  if (second != first) {
+    Unlock(second);
+  }
+  Unlock(first);
+}
+
+CuckooCache::PmemNode* CuckooCache::Lookup(const Key& key) {
+  Table* table = table_.load(std::memory_order_acquire);
+  const uint64_t h = Hash(key);
+  const uint16_t tag = Tag(h);
+  const size_t b1 = h % table->size;
+  for (size_t b : {b1, AltBucket(table, b1, tag)}) {
+    Bucket* bucket = &table->buckets[b];
+    PmemNode* candidates[kSlots];
+    int num_candidates;
+    uint32_t v;
+    do {
+      v = bucket->version.load(std::memory_order_acquire);
+      if (v & 1) {
+        _mm_pause();
+        continue;
+      }
+      num_candidates = 0;
+      uint32_t match = MatchTags(bucket, tag);
+      while (match) {
+        int i = __builtin_ctz(match) / 2;
+        match &= ~(3u << (2 * i));
+        candidates[num_candidates++] = bucket->values[i].load(std::memory_order_relaxed);
+      }
+      std::atomic_thread_fence(std::memory_order_acquire);
+    } while ((v & 1) || bucket->version.load(std::memory_order_relaxed) != v);
+
+    for (int i = 0; i < num_candidates; i++) {
+      if (candidates[i]->key.Compare(key) == 0) {
+        return candidates[i];
+      }
+    }
+  }
+  return nullptr;
+}
+
+void CuckooCache::Erase(const Key& key, PmemNode* const p) {
+  Table* table = table_.load(std::memory_order_acquire);
+  const uint64_t h = Hash(key);
+  const uint16_t tag = Tag(h);
+  const size_t b1 = h % table->size;
+  for (size_t b : {b1, AltBucket(table, b1, tag)}) {
+    Bucket* bucket = &table->buckets[b];
+    Lock(bucket);
+    uint32_t match = MatchTags(bucket, tag);
+    while (match) {
+      int i = __builtin_ctz(match) / 2;
+      match &= ~(3u << (2 * i));
+      if (bucket->values[i].load(std::memory_order_relaxed) == p) {
+        bucket->tags[i] = 0;
+        bucket->values[i].store(nullptr, std::memory_order_relaxed);
+      }
+    }
+    Unlock(bucket);
+  }
+}
+
+void CuckooCache::Resize(const size_t size, EpochManager* epoch_manager) {
+  Table* old_table = table_.load();
+  Table* new_table = new Table(std::max<size_t>(size / kSlots, 1));
+  for (size_t b = 0; b < old_table->size; b++) {
+    Bucket* bucket = &old_table->buckets[b];
+    for (int i = 0; i < kSlots; i++) {
+      PmemNode* p = bucket->values[i].load(std::memory_order_relaxed);
+      if (bucket->tags[i] != 0 && p) {
+        Insert(new_table, p->key, p);
+      }
+    }
+  }
+  table_.store(new_table, std::memory_order_release);
+  epoch_manager->Retire([old_table] { delete old_table; });
+}
@@ -1,7 +1,9 @@
 #pragma once
 
 #include "listdb/common.h"
+#include "listdb/core/cache_table.h"
 #include "listdb/index/braided_pmem_skiplist.h"
+#include "listdb/lib/epoch.h"
 #include "listdb/lib/murmur3.h"
 #include "listdb/lib/sha1.h"
 
@@ -21,63 +23,104 @@ class DoubleHashingCache {
     Bucket() : value(nullptr) { }
   };
 
+  using Table = CacheTable<Bucket>;
+
+  static constexpr size_t kEntrySize = sizeof(Bucket);
+
   DoubleHashingCache(size_t size, int shard);
 
-  Bucket* at(const int i) { return &(buckets_[i]); }
+  ~DoubleHashingCache();
 
+  Bucket* at(const int i) { return &(table_.load()->buckets[i]); }
+
+  // Replaces the cached node of the key if any
   void Insert(const Key& key, PmemNode* const p);
 
   PmemNode* Lookup(const Key& key);
 
+  // Drops the entry of the key if it still caches p
+  void Erase(const Key& key, PmemNode* const p);
+
+  size_t size() { return table_.load()->size; }
+
+  // Rehashes the entries into a new table of the given size. Must not run
+  // concurrently with Insert or Erase.
+  void Resize(const size_t size, EpochManager* epoch_manager);
+
   uint32_t Hash1(const Key& key);
 
   uint32_t Hash2(const Key& key);
 
  private:
+  void Insert(Table* table, const Key& key, PmemNode* const p);
+
+  // Returns the bucket caching the key and its node
+  Bucket* Find(Table* table, const Key& key, PmemNode** node_out);
+
   const static int probing_distance_ = 1;
 
-  const size_t size_;
   const int shard_;
   const uint32_t seed_;
-  Bucket* buckets_;
+  std::atomic<Table*> table_;
 };
 
 DoubleHashingCache::DoubleHashingCache(size_t size, int shard)
-  : size_(size), shard_(shard), seed_(std::hash<int>()(shard_)) {
-  buckets_ = new Bucket[size];
+  : shard_(shard), seed_(std::hash<int>()(shard_)), table_(new Table(size)) {
   std::atomic_thread_fence(std::memory_order_seq_cst);
 }
 
+DoubleHashingCache::~DoubleHashingCache() {
+  delete table_.load();
+}
+
 void DoubleHashingCache::Insert(const Key& key, PmemNode* const p) {
+  Insert(table_.load(std::memory_order_acquire), key, p);
+}
+
+void DoubleHashingCache::Insert(Table* table, const Key& key, PmemNode* const p) {
+  PmemNode* cached;
+  Bucket* found = Find(table, key, &cached);
+  if (found) {
+    // Otherwise a lookup may find the older version first. Flushes of a
+    // shard may finish out of order, so a newer version stays.
+    while (cached == nullptr || cached->key.Compare(key) != 0 || !SeqNewer(cached->seq(), p->seq())) {
+      if (found->value.compare_exchange_weak(cached, p)) {
+        break;
+      }
+    }
+    return;
+  }
+  const size_t size = table->size;
+  Bucket* buckets = table->buckets;
 #if LISTDB_DOUBLE_HASHING == DOUBLE_HASHING_T_A
   uint32_t h = Hash1(key);
-  uint32_t pos = h % size_;
-  PmemNode* old_value = buckets_[pos].value.load(std::memory_order_seq_cst);
+  uint32_t pos = h % size;
+  PmemNode* old_value = buckets[pos].value.load(std::memory_order_seq_cst);
   if (old_value != nullptr) {
-    uint32_t pos2 = (h + Hash2(key)) % size_;
-    buckets_[pos2].value.store(old_value, std::memory_order_seq_cst);
+    uint32_t pos2 = (h + Hash2(key)) % size;
+    buckets[pos2].value.store(old_value, std::memory_order_seq_cst);
   }
-  buckets_[pos].value.store(p, std::memory_order_seq_cst);
+  buckets[pos].value.store(p, std::memory_order_seq_cst);
 #elif LISTDB_DOUBLE_HASHING == DOUBLE_HASHING_T_B
   uint32_t h = Hash1(key);
-  uint32_t pos = h % size_;
+  uint32_t pos = h % size;
   PmemNode* expected = nullptr;
-  if (buckets_[pos].value.compare_exchange_strong(expected, p)) {
+  if (buckets[pos].value.compare_exchange_strong(expected, p)) {
     return;
   }
   uint32_t h2 = Hash2(key);
   unsigned int cnt = 1;
-  pos = (h + cnt * h2) % size_;
+  pos = (h + cnt * h2) % size;
   while (cnt < probing_distance_) {
     expected = nullptr;
-    if (buckets_[pos].value.compare_exchange_strong(expected, p)) {
+    if (buckets[pos].value.compare_exchange_strong(expected, p)) {
       return;
     } else {
       cnt++;
-      pos = (h + cnt * h2) % size_;
+      pos = (h + cnt * h2) % size;
     }
   }
-  buckets_[pos].value.store(p, std::memory_order_seq_cst);
+  buckets[pos].value.store(p, std::memory_order_seq_cst);
 #else
   fprintf(stderr, "DEFINE LISTDB_DOUBLE_HASHING <type>\n");
   abort();
@@ -85,34 +128,70 @@ void DoubleHashingCache::Insert(const Key& key, PmemNode* const p) {
 }
 
 DoubleHashingCache::PmemNode* DoubleHashingCache::Lookup(const Key& key) {
+  PmemNode* cached;
+  if (Find(table_.load(std::memory_order_acquire), key, &cached)) {
+    return cached;
+  }
+  return nullptr;
+}
+
+void DoubleHashingCache::Erase(const Key& key, PmemNode* const p) {
+  PmemNode* cached;
+  Bucket* found = Find(table_.load(std::memory_order_acquire), key, &cached);
+  if (found && cached == p) {
+    found->value.compare_exchange_strong(cached, nullptr);
+  }
+}
+
+void DoubleHashingCache::Resize(const size_t size, EpochManager* epoch_manager) {
+  Table* old_table = table_.load();
+  Table* new_table = new Table(size);
+  for (size_t i = 0; i < old_table->size; i++) {
+    PmemNode* p = old_table->buckets[i].value.load(std::memory_order_relaxed);
+    if (p) {
+      Insert(new_table, p->key, p);
+    }
+  }
+  table_.store(new_table, std::memory_order_release);
+  epoch_manager->Retire([old_table] { delete old_table; });
+}
+
+inline DoubleHashingCache::Bucket* DoubleHashingCache::Find(Table* table, const Key& key,
+                                                            PmemNode** node_out) {
+  const size_t size = table->size;
+  Bucket* buckets = table->buckets;
 #if LISTDB_DOUBLE_HASHING == DOUBLE_HASHING_T_A
   uint32_t h = Hash1(key);
-  uint32_t pos = h % size_;
-  PmemNode* value = buckets_[pos].value.load(std::memory_order_seq_cst);
+  uint32_t pos = h % size;
+  PmemNode* value = buckets[pos].value.load(std::memory_order_seq_cst);
   if (value && value->key.Compare(key) == 0) {
-    return value;
+    *node_out = value;
+    return &buckets[pos];
   } else {
-    uint32_t pos2 = (h + Hash2(key)) % size_;
-    PmemNode* value = buckets_[pos2].value.load(std::memory_order_seq_cst);
+    uint32_t pos2 = (h + Hash2(key)) % size;
+    PmemNode* value = buckets[pos2].value.load(std::memory_order_seq_cst);
     if (value && value->key.Compare(key) == 0) {
-      return value;
+      *node_out = value;
+      return &buckets[pos2];
     }
   }
   return nullptr;
 #elif LISTDB_DOUBLE_HASHING == DOUBLE_HASHING_T_B
   uint32_t h = Hash1(key);
-  uint32_t pos = h % size_;
-  PmemNode* value = buckets_[pos].value.load(std::memory_order_seq_cst);
+  uint32_t pos = h % size;
+  PmemNode* value = buckets[pos].value.load(std::memory_order_seq_cst);
   if (value && value->key.Compare(key) == 0) {
-    return value;
+    *node_out = value;
+    return &buckets[pos];
   } else {
     uint32_t h2 = Hash2(key);
     unsigned int cnt = 1;
     while (cnt <= probing_distance_) {
-      pos = (h + cnt * h2) % size_;
-      value = buckets_[pos].value.load(std::memory_order_seq_cst);
+      pos = (h + cnt * h2) % size;
+      value = buckets[pos].value.load(std::memory_order_seq_cst);
       if (value && value->key.Compare(key) == 0) {
-        return value;
+        *node_out = value;
+        return &buckets[pos];
       } else {
         cnt++;
         continue;
@@ -132,7 +211,7 @@ inline uint32_t DoubleHashingCache::Hash1(const Key& key) {
 #ifndef LISTDB_STRING_KEY
 	MurmurHash3_x86_32(&key, sizeof(uint64_t), seed_, (void*) &h);
 #else
-	MurmurHash3_x86_32(key.data(), kStringKeyLength, seed_, (void*) &h);
+	MurmurHash3_x86_32(key.data(), key.size(), seed_, (void*) &h);
 #endif
 	return h;
 }
@@ -142,7 +221,7 @@ inline uint32_t DoubleHashingCache::Hash2(const Key& key) {
 #ifndef LISTDB_STRING_KEY
 	SHA1(result, (char*) &key, 8);
 #else
-	SHA1(result, key.data(), kStringKeyLength);
+	SHA1(result, key.data(), key.size());
 #endif
 	return *reinterpret_cast<uint32_t*>(result);
 }
@@ -20,6 +20,11 @@ class FixedLengthStringKey {
 
   bool Valid() const { return *((uint64_t*) data_) != 0; }
 
+  // Keys are stored inline in nodes
+  size_t out_of_line_size() const { return 0; }
+  FixedLengthStringKey<N> StoreOutOfLine(const int pool_id, char* dst) const { return *this; }
+  FixedLengthStringKey<N> OutOfLineAt(const int pool_id, const char* dst) const { return *this; }
+
   bool operator==(const FixedLengthStringKey<N>& other) const;
 
  private:
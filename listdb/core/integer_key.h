@@ -16,6 +16,11 @@ class IntegerKey {
 
   bool Valid() const { return data_ != 0; }
 
+  // Keys are stored inline in nodes
+  size_t out_of_line_size() const { return 0; }
+  IntegerKey StoreOutOfLine(const int pool_id, char* dst) const { return *this; }
+  IntegerKey OutOfLineAt(const int pool_id, const char* dst) const { return *this; }
+
  private: 
   uint64_t data_;
 };
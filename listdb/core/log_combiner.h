@@ -0,0 +1,232 @@
+#ifndef LISTDB_CORE_LOG_COMBINER_H_
+#define LISTDB_CORE_LOG_COMBINER_H_
+
+#include <atomic>
+#include <cstring>
+#include <string_view>
+#include <vector>
+
+#include <x86intrin.h>
+
+#include "listdb/common.h"
+#include "listdb/core/pmem_log.h"
+#include "listdb/index/braided_pmem_skiplist.h"
+#include "listdb/lib/memory.h"
+#include "listdb/pmem/persistence.h"
+#include "listdb/util.h"
+#include "listdb/util/clock.h"
+
+// Group commit of IUL entries by flat combining.
+// A writer publishes its entry in the slot of its client index. Whoever
+// takes the combiner lock appends every published entry as one contiguous
+// run of the log, with one flush run and one fence for the whole group,
+// and the other writers only wait for their slot to be done.
+// With nt_store, a group is built in a DRAM staging buffer and copied with
+// non-temporal stores, so that it reaches PMem in whole lines. This only
+// applies to PersistenceMode::kADR, as the other modes do not flush.
+class LogCombiner {
+ public:
+  using PmemNode = BraidedPmemSkipList::Node;
+
+  struct Entry {
+    Key key;
+    uint64_t tag;
+    Value value;
+    std::string_view inline_value;
+    int height;
+    size_t size;  // IUL entry size
+  };
+
+  // wait_usec bounds how long a combiner waits for more writers to join
+  // before writing a group. The wait ends early once no writer has joined
+  // for kJoinGapNanos.
+  LogCombiner(PmemLog* log, const int num_slots, const uint64_t wait_usec = 0,
+              const bool nt_store = false,
+              const PersistenceMode persistence = PersistenceMode::kADR);
+
+  LogCombiner(const LogCombiner&) = delete;
+  LogCombiner& operator=(const LogCombiner&) = delete;
+
+  // Appends the entry and returns its address once it is persisted.
+  // A slot must not be used by two writers at a time.
+  PmemPtr Append(const int slot_id, const Entry& entry);
+
+  // Builds the entry but its key in stage, for the entry to be copied to
+  // dst. Returns the key to store at dst. stage must be zeroed.
+  static Key StageEntry(const Entry& entry, const int pool_id, char* stage,
+                        const char* dst);
+
+ private:
+  static constexpr uint64_t kJoinGapNanos = 1000;
+
+  enum SlotState { kIdle, kPending, kDone };
+
+  struct alignas(64) Slot {
+    std::atomic<int> state{kIdle};
+    const Entry* entry;
+    PmemPtr paddr;
+  };
+
+  template <typename Persistence>
+  void Combine(Slot* own);
+
+  PmemLog* log_;
+  const int num_slots_;
+  const uint64_t wait_usec_;
+  const bool nt_store_;
+  void (LogCombiner::*combine_fn_)(Slot* own);
+  std::vector<Slot> slots_;
+  alignas(64) std::atomic<bool> combining_{false};
+  std::atomic<int> num_pending_{0};
+  // Only accessed by the combiner
+  std::vector<Slot*> group_;
+  std::vector<Key> group_keys_;
+  std::vector<char> stage_;
+};
+
+LogCombiner::LogCombiner(PmemLog* log, const int num_slots, const uint64_t wait_usec,
+                         const bool nt_store, const PersistenceMode persistence)
+    : log_(log),
+      num_slots_(num_slots),
+      wait_usec_(wait_usec),
+      nt_store_(nt_store && persistence == PersistenceMode::kADR),
+      slots_(num_slots) {
+  combine_fn_ = WithPersistence(persistence, [](auto p) { return &LogCombiner::Combine<decltype(p)>; });
+  group_.reserve(num_slots);
+  group_keys_.reserve(num_slots);
+}
+
+inline PmemPtr LogCombiner::Append(const int slot_id, const Entry& entry) {
+  Slot* slot = &slots_[slot_id];
+  slot->entry = &entry;
+  slot->state.store(kPending, std::memory_order_release);
+  num_pending_.fetch_add(1, std::memory_order_relaxed);
+  while (slot->state.load(std::memory_order_acquire) != kDone) {
+    if (!combining_.load(std::memory_order_relaxed) &&
+        !combining_.exchange(true, std::memory_order_acquire)) {
+      // The slot may have been done by the previous combiner meanwhile
+      if (slot->state.load(std::memory_order_acquire) != kDone) {
+        (this->*combine_fn_)(slot);
+      }
+      combining_.store(false, std::memory_order_release);
+      break;
+    }
+    _mm_pause();
+  }
+  slot->state.store(kIdle, std::memory_order_relaxed);
+  return slot->paddr;
+}
+
+inline Key LogCombiner::StageEntry(const Entry& entry, const int pool_id, char* stage,
+                                  const char* dst) {
+  PmemNode* staged = (PmemNode*) stage;
+  staged->tag = entry.tag;
+  staged->value = entry.value;
+  char* data_p = (char*) &staged->next[entry.height];
+  if (entry.key.out_of_line_size() > 0) {
+    memcpy(data_p, entry.key.data(), entry.key.size());
+  }
+  Key stored_key = entry.key.OutOfLineAt(pool_id, dst + (data_p - stage));
+  data_p += entry.key.out_of_line_size();
+  if (!entry.inline_value.empty()) {
+    memcpy(data_p, entry.inline_value.data(), entry.inline_value.size());
+  }
+  return stored_key;
+}
+
+template <typename Persistence>
+void LogCombiner::Combine(Slot* own) {
+  if (wait_usec_ > 0) {
+    // Few writers rarely fill every slot, so the wait also ends once they
+    // stop joining
+    uint64_t now = Clock::NowNanos();
+    const uint64_t deadline = now + wait_usec_ * 1000;
+    uint64_t last_join = now;
+    int num_pending = num_pending_.load(std::memory_order_relaxed);
+    while (num_pending < num_slots_ && now < deadline && now - last_join < kJoinGapNanos) {
+      _mm_pause();
+      now = Clock::NowNanos();
+      const int n = num_pending_.load(std::memory_order_relaxed);
+      if (n != num_pending) {
+        num_pending = n;
+        last_join = now;
+      }
+    }
+  }
+
+  // Collect the group. The writer of the combiner goes first, and a group
+  // never exceeds a log block.
+  group_.clear();
+  group_.push_back(own);
+  size_t total_size = own->entry->size;
+  for (auto& slot : slots_) {
+    if (&slot == own || slot.state.load(std::memory_order_acquire) != kPending) {
+      continue;
+    }
+    if (total_size + slot.entry->size > log_->block_size()) {
+      break;
+    }
+    group_.push_back(&slot);
+    total_size += slot.entry->size;
+  }
+  num_pending_.fetch_sub(group_.size(), std::memory_order_relaxed);
+
+  auto group_paddr = log_->Allocate(total_size);
+  const int pool_id = group_paddr.pool_id();
+  char* base = (char*) group_paddr.get();
+
+  // Everything but the keys, which mark the entries valid
+  group_keys_.clear();
+  size_t offset = 0;
+  constexpr bool kAdr = Persistence::kMode == PersistenceMode::kADR;
+  if (kAdr && nt_store_) {
+    stage_.assign(total_size, 0);
+    for (auto slot : group_) {
+      group_keys_.push_back(StageEntry(*slot->entry, pool_id, stage_.data() + offset, base + offset));
+      offset += slot->entry->size;
+    }
+    memcpy_nt(base, stage_.data(), total_size);
+  } else {
+    for (auto slot : group_) {
+      auto& entry = *slot->entry;
+      PmemNode* iul_entry = (PmemNode*) (base + offset);
+      char* data_p = (char*) &iul_entry->next[entry.height];
+      group_keys_.push_back(entry.key.StoreOutOfLine(pool_id, data_p));
+      data_p += entry.key.out_of_line_size();
+      if (!entry.inline_value.empty()) {
+        memcpy(data_p, entry.inline_value.data(), entry.inline_value.size());
+      }
+      iul_entry->tag = entry.tag;
+      iul_entry->value = entry.value;
+      offset += entry.size;
+    }
+    char* flush_begin = (char*) ((uintptr_t) base & ~63ull);
+    Persistence::Flush(flush_begin, base + total_size - flush_begin);
+  }
+  Persistence::Fence();
+
+  offset = 0;
+  for (size_t i = 0; i < group_.size(); i++) {
+    PmemNode* iul_entry = (PmemNode*) (base + offset);
+    if (kAdr && nt_store_) {
+      store_words_nt(&iul_entry->key, &group_keys_[i], sizeof(Key));
+    } else {
+      iul_entry->key = group_keys_[i];
+      Persistence::Flush(&iul_entry->key, sizeof(Key));
+    }
+    group_[i]->paddr = PmemPtr(pool_id, (char*) iul_entry);
+    offset += group_[i]->entry->size;
+  }
+  if (kAdr && nt_store_) {
+    // Orders the keys before the writers publish the entries
+    _mm_sfence();
+  }
+
+  for (auto slot : group_) {
+    if (slot != own) {
+      slot->state.store(kDone, std::memory_order_release);
+    }
+  }
+}
+
+#endif  // LISTDB_CORE_LOG_COMBINER_H_
@@ -1,21 +1,28 @@
 #ifndef LISTDB_CORE_LRU_SKIPLIST_H_
 #define LISTDB_CORE_LRU_SKIPLIST_H_
 
-#define MUTEX mutex
-#define MUTEX_HEADER <MUTEX>
-#include MUTEX_HEADER
+#include <atomic>
+#include <cstdlib>
+#include <cstring>
+#include <new>
 
 #include "listdb/common.h"
-#include "listdb/index/lockfree_skiplist.h"
-
+#include "listdb/lib/epoch.h"
+#include "listdb/util.h"
+
+// DRAM skiplist of L1 search shortcuts within a byte budget.
+// Lookups are lock-free and only set the reference bit of the node they
+// return. The single writer, i.e. the compaction of the shard, evicts nodes
+// in CLOCK order: the hand sweeps the bottom layer, clearing set reference
+// bits and evicting the first node found without one. Evicted nodes are
+// retired through the epoch manager, so readers must hold an epoch.
 class LruSkipList {
  public:
   struct Node {
     Key key;       // integer value or offset
-    uint64_t tag;  // seqorder (52-bit), op (4-bit), height (8-bit)
-    uint64_t value;     // integer value or offset, (SHORTCUT: pointer to next memtable node)
-    Node* lru_next;
-    Node* lru_prev;
+    uint64_t tag;  // height (8-bit)
+    uint64_t value;     // PmemPtr of the L1 node
+    std::atomic<bool> referenced;
     std::atomic<Node*> next[1];
 
 #ifndef LISTDB_STRING_KEY
@@ -25,46 +32,77 @@ class LruSkipList {
 #endif
 
     static size_t compute_alloc_size(const Key& key, const int height) {
-      return aligned_size(8, sizeof(Node) + (height-1)*8);
+      return util::AlignedSize(8, sizeof(Node) + (height-1)*8);
     }
 
     int height() const { return tag & 0xff; }
-    size_t alloc_size() const { return sizeof(Node) + (height() - 1) * 8; }
-    uint8_t type() const { return ValueType((tag & 0xf00) >> 4); }
+    size_t alloc_size() const { return compute_alloc_size(key, height()); }
     char* data() const { return (char*) this; }
   };
 
-  LruSkipList(const size_t capacity);
+  // capacity: in bytes
+  LruSkipList(const size_t capacity, EpochManager* epoch_manager);
+
+  ~LruSkipList();
 
   // Returns cached value of the largest key among keys less than a given key
   // Returns 0 if the found result is head node of the SkipList
   uint64_t FindLessThan(const Key& key);
 
+  // Not thread-safe against other writers. Evicts nodes to stay within the
+  // capacity.
   void Insert(const Key& key, const uint64_t value, const int height);
 
+  // Drops the shortcut to an L1 node about to be unlinked
+  void Erase(const Key& key, const uint64_t value);
+
+  // Bytes of the nodes, including the head
+  size_t MemoryUsage() const { return size_.load(std::memory_order_relaxed); }
+
  private:
-  void FindPosition(Node* node, Node* preds[], Node* succs[]);
+  Node* NewNode(const Key& key, const uint64_t value, const int height);
+
+  void FindPosition(const Key& key, Node* preds[], Node* succs[]);
+
+  // Evicts one node. Returns false if the cache is empty.
+  bool EvictOne();
+
+  void Unlink(Node* node);
 
-  const size_t capacity_;  // in number of nodes
-  size_t size_;  // in number of nodes
+  const size_t capacity_;
+  std::atomic<size_t> size_;
+  EpochManager* epoch_manager_;
   Node* head_;
-  std::MUTEX mu_;
+  // Next node the clock hand visits, nullptr to start over from the front
+  Node* hand_ = nullptr;
 };
 
-LruSkipList::LruSkipList(const size_t capacity) : capacity_(capacity), size_(0) {
-  // Init head
-  size_t node_size = sizeof(Node) + (kLruMaxHeight - 1) * 8;
-  Node* new_node = (Node*) aligned_alloc(8, node_size);
+LruSkipList::LruSkipList(const size_t capacity, EpochManager* epoch_manager)
+    : capacity_(capacity), size_(0), epoch_manager_(epoch_manager) {
+  head_ = NewNode(Node::head_key(), 0, kLruMaxHeight);
+  std::atomic_thread_fence(std::memory_order_release);
+}
 
-  new_node->key = Node::head_key();
-  new_node->tag = kLruMaxHeight & 0xff;
-  new_node->value = 0;
-  memset(new_node->next, 0, kLruMaxHeight * 8);
+LruSkipList::~LruSkipList() {
+  Node* node = head_;
+  while (node) {
+    Node* next = node->next[0].load(std::memory_order_relaxed);
+    free(node);
+    node = next;
+  }
+}
 
-  head_ = new_node;
-  head_->lru_next = head_;
-  head_->lru_prev = head_;
-  std::atomic_thread_fence(std::memory_order_release);
+inline LruSkipList::Node* LruSkipList::NewNode(const Key& key, const uint64_t value,
+                                               const int height) {
+  const size_t node_size = Node::compute_alloc_size(key, height);
+  Node* node = (Node*) aligned_alloc(8, node_size);
+  node->key = key;
+  node->tag = height & 0xff;
+  node->value = value;
+  new (&node->referenced) std::atomic<bool>(false);
+  memset((void*) node->next, 0, height * 8);
+  size_.fetch_add(node_size, std::memory_order_relaxed);
+  return node;
 }
 
 uint64_t LruSkipList::FindLessThan(const Key& key) {
@@ -73,7 +111,7 @@ uint64_t LruSkipList::FindLessThan(const Key& key) {
   int h = pred->height();
   for (int l = h - 1; l >= 0; l--) {
     while (true) {
-      curr = pred->next[l].load(std::memory_order_relaxed);
+      curr = pred->next[l].load(std::memory_order_acquire);
       if (curr && curr->key.Compare(key) < 0) {
         pred = curr;
         continue;
@@ -81,81 +119,58 @@ uint64_t LruSkipList::FindLessThan(const Key& key) {
       break;
     }
   }
-  
-  if (pred != head_) {
-    // Move found node to MRU position
-    std::unique_lock<std::MUTEX> lk(mu_); 
-    auto tail = head_->lru_prev;
-    if (pred != tail) {
-      pred->lru_prev->lru_next = pred->lru_next;
-      pred->lru_next->lru_prev = pred->lru_prev;
-
-      head_->lru_prev = pred;  // pred at tail
-      pred->lru_next = head_;
-
-      pred->lru_prev = tail;
-      tail->lru_next = pred;
-    }
-    lk.unlock();
+
+  // Checked first to keep the cache line of a hot node shared
+  if (pred != head_ && !pred->referenced.load(std::memory_order_relaxed)) {
+    pred->referenced.store(true, std::memory_order_relaxed);
   }
   return pred->value;
 }
 
 void LruSkipList::Insert(const Key& key, const uint64_t value, const int height) {
-  // Alloc SkipList node and LRU list node
-  size_t node_size = sizeof(Node) + (height - 1) * 8;
-  Node* new_node = (Node*) aligned_alloc(8, node_size);
-
-  // Init SkipList node
-  new_node->key = key;
-  new_node->tag = height & 0xff;
-  new_node->value = value;
-  memset(new_node->next, 0, height * 8);
-
-  // TODO: Evict
-
-  // Insert new LRU node at MRU position
-  std::unique_lock<std::MUTEX> lk(mu_); 
-  auto tail = head_->lru_prev;
-
-  head_->lru_prev = new_node;
-  new_node->lru_next = head_;
+  const size_t node_size = Node::compute_alloc_size(key, height);
+  while (size_.load(std::memory_order_relaxed) + node_size > capacity_) {
+    if (!EvictOne()) {
+      // Smaller than a node
+      return;
+    }
+  }
+  Node* new_node = NewNode(key, value, height);
 
-  new_node->lru_prev = tail;
-  tail->lru_next = new_node;
-  lk.unlock();
+  Node* preds[kLruMaxHeight];
+  Node* succs[kLruMaxHeight];
+  FindPosition(key, preds, succs);
+  for (int l = 0; l < height; l++) {
+    new_node->next[l].store(succs[l], std::memory_order_relaxed);
+  }
+  // Linked bottom-up, so a reader finding the node finds its successors
+  for (int l = 0; l < height; l++) {
+    preds[l]->next[l].store(new_node, std::memory_order_release);
+  }
+}
 
-  // Insert new node into SkipList
+void LruSkipList::Erase(const Key& key, const uint64_t value) {
   Node* preds[kLruMaxHeight];
   Node* succs[kLruMaxHeight];
-  while (true) {
-    FindPosition(new_node, preds, succs);
-    for (int l = 0; l < new_node->height(); l++) {
-      new_node->next[l].store(succs[l], std::memory_order_relaxed);
-    }
-    if (!preds[0]->next[0].compare_exchange_strong(succs[0], new_node)) {
-      continue;
+  FindPosition(key, preds, succs);
+  Node* node = succs[0];
+  while (node && node->key.Compare(key) == 0) {
+    if (node->value == value) {
+      Unlink(node);
+      return;
     }
-    for (int l = 1; l < new_node->height(); l++) {
-      while (true) {
-        if (preds[l]->next[l].compare_exchange_strong(succs[l], new_node)) {
-          break;
-        }
-        FindPosition(new_node, preds, succs);
-      }
-    }
-    break;
+    node = node->next[0].load(std::memory_order_relaxed);
   }
 }
 
-void LruSkipList::FindPosition(Node* node, Node* preds[], Node* succs[]) {
+void LruSkipList::FindPosition(const Key& key, Node* preds[], Node* succs[]) {
   Node* pred = head_;
   Node* curr = nullptr;
   int h = pred->height();
   for (int l = h - 1; l >= 0; l--) {
     while (true) {
       curr = pred->next[l].load(std::memory_order_relaxed);
-      if (curr && curr->key.Compare(node->key) < 0) {
+      if (curr && curr->key.Compare(key) < 0) {
         pred = curr;
         continue;
       }
@@ -166,4 +181,53 @@ void LruSkipList::FindPosition(Node* node, Node* preds[], Node* succs[]) {
   }
 }
 
+bool LruSkipList::EvictOne() {
+  // Two rounds at most: the first one clears every reference bit
+  Node* first = head_->next[0].load(std::memory_order_relaxed);
+  if (first == nullptr) {
+    return false;
+  }
+  while (true) {
+    if (hand_ == nullptr) {
+      hand_ = first;
+    }
+    Node* node = hand_;
+    hand_ = node->next[0].load(std::memory_order_relaxed);
+    if (node->referenced.load(std::memory_order_relaxed)) {
+      node->referenced.store(false, std::memory_order_relaxed);
+      continue;
+    }
+    Unlink(node);
+    return true;
+  }
+}
+
+void LruSkipList::Unlink(Node* node) {
+  if (hand_ == node) {
+    hand_ = node->next[0].load(std::memory_order_relaxed);
+  }
+  Node* pred = head_;
+  for (int l = kLruMaxHeight - 1; l >= 0; l--) {
+    Node* curr = pred->next[l].load(std::memory_order_relaxed);
+    while (curr && curr->key.Compare(node->key) < 0) {
+      pred = curr;
+      curr = pred->next[l].load(std::memory_order_relaxed);
+    }
+    if (l >= node->height()) {
+      continue;
+    }
+    // Skip other shortcuts of the same key
+    Node* upper_pred = pred;
+    while (curr != node) {
+      upper_pred = curr;
+      curr = upper_pred->next[l].load(std::memory_order_relaxed);
+    }
+    // Readers on the node still move on through its next pointers
+    upper_pred->next[l].store(node->next[l].load(std::memory_order_relaxed),
+                              std::memory_order_release);
+  }
+  size_.fetch_sub(node->alloc_size(), std::memory_order_relaxed);
+  epoch_manager_->Retire([node] { free(node); });
+}
+
 #endif  // LISTDB_CORE_LRU_SKIPLIST_H_
@@ -18,9 +18,33 @@ enum class Level0Status {
   kMergeDone,
 };
 
+// ListDB::Options without the path
+struct pmem_db_options {
+  uint64_t num_shards;
+  uint64_t num_workers;
+  uint64_t memtable_capacity;
+  uint64_t max_num_memtables;
+  uint64_t l0_cache_budget;
+};
+
+// Version of the persistent format, checked at Open. Bumped whenever the
+// layout of a persistent structure or of an IUL entry changes.
+//   1: 16-bit l0_id in the tags of IUL entries
+//   2: Sized log blocks with separate data, and a free block list per log
+//   3: Ids of the log and value pools in pmem_db
+constexpr uint64_t kPmemFormatVersion = 3;
+
 struct pmem_db {
   // TODO: place pointer to shard info here
   pmem::obj::persistent_ptr<pmem_db_shard> shard[kNumShards];
+  // Every logged seqorder is below this
+  uint64_t seq_reserved;
+  pmem_db_options options;
+  uint64_t format_version;
+  // Ids the pools were bound at by Init. Logged PmemPtrs carry them, so Open
+  // binds the pools at the same ids.
+  uint64_t log_pool_id[kNumRegions];
+  uint64_t value_pool_id[kNumRegions];
 };
 
 struct pmem_db_shard {
@@ -2,6 +2,7 @@
 #define LISTDB_CORE_PMEM_LOG_H_
 
 #include <functional>
+#include <libpmemobj++/make_persistent_array_atomic.hpp>
 #include <libpmemobj++/make_persistent_atomic.hpp>
 #include <libpmemobj++/p.hpp>
 #include <libpmemobj++/persistent_ptr.hpp>
@@ -36,16 +37,21 @@ struct pmem_log_root {
 struct pmem_log {
   uint32_t block_cnt;
   pmem::obj::persistent_ptr<pmem_log_block> head;
+  // Blocks allocated ahead by Refill, linked through next. They are kept
+  // across an open.
+  pmem::obj::persistent_ptr<pmem_log_block> free_head;
 };
 
+// Blocks of a log may differ in size. The data is zeroed on allocation.
 struct pmem_log_block {
   uint32_t id;
   size_t p;
-  char data[kPmemLogBlockSize];
+  size_t size;
+  pmem::obj::persistent_ptr<char[]> data;
   pmem::obj::persistent_ptr<pmem_log_block> next;
 
   pmem_log_block(pmem::obj::persistent_ptr<pmem_log_block> next_ = nullptr)
-      : p(0), data(), next(next_) {}
+      : p(0), size(0), next(next_) {}
 };
 
 // PmemLog
@@ -54,6 +60,7 @@ class PmemLog {
  public:
   struct Block {
     std::atomic<size_t> p;  // current end
+    size_t size;
     char* data;             // pointer to pmem_log_block::data
     pmem::obj::persistent_ptr<pmem_log_block> p_block;
 
@@ -61,47 +68,83 @@ class PmemLog {
     void* Allocate(const size_t size);
   };
 
-  PmemLog(const int pool_id, const int shard_id);
+  // Number of free blocks kept ready by Refill
+  static constexpr size_t kNumFreeBlocks = 4;
 
-  PmemLog(const int pool_id, const int shard_id, PmemAllocator& pmem);
+  // New blocks are block_size bytes. Blocks written before an open keep the
+  // size they were allocated with.
+  PmemLog(const int pool_id, const int shard_id,
+          const size_t block_size = kPmemLogBlockSize);
+
+  PmemLog(const int pool_id, const int shard_id, PmemAllocator& pmem,
+          const size_t block_size = kPmemLogBlockSize);
 
   ~PmemLog();
 
+  // size must not exceed the block size
   PmemPtr Allocate(const size_t size);
 
+  // The function is called to have Refill run in the background. Without it,
+  // a block is allocated when the current one is full.
+  void BindRefillFunction(std::function<void()> refill_fn);
+
+  // Allocates free blocks until kNumFreeBlocks are ready
+  void Refill();
+
   int pool_id() { return pool_id_; }
 
+  size_t block_size() const { return block_size_; }
+
   pmem::obj::pool<pmem_log_root> pool() { return pool_; }
 
  private:
   Block* GetCurrentBlock();
 
+  // Allocates a block that is not linked to the log yet
+  pmem::obj::persistent_ptr<pmem_log_block> NewBlock();
+
+  // Makes a free block, or a new one if there is none, the current block.
+  // Must be called while holding block_init_mu_.
+  Block* LinkBlock();
+
+  // Counts the free blocks linked in the log. Drops the free list if a
+  // crash interrupted LinkBlock after it linked the first free block.
+  size_t NumFreeBlocks();
+
+  void RequestRefill();
+
   const int pool_id_;
+  const size_t block_size_;
   pmem::obj::pool<pmem_log_root> pool_;  // for memory allocation
   pmem::obj::persistent_ptr<pmem_log> p_log_;
   std::atomic<Block*> front_;
   std::atomic<size_t> hmm;
   std::mutex block_init_mu_;
+  size_t num_free_blocks_ = 0;
+  bool refill_requested_ = false;
+  std::function<void()> refill_fn_;
 };
 
 PmemLog::Block::Block(pmem::obj::persistent_ptr<pmem_log_block> p_block_) {
   assert(p_block_ != nullptr);
   p.store(p_block_->p);
-  data = p_block_->data;
+  size = p_block_->size;
+  data = p_block_->data.get();
   p_block = p_block_;
   std::atomic_thread_fence(std::memory_order_release);
 }
 
 void* PmemLog::Block::Allocate(const size_t size) {
   size_t before = p.fetch_add(size, MO_RELAXED);
-  if (before + size <= kPmemLogBlockSize) {
+  if (before + size <= this->size) {
     return (void*)(data + before);
   } else {
     return nullptr;
   }
 }
 
-PmemLog::PmemLog(const int pool_id, const int shard_id) : pool_id_(pool_id) {
+PmemLog::PmemLog(const int pool_id, const int shard_id, const size_t block_size)
+    : pool_id_(pool_id), block_size_(block_size) {
   auto pool = Pmem::pool<pmem_log_root>(pool_id_);
   pool_ = pool;
   auto root = pool_.root();
@@ -123,14 +166,17 @@ PmemLog::PmemLog(const int pool_id, const int shard_id) : pool_id_(pool_id) {
     };
     auto head_block = init_fn(p_log_->head);
 #else
-    auto head_block = new Block(p_log_->head);
+    // A log that never got a block links its first one on demand
+    auto head_block = (p_log_->head != nullptr) ? new Block(p_log_->head) : nullptr;
 #endif
     front_.store(head_block);
+    num_free_blocks_ = NumFreeBlocks();
   }
 }
 
-PmemLog::PmemLog(const int pool_id, const int shard_id, PmemAllocator& pmem)
-    : pool_id_(pool_id) {
+PmemLog::PmemLog(const int pool_id, const int shard_id, PmemAllocator& pmem,
+                 const size_t block_size)
+    : pool_id_(pool_id), block_size_(block_size) {
   auto pool = pmem.pool<pmem_log_root>(pool_id_);
   pool_ = pool;
   auto root = pool_.root();
@@ -145,35 +191,131 @@ PmemLog::PmemLog(const int pool_id, const int shard_id, PmemAllocator& pmem)
   } else {
     // Open
     p_log_ = root->shard[shard_id];
-    auto head_block = new Block(p_log_->head);
+    auto head_block = (p_log_->head != nullptr) ? new Block(p_log_->head) : nullptr;
     front_.store(head_block);
+    num_free_blocks_ = NumFreeBlocks();
   }
 }
 
 PmemLog::~PmemLog() {
-  auto block = GetCurrentBlock();
+  // Not GetCurrentBlock, which may link a block and ask for a refill after
+  // the workers have stopped
+  auto block = front_.load(MO_RELAXED);
+  if (block == nullptr) {
+    return;
+  }
   block->p_block->p = block->p;
   clwb(&(block->p_block->p), sizeof(size_t));
 }
 
+void PmemLog::BindRefillFunction(std::function<void()> refill_fn) {
+  refill_fn_ = refill_fn;
+  RequestRefill();
+}
+
+pmem::obj::persistent_ptr<pmem_log_block> PmemLog::NewBlock() {
+  pmem::obj::persistent_ptr<pmem_log_block> p_new_block;
+  pmem::obj::make_persistent_atomic<pmem_log_block>(pool_, p_new_block);
+  p_new_block->size = block_size_;
+  pmem::obj::make_persistent_atomic<char[]>(pool_, p_new_block->data,
+                                            block_size_);
+  return p_new_block;
+}
+
+PmemLog::Block* PmemLog::LinkBlock() {
+  pmem::obj::persistent_ptr<pmem_log_block> p_new_block;
+  pmem::obj::persistent_ptr<pmem_log_block> p_next_free;
+  const bool reused = (p_log_->free_head != nullptr);
+  if (reused) {
+    p_new_block = p_log_->free_head;
+    p_next_free = p_new_block->next;
+  } else {
+    p_new_block = NewBlock();
+  }
+  // The block has to point into the log before the head points to it.
+  // A crash before the pop below leaves the block at both heads, which Open
+  // resolves.
+  p_new_block->id = p_log_->block_cnt;
+  p_new_block->next = p_log_->head;
+  clwb(p_new_block.get(), sizeof(pmem_log_block));
+  _mm_sfence();
+  p_log_->block_cnt++;
+  p_log_->head = p_new_block;
+  clwb(p_log_.get(), sizeof(pmem_log));
+  _mm_sfence();
+  if (reused) {
+    p_log_->free_head = p_next_free;
+    clwb(&p_log_->free_head, sizeof(p_log_->free_head));
+    _mm_sfence();
+    num_free_blocks_--;
+  }
+
+  auto new_block = new Block(p_new_block);
+  front_.store(new_block, MO_RELAXED);
+  return new_block;
+}
+
+void PmemLog::RequestRefill() {
+  if (!refill_fn_) {
+    return;
+  }
+  {
+    std::lock_guard<std::mutex> lk(block_init_mu_);
+    if (refill_requested_ || num_free_blocks_ >= kNumFreeBlocks) {
+      return;
+    }
+    refill_requested_ = true;
+  }
+  refill_fn_();
+}
+
+void PmemLog::Refill() {
+  while (true) {
+    {
+      std::lock_guard<std::mutex> lk(block_init_mu_);
+      if (num_free_blocks_ >= kNumFreeBlocks) {
+        refill_requested_ = false;
+        return;
+      }
+    }
+    // Outside the lock, so that writers are not held up by the allocator
+    auto p_new_block = NewBlock();
+    std::lock_guard<std::mutex> lk(block_init_mu_);
+    p_new_block->next = p_log_->free_head;
+    clwb(p_new_block.get(), sizeof(pmem_log_block));
+    _mm_sfence();
+    p_log_->free_head = p_new_block;
+    clwb(&p_log_->free_head, sizeof(p_log_->free_head));
+    _mm_sfence();
+    num_free_blocks_++;
+  }
+}
+
+size_t PmemLog::NumFreeBlocks() {
+  if (p_log_->free_head != nullptr && p_log_->free_head.get() == p_log_->head.get()) {
+    // The block now leads into the log. The rest of the free list is lost.
+    p_log_->free_head = nullptr;
+    clwb(&p_log_->free_head, sizeof(p_log_->free_head));
+    _mm_sfence();
+  }
+  size_t cnt = 0;
+  for (auto p_block = p_log_->free_head; p_block != nullptr; p_block = p_block->next) {
+    cnt++;
+  }
+  return cnt;
+}
+
 PmemLog::Block* PmemLog::GetCurrentBlock() {
   Block* ret = front_.load(MO_RELAXED);
   if (ret == nullptr) {
-    std::lock_guard<std::mutex> lk(block_init_mu_);
-    ret = front_.load(MO_RELAXED);
-    if (ret == nullptr) {
-      pmem::obj::persistent_ptr<pmem_log_block> p_new_block;
-      pmem::obj::make_persistent_atomic<pmem_log_block>(pool_, p_new_block,
-                                                        p_log_->head);
-
-      p_new_block->id = p_log_->block_cnt;
-      p_log_->block_cnt++;
-
-      p_log_->head = p_new_block;
-      auto new_block = new Block(p_new_block);
-      front_.store(new_block, MO_RELAXED);
-      ret = new_block;
+    {
+      std::lock_guard<std::mutex> lk(block_init_mu_);
+      ret = front_.load(MO_RELAXED);
+      if (ret == nullptr) {
+        ret = LinkBlock();
+      }
     }
+    RequestRefill();
   }
   return ret;
 }
@@ -182,22 +324,15 @@ PmemPtr PmemLog::Allocate(const size_t size) {
   Block* block = GetCurrentBlock();
   void* buf = nullptr;
   if ((buf = block->Allocate(size)) == nullptr) {
-    std::lock_guard<std::mutex> lk(block_init_mu_);
-    block = front_.load(MO_RELAXED);
-    if ((buf = block->Allocate(size)) == nullptr) {
-      // TODO: write Block contents to pmem_log_block
-      pmem::obj::persistent_ptr<pmem_log_block> p_new_block;
-      pmem::obj::make_persistent_atomic<pmem_log_block>(pool_, p_new_block,
-                                                        p_log_->head);
-
-      p_new_block->id = p_log_->block_cnt;
-      p_log_->block_cnt++;
-
-      p_log_->head = p_new_block;
-      auto new_block = new Block(p_new_block);
-      front_.store(new_block, MO_RELAXED);
-      buf = new_block->Allocate(size);
+    {
+      std::lock_guard<std::mutex> lk(block_init_mu_);
+      block = front_.load(MO_RELAXED);
+      if ((buf = block->Allocate(size)) == nullptr) {
+        // TODO: write Block contents to pmem_log_block
+        buf = LinkBlock()->Allocate(size);
+      }
     }
+    RequestRefill();
   }
   PmemPtr ret(pool_id_, (uint64_t)((uintptr_t)buf - (uintptr_t)pool_.handle()));
   return ret;
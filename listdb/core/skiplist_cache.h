@@ -6,12 +6,17 @@
 
 #include "listdb/common.h"
 #include "listdb/index/braided_pmem_skiplist.h"
+#include "listdb/lib/epoch.h"
 #include "listdb/util.h"
 #include "listdb/util/random.h"
 
-// TODO(wkim): Undefine this after doing the relevant works. Refer `SkipListCache::size_`
-#define CACHE_SIZE_IS_FIELD_COUNT
-
+// DRAM skiplist of L1 search shortcuts within a byte budget. A node holds up
+// to N shortcuts in descending key order, the largest being the node key.
+// The single writer, i.e. the compaction of the shard, evicts whole nodes in
+// CLOCK order: lookups set the reference bit of the node they return from,
+// and the hand sweeps the bottom layer, clearing set bits and evicting the
+// first node found without one. Unlinked nodes are retired through the epoch
+// manager, so readers must hold an epoch.
 template <std::size_t N>
 class SkipListCache {
  public:
@@ -55,10 +60,11 @@ class SkipListCache {
 
   struct Node {
     uint64_t tag;  // height (8-bit)
+    std::atomic<bool> referenced;
     Field fields[N];  // descending order
     std::atomic<Node*> next[1];
     
-    explicit Node(const Key& k, int height, int pnode_height, uint64_t offset) {
+    explicit Node(const Key& k, int height, int pnode_height, uint64_t offset) : referenced(false) {
       tag = static_cast<uint16_t>(height);
       fields[0].Set(k, pnode_height, offset);
     }
@@ -94,8 +100,8 @@ class SkipListCache {
       fields[pos].Set(key, pnode_height, offset);
     }
 
+    // Deleting fields[0] makes the next field the node key
     void MaybeShiftDeleteFieldByPosition(unsigned int pos) {
-      assert(pos != 0);
       while (pos < N - 1 && !fields[pos + 1].IsEmpty()) {
         fields[pos] = fields[pos + 1];
         pos++;
@@ -104,33 +110,23 @@ class SkipListCache {
     }
   };
 
-  struct Cursor {
-    Key key;
-    std::atomic<Node*> node;
-
-    Cursor() : key(0), node(nullptr) { }
-
-    void Set(const Key& k, Node* n) {
-      key = k;
-      node.store(n, std::memory_order_release);
-    }
+  // Unlinked nodes are retired through the epoch manager, so readers must
+  // hold an epoch.
+  // capacity: in bytes
+  SkipListCache(const int pool_id, EpochManager* epoch_manager,
+                size_t capacity = kSkipListCacheCapacity);
 
-    void Reset() {
-      node.store(nullptr, std::memory_order_release);
-    }
-
-    bool IsEmpty() {
-      return node.load(std::memory_order_acquire) == 0;
-    }
-  };
-
-  // Constructor
-  SkipListCache(const int pool_id, size_t capacity = kSkipListCacheCapacity);
+  ~SkipListCache();
 
   // Not thread-safe.
-  // Only one background worker thread calls this.
+  // Only one background worker thread calls this. Evicts nodes to stay within
+  // the capacity. Returns 1 if the shortcut does not fit.
   int Insert(PmemNode* const p);
 
+  // Drops the shortcut to an L1 node about to be unlinked.
+  // Not thread-safe against Insert.
+  void Erase(const Key& key, PmemNode* const p);
+
   PmemNode* LookupLessThan(const Key& key);
 
   // Returns 0 if equal, -1 lessthan, 1 not found
@@ -140,11 +136,25 @@ class SkipListCache {
 
   size_t AcquireLoadSize() { return size_.load(std::memory_order_acquire); }
 
+  // Bytes of the nodes, including the head
+  size_t MemoryUsage() { return size_.load(std::memory_order_relaxed); }
+
  private:
   Node* NewNode(const Key& key, const int height, PmemNode* p = nullptr);
 
+  static size_t NodeSize(const int height) {
+    return util::AlignedSize(8, sizeof(Node) + (height - 1) * 8);
+  }
+
   int RandomHeight();
 
+  static void Touch(Node* n) {
+    // Checked first to keep the cache line of a hot node shared
+    if (!n->referenced.load(std::memory_order_relaxed)) {
+      n->referenced.store(true, std::memory_order_relaxed);
+    }
+  }
+
   PmemNode* DecodeFieldValue(const Field& f) {
     return PmemPtr::Compose<PmemNode>(pool_id_, f.offset());
   }
@@ -153,31 +163,27 @@ class SkipListCache {
 
   Node* FindPosition(const Key& key, Node* preds[], Node* succs[]);
 
-  void MaybeMoveCursor(Node* node, unsigned int begin, unsigned int end, Node* move_to);
+  // Evicts one node. Returns false if the cache is empty.
+  bool EvictOne();
 
-  void MaybeUpdateCursor(int height, const Key& key, Node* node);
-
-  int EvictSome(int height_upper);
+  void Unlink(Node* node);
 
   const int pool_id_;
+  EpochManager* epoch_manager_;
   const size_t capacity_;
+  std::atomic<size_t> size_;  // bytes
   Node* head_;
-  // NOTE: size_ and capacity_ must represent used and free memory space respectively.
-  // Since this requires a Merge operation, which is not implemented yet, for now, size_ represents the number of fields
-  // occupied regardless of the actual memory consumption.
-  // TODO(wkim): Impl. Merge and change the semantic of size and capacity.
-  std::atomic<size_t> size_;
-  std::vector<Cursor> smallest_cursor_;
-  //std::mutex mu_;
+  // Next node the clock hand visits, nullptr to start over from the front
+  Node* hand_ = nullptr;
 };
 
 template <std::size_t N>
-SkipListCache<N>::SkipListCache(const int pool_id, size_t capacity)
+SkipListCache<N>::SkipListCache(const int pool_id, EpochManager* epoch_manager, size_t capacity)
   : pool_id_(pool_id),
+    epoch_manager_(epoch_manager),
     capacity_(capacity),
-    head_(NewNode(uint64_t{0}, kMaxHeight_)),
     size_(0),
-    smallest_cursor_(kMaxHeight) {
+    head_(NewNode(uint64_t{0}, kMaxHeight_)) {
   for (int i = 0; i < kMaxHeight_; i++) {
     head_->next[i].store(nullptr, std::memory_order_relaxed);
   }
@@ -185,47 +191,52 @@ SkipListCache<N>::SkipListCache(const int pool_id, size_t capacity)
 }
 
 template <std::size_t N>
-int SkipListCache<N>::Insert(PmemNode* const p) {
-#ifdef CACHE_SIZE_IS_FIELD_COUNT
-  size_t curr_size = size_.load(std::memory_order_acquire);
-  if (curr_size + sizeof(Field) > capacity_) {
-    int num_evicted = EvictSome(p->height());
-    //fprintf(stdout, "Full. evict_cnt=%d\n", num_evicted);
-    if (num_evicted == 0) {
-      // Full. Nothing to evict
-      return 1;
-    }
+SkipListCache<N>::~SkipListCache() {
+  Node* node = head_;
+  while (node) {
+    Node* next = node->next[0].load(std::memory_order_relaxed);
+    free(node);
+    node = next;
   }
-#endif
+}
 
+template <std::size_t N>
+int SkipListCache<N>::Insert(PmemNode* const p) {
   Key& key = p->key;
+  const uint64_t offset = PmemPtr::OffsetOfVaddr(pool_id_, p);
 
   // Insert new node into SkipList
   Node* preds[kMaxHeight_];
   Node* succs[kMaxHeight_];
 
-  Node* n = FindPosition(key, preds, succs);
+  // Height of the node to add if no node has a free field
+  const int height = RandomHeight();
+  Node* n;
+  while (true) {
+    n = FindPosition(key, preds, succs);
+    if (n != nullptr && !n->IsFull()) {
+      n->MaybeShiftInsertField(key, p->height(), offset);
+      return 0;
+    }
+    if (size_.load(std::memory_order_relaxed) + NodeSize(height) <= capacity_) {
+      break;
+    }
+    // Eviction may unlink the nodes found, so search again
+    if (!EvictOne()) {
+      // Full. Nothing to evict
+      return 1;
+    }
+  }
+
   if (n == nullptr) {
     // Create a new node
-    int height = RandomHeight();
     Node* x = NewNode(key, height, p);
     for (int i = 0; i < height; i++) {
       x->next[i].store(succs[i], std::memory_order_relaxed);
       preds[i]->next[i].store(x, std::memory_order_release);
     }
-#ifdef CACHE_SIZE_IS_FIELD_COUNT
-    MaybeUpdateCursor(p->height(), key, x);
-    size_.fetch_add(sizeof(Field));
-#endif
-  } else if (!n->IsFull()) {
-    n->MaybeShiftInsertField(key, p->height(), PmemPtr::OffsetOfVaddr(pool_id_, p));
-    MaybeUpdateCursor(p->height(), key, n);
-#ifdef CACHE_SIZE_IS_FIELD_COUNT
-    size_.fetch_add(sizeof(Field));
-#endif
   } else {
     // Split
-    //fprintf(stdout, "split\n");
 
     // Determine a split key
     // preds -> A{ split_key } -> n{ old_key }
@@ -234,33 +245,16 @@ int SkipListCache<N>::Insert(PmemNode* const p) {
     PmemNode* split_pnode = DecodeFieldValue(split_field);
 
     // Create a new node
-    int height = RandomHeight();
-#ifdef CACHE_SIZE_IS_FIELD_COUNT
-    size_.fetch_add(sizeof(Field));
-#else
-    size_t node_size = util::AlignedSize(8, sizeof(Node) + (height - 1) * 8);
-    if (curr_size + node_size > capacity_) {
-      size_t available_space_for_height = capacity_ - (curr_size + (sizeof(Node) - 8));
-      height = available_space_for_height / 8;
-      node_size = util::AlignedSize(8, sizeof(Node) + (height - 1) * 8);
-      while (curr_size + node_size > capacity_ && height > 1) {
-        height--;
-        node_size = util::AlignedSize(8, sizeof(Node) + (height - 1) * 8);
-      }
-    }
-    size_.fetch_add(node_size, std::memory_order_release);
-#endif
     Node* x = NewNode(split_key, height, split_pnode);  // TODO(wkim): Impl. NewNode(Field&, height)
 
     bool insert_to_new_node = key.Compare(split_key) <= 0;
     // Copy fields having the key < split_key
-    // smallest_cursor_ may be updated if a cursor points to the node containing the field to move to the new node.
     int pos = 1;
     if (insert_to_new_node) {
       for (unsigned int i = N/2 + 1; i < N; i++) {
         // Insertion in descending order prevents field shifts.
         if (UNLIKELY(n->fields[i].key.Compare(key) < 0)) {
-          x->fields[pos++].Set(key, p->height(), PmemPtr::OffsetOfVaddr(pool_id_, p));
+          x->fields[pos++].Set(key, p->height(), offset);
         }
         x->fields[pos++] = n->fields[i];
       }
@@ -270,7 +264,6 @@ int SkipListCache<N>::Insert(PmemNode* const p) {
         x->fields[pos++] = n->fields[i];
       }
     }
-    MaybeMoveCursor(n, N/2 + 1, N, x);
 
     // Link the newely created node
     for (int i = 0; i < height; i++) {
@@ -281,16 +274,39 @@ int SkipListCache<N>::Insert(PmemNode* const p) {
     for (unsigned int i = N-1; i >= N/2; i--) {
       n->fields[i].Reset();
     }
-    if (insert_to_new_node) {
-      MaybeUpdateCursor(p->height(), key, x);
-    } else {
-      n->MaybeShiftInsertField(key, p->height(), PmemPtr::OffsetOfVaddr(pool_id_, p));
-      MaybeUpdateCursor(p->height(), key, n);
+    if (!insert_to_new_node) {
+      n->MaybeShiftInsertField(key, p->height(), offset);
     }
   }
   return 0;
 }
 
+template <std::size_t N>
+void SkipListCache<N>::Erase(const Key& key, PmemNode* const p) {
+  const uint64_t offset = PmemPtr::OffsetOfVaddr(pool_id_, p);
+  Node* n = FindPosition(key, nullptr, nullptr);
+  while (n != nullptr) {
+    for (unsigned int i = 0; i < N; i++) {
+      if (n->fields[i].IsEmpty()) {
+        break;
+      }
+      if (n->fields[i].key.Compare(key) == 0 && n->fields[i].offset() == offset) {
+        if (i == 0 && n->fields[1].IsEmpty()) {
+          Unlink(n);
+        } else {
+          n->MaybeShiftDeleteFieldByPosition(i);
+        }
+        return;
+      }
+    }
+    // A split may leave versions of the node key in the next node
+    if (n->key()->Compare(key) != 0) {
+      return;
+    }
+    n = n->next[0].load(std::memory_order_relaxed);
+  }
+}
+
 template <std::size_t N>
 typename SkipListCache<N>::PmemNode* SkipListCache<N>::LookupLessThan(const Key& key) {
   Node* preds[kMaxHeight_];
@@ -301,12 +317,14 @@ typename SkipListCache<N>::PmemNode* SkipListCache<N>::LookupLessThan(const Key&
         break;
       }
       if (n->fields[i].key.Compare(key) < 0) {
+        Touch(n);
         return DecodeFieldValue(n->fields[i]);
       }
     }
   }
   if (preds[0] != head_) {
     n = preds[0];
+    Touch(n);
     return DecodeFieldValue(n->fields[0]);
   }
   return nullptr;
@@ -325,9 +343,11 @@ int SkipListCache<N>::LookupLessThanOrEqualsTo(const Key& key, PmemNode** out) {
       }
       int cmp = n->fields[i].key.Compare(key);
       if (cmp == 0) {
+        Touch(n);
         *out = DecodeFieldValue(n->fields[i]);
         return 0;
       } else if (cmp < 0) {
+        Touch(n);
         *out = DecodeFieldValue(n->fields[i]);
         return -1;
       }
@@ -345,6 +365,7 @@ int SkipListCache<N>::LookupLessThanOrEqualsTo(const Key& key, PmemNode** out) {
       }
       int cmp = n->fields[i].key.Compare(key);
       if (cmp == 0) {
+        Touch(n);
         *out = DecodeFieldValue(n->fields[i]);
         return 0;
       } else if (cmp > 0) {
@@ -359,6 +380,7 @@ int SkipListCache<N>::LookupLessThanOrEqualsTo(const Key& key, PmemNode** out) {
       }
     }
     if (last_lt_pos < N) {
+      Touch(n);
       *out = DecodeFieldValue(n->fields[last_lt_pos]);
       return -1;
     }
@@ -366,6 +388,7 @@ int SkipListCache<N>::LookupLessThanOrEqualsTo(const Key& key, PmemNode** out) {
   }
   if (preds[0] != head_) {
     n = preds[0];
+    Touch(n);
     *out = DecodeFieldValue(n->fields[0]);
     return -1;
   }
@@ -376,8 +399,9 @@ int SkipListCache<N>::LookupLessThanOrEqualsTo(const Key& key, PmemNode** out) {
 
 template <std::size_t N>
 typename SkipListCache<N>::Node* SkipListCache<N>::NewNode(const Key& key, const int height, PmemNode* p) {
-  size_t node_size = util::AlignedSize(8, sizeof(Node) + (height - 1) * 8);
+  size_t node_size = NodeSize(height);
   void* buf = aligned_alloc(8, node_size);
+  size_.fetch_add(node_size, std::memory_order_relaxed);
   Node* node;
   if (p != nullptr) {
     node = new (buf) Node(key, height, p->height(), PmemPtr::OffsetOfVaddr(pool_id_, p));
@@ -432,109 +456,61 @@ typename SkipListCache<N>::Node* SkipListCache<N>::FindPosition(const Key& key,
 }
 
 template <std::size_t N>
-void SkipListCache<N>::MaybeMoveCursor(Node* node, unsigned int begin, unsigned int end, Node* move_to) {
-  for (int i = 0; i < kMaxHeight_; i++) {
-    if (smallest_cursor_[i].node.load(std::memory_order_acquire) == node) {
-      unsigned int pos = begin; 
-      while (pos < end) {
-        if (node->fields[pos].IsEmpty()) {
-          break;
-        }
-        int cmp = node->fields[pos].key.Compare(smallest_cursor_[i].key);
-        if (cmp < 0) {
-          break;
-        } else if (cmp == 0) {
-          smallest_cursor_[i].node.store(move_to, std::memory_order_relaxed);
-          break;
-        }
-        pos++;
-      }
+bool SkipListCache<N>::EvictOne() {
+  // Two rounds at most: the first one clears every reference bit
+  Node* first = head_->next[0].load(std::memory_order_relaxed);
+  if (first == nullptr) {
+    return false;
+  }
+  while (true) {
+    if (hand_ == nullptr) {
+      hand_ = first;
+    }
+    Node* node = hand_;
+    hand_ = node->next[0].load(std::memory_order_relaxed);
+    if (node->referenced.load(std::memory_order_relaxed)) {
+      node->referenced.store(false, std::memory_order_relaxed);
+      continue;
     }
+    Unlink(node);
+    return true;
   }
 }
 
 template <std::size_t N>
-void SkipListCache<N>::MaybeUpdateCursor(int height, const Key& key, Node* node) {
-  if (smallest_cursor_[height].IsEmpty() || smallest_cursor_[height].key.Compare(key) > 0) {
-    smallest_cursor_[height].Set(key, node);
+void SkipListCache<N>::Unlink(Node* node) {
+  if (hand_ == node) {
+    hand_ = node->next[0].load(std::memory_order_relaxed);
   }
-}
-
-template <std::size_t N>
-int SkipListCache<N>::EvictSome(int height_upper) {
-  // Evict
-
-  static const unsigned int kEvictionBatchSize = 4;
-  unsigned int eviction_cnt = 0;
-  int curr_height = 0;
-  bool collection_done = false;
-  // evict lowest heights first
-  while (curr_height < height_upper && !collection_done) {
-    if (smallest_cursor_[curr_height].IsEmpty()) {
-      curr_height++;
-      continue;
+  Node* pred = head_;
+  for (int l = kMaxHeight_ - 1; l >= 0; l--) {
+    Node* curr = pred->next[l].load(std::memory_order_relaxed);
+    while (KeyIsAfterNode(*node->key(), curr)) {
+      pred = curr;
+      curr = pred->next[l].load(std::memory_order_relaxed);
     }
-    std::vector<std::pair<Node*, int>> victims;
-    Node* x = smallest_cursor_[curr_height].node.load(std::memory_order_acquire);
-    while (x != nullptr && !collection_done) {
-      // TODO(wkim): Split node when field[pos = 0] should be evicted
-      // Since fields[pos = 0] contains node key, we need to split the node to evict fields[pos = 0]
-      // For now, we don't evict the node key. Collect the victim infos upto pos = 1.
-      unsigned int pos = N - 1;
-      while (pos > 0) {
-        if (!x->fields[pos].IsEmpty() && x->fields[pos].height() - 1 == curr_height) {
-          //fprintf(stdout, "cursor points to node key (curr_height=%d)\n", curr_height);
-          victims.emplace_back(x, pos);
-          if (eviction_cnt + victims.size() > kEvictionBatchSize) {
-            collection_done = true;
-            break;
-          }
-        }
-        pos--;
-      }
-      x = x->next[0].load(std::memory_order_acquire);
-    }
-    // Update cursor
-    if (victims.size() > kEvictionBatchSize - eviction_cnt) {
-      auto& new_smallest = victims.back();
-      Node* new_smallest_node = new_smallest.first;
-      int new_smallest_field_pos = new_smallest.second;
-      smallest_cursor_[curr_height].Set(new_smallest_node->fields[new_smallest_field_pos].key, new_smallest_node);
-      victims.pop_back();
-    } else {
-      smallest_cursor_[curr_height].Reset();
+    if (l >= node->height()) {
+      continue;
     }
-    // Drop victims
-    auto it = victims.begin();
-    while (it != victims.end()) {
-      std::vector<int> positions;
-      Node* x = it->first;
-      while (it != victims.end()) {
-        if (it->first == x) {
-          positions.push_back(it->second);
-        }
-        ++it;
-      }
-      for (auto& pos : positions) {
-        x->MaybeShiftDeleteFieldByPosition(pos);
-      }
+    // Skip other nodes of the same node key
+    Node* upper_pred = pred;
+    while (curr != node) {
+      upper_pred = curr;
+      curr = upper_pred->next[l].load(std::memory_order_relaxed);
     }
-    eviction_cnt += victims.size();
-    curr_height++;
+    // Readers on the node still move on through its next pointers
+    upper_pred->next[l].store(node->next[l].load(std::memory_order_relaxed),
+                              std::memory_order_release);
   }
-
-  size_.fetch_sub(eviction_cnt * sizeof(Field));
-
-  return eviction_cnt;
+  size_.fetch_sub(NodeSize(node->height()), std::memory_order_relaxed);
+  epoch_manager_->Retire([node] { free(node); });
 }
 
 template <std::size_t N>
 void SkipListCache<N>::GetDebugString(const std::string& name, std::string* buf) {
   std::stringstream ss;
-  if (name == "cursor") {
-    for (int i = 0; i < kMaxHeight_; i++) {
-      ss << i + 1 << ": " << smallest_cursor_[i].key.key_num() << std::endl;
-    }
+  if (name == "size") {
+    ss << "size: " << size_.load(std::memory_order_relaxed) << " / " << capacity_ << std::endl;
     buf->assign(std::move(ss.str()));
   }
 }
@@ -21,6 +21,7 @@ namespace fs = std::experimental::filesystem::v1;
 #include "listdb/core/skiplist_cache.h"
 #include "listdb/port/port_posix.h"
 #include "listdb/index/braided_pmem_skiplist.h"
+#include "listdb/lib/epoch.h"
 #include "listdb/util/random.h"
 
 static int pool_id;
@@ -99,13 +100,15 @@ int main() {
 
   int n = 40;
 
-  auto c = new SkipListCache<4>(pool_id, 16 * n / 2);
+  EpochManager epoch_manager;
+  auto c = new SkipListCache<4>(pool_id, &epoch_manager, 1 << 10);
 
   std::unique_ptr<const char[]> key_guard;
   std::string_view key = AllocateKey(&key_guard);
 
   Random64 rand(999);
   std::vector<uint64_t> randints;
+  std::vector<PmemNode*> pnodes;
 
   for (int i = 0; i < n; i++) {
     randints.push_back(rand.Uniform(n<<3) + 1);
@@ -119,6 +122,7 @@ int main() {
     PmemNode* p = CreateIULNode(key, height);
     std::cout << p << ": " << p->key.key_num() << std::endl;
     c->Insert(p);
+    pnodes.push_back(p);
   }
 
   uint64_t lkey_int;
@@ -147,10 +151,26 @@ int main() {
     std::cout << lt << std::endl;
   }
 
+  {
+    // Erased shortcuts are no longer returned
+    GenerateKeyFromInt(randints[0], &key);
+    Key& erase_key = *((Key*) key.data());
+    c->Erase(erase_key, pnodes[0]);
+    PmemNode* lte = nullptr;
+    int rv = c->LookupLessThanOrEqualsTo(erase_key, &lte);
+    std::cout << "after erase: " << rv << " " << lte << std::endl;
+    if (lte == pnodes[0]) {
+      std::cerr << "erased shortcut returned" << std::endl;
+      return 1;
+    }
+    epoch_manager.Reclaim();
+  }
+
   std::string debug_str;
-  c->GetDebugString("cursor", &debug_str);
+  c->GetDebugString("size", &debug_str);
   std::cout << debug_str << std::endl;
 
+  delete c;
   return 0;
 }
 #endif  // LISTDB_SKIPLIST_CACHE
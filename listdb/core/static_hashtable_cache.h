@@ -2,7 +2,9 @@
 #define LISTDB_CORE_STATIC_HASHTABLE_CACHE_H_
 
 #include "listdb/common.h"
+#include "listdb/core/cache_table.h"
 #include "listdb/index/braided_pmem_skiplist.h"
+#include "listdb/lib/epoch.h"
 #include "listdb/lib/murmur3.h"
 
 class StaticHashTableCache {
@@ -15,52 +17,98 @@ class StaticHashTableCache {
     Bucket() : value(nullptr) { }
   };
 
+  using Table = CacheTable<Bucket>;
+
+  static constexpr size_t kEntrySize = sizeof(Bucket);
+
   StaticHashTableCache(size_t size, int shard);
 
-  Bucket* at(const int i) { return &(buckets_[i]); }
+  ~StaticHashTableCache();
+
+  Bucket* at(const int i) { return &(table_.load()->buckets[i]); }
 
   void Insert(const Key& key, PmemNode* const p);
 
   PmemNode* Lookup(const Key& key);
 
-  uint32_t Hash(const Key& key);
+  // Drops the entry of the key if it still caches p
+  void Erase(const Key& key, PmemNode* const p);
+
+  size_t size() { return table_.load()->size; }
+
+  // Rehashes the entries into a new table of the given size. Must not run
+  // concurrently with Insert or Erase.
+  void Resize(const size_t size, EpochManager* epoch_manager);
+
+  uint32_t Hash(const Key& key, const size_t size);
 
  private:
-  const size_t size_;
   const int shard_;
   const uint32_t seed_;
-  Bucket* buckets_;
+  std::atomic<Table*> table_;
 };
 
 StaticHashTableCache::StaticHashTableCache(size_t size, int shard)
-  : size_(size), shard_(shard), seed_(std::hash<int>()(shard_)) {
-  buckets_ = new Bucket[size];
+  : shard_(shard), seed_(std::hash<int>()(shard_)), table_(new Table(size)) {
   std::atomic_thread_fence(std::memory_order_seq_cst);
 }
 
+StaticHashTableCache::~StaticHashTableCache() {
+  delete table_.load();
+}
+
 void StaticHashTableCache::Insert(const Key& key, PmemNode* const p) {
-  uint32_t pos = Hash(key);
-  buckets_[pos].value.store(p, std::memory_order_seq_cst);
+  Table* table = table_.load(std::memory_order_acquire);
+  uint32_t pos = Hash(key, table->size);
+  auto& bucket = table->buckets[pos];
+  PmemNode* cached = bucket.value.load(std::memory_order_seq_cst);
+  // Flushes of a shard may finish out of order. A newer version stays.
+  while (cached == nullptr || cached->key.Compare(key) != 0 || !SeqNewer(cached->seq(), p->seq())) {
+    if (bucket.value.compare_exchange_weak(cached, p)) {
+      break;
+    }
+  }
 }
 
 StaticHashTableCache::PmemNode* StaticHashTableCache::Lookup(const Key& key) {
-  uint32_t pos = Hash(key);
-  PmemNode* value = buckets_[pos].value.load(std::memory_order_seq_cst);
+  Table* table = table_.load(std::memory_order_acquire);
+  uint32_t pos = Hash(key, table->size);
+  PmemNode* value = table->buckets[pos].value.load(std::memory_order_seq_cst);
   if (value && value->key.Compare(key) == 0) {
     return value;
   }
   return nullptr;
 }
 
-inline uint32_t StaticHashTableCache::Hash(const Key& key) {
+void StaticHashTableCache::Erase(const Key& key, PmemNode* const p) {
+  Table* table = table_.load(std::memory_order_acquire);
+  uint32_t pos = Hash(key, table->size);
+  PmemNode* expected = p;
+  table->buckets[pos].value.compare_exchange_strong(expected, nullptr);
+}
+
+void StaticHashTableCache::Resize(const size_t size, EpochManager* epoch_manager) {
+  Table* old_table = table_.load();
+  Table* new_table = new Table(size);
+  for (size_t i = 0; i < old_table->size; i++) {
+    PmemNode* p = old_table->buckets[i].value.load(std::memory_order_relaxed);
+    if (p) {
+      new_table->buckets[Hash(p->key, size)].value.store(p, std::memory_order_relaxed);
+    }
+  }
+  table_.store(new_table, std::memory_order_release);
+  epoch_manager->Retire([old_table] { delete old_table; });
+}
+
+inline uint32_t StaticHashTableCache::Hash(const Key& key, const size_t size) {
 	uint32_t h;
 	//static const uint32_t seed = 0xcafeb0ba;
 #ifndef LISTDB_STRING_KEY
 	MurmurHash3_x86_32(&key, sizeof(uint64_t), seed_, (void*) &h);
 #else
-	MurmurHash3_x86_32(key.data(), kStringKeyLength, seed_, (void*) &h);
+	MurmurHash3_x86_32(key.data(), key.size(), seed_, (void*) &h);
 #endif
-	return h % size_;
+	return h % size;
 }
 
 #endif  // LISTDB_CORE_STATIC_HASHTABLE_CACHE_H_
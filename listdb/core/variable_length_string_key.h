@@ -0,0 +1,131 @@
+#ifndef LISTDB_CORE_VARIABLE_LENGTH_STRING_KEY_H_
+#define LISTDB_CORE_VARIABLE_LENGTH_STRING_KEY_H_
+
+#include <algorithm>
+#include <cstring>
+#include <string>
+#include <string_view>
+
+#include "listdb/pmem/pmem_ptr.h"
+
+// A string key of up to kMaxLength bytes that fits in 16 bytes.
+// The first 8 bytes are kept inline as a big-endian prefix, so most
+// comparisons finish without touching the rest of the key. The bytes past
+// the prefix are stored out of line, either in the caller's buffer for a
+// lookup key or next to the IUL entry for a stored key, and referenced by
+//   length (8-bit) | pool_id (8-bit) | offset (48-bit)
+// where pool_id kTransientPoolId means the offset is a virtual address.
+class VariableLengthStringKey {
+ public:
+  static constexpr size_t kPrefixSize = 8;
+  static constexpr size_t kMaxLength = 255;
+
+  VariableLengthStringKey() : prefix_(0), rest_(0) { }
+  VariableLengthStringKey(const std::string_view& key);
+  VariableLengthStringKey(const std::string& key) : VariableLengthStringKey(std::string_view(key)) { }
+  VariableLengthStringKey(const char* key) : VariableLengthStringKey(std::string_view(key)) { }
+  // 8-byte key holding the bytes of the integer
+  VariableLengthStringKey(const uint64_t key);
+  VariableLengthStringKey(const int key) : VariableLengthStringKey((uint64_t) key) { }
+
+  size_t size() const { return rest_ >> 56; }
+  uint64_t key_num() const { return __builtin_bswap64(prefix_); }
+  int Compare(const VariableLengthStringKey& other) const;
+
+  // Pointer to the full key bytes
+  const char* data() const;
+
+  bool Valid() const { return rest_ != 0; }
+
+  bool operator==(const VariableLengthStringKey& other) const { return Compare(other) == 0; }
+
+  // Size of the bytes stored out of line by StoreOutOfLine
+  size_t out_of_line_size() const;
+
+  // Copies the out-of-line bytes to dst in the pool and returns the key
+  // referring to them
+  VariableLengthStringKey StoreOutOfLine(const int pool_id, char* dst) const;
+
+  // Returns the key referring to out-of-line bytes already copied to dst
+  VariableLengthStringKey OutOfLineAt(const int pool_id, const char* dst) const;
+
+ private:
+  static constexpr uint64_t kOffsetMask = (1ull << 48) - 1;
+  static constexpr uint64_t kTransientPoolId = 0xff;
+
+  const char* suffix() const;
+
+  uint64_t prefix_;  // first 8 bytes in key order, zero-padded
+  uint64_t rest_;
+};
+
+inline VariableLengthStringKey::VariableLengthStringKey(const std::string_view& key) : prefix_(0) {
+  assert(key.size() > 0 && key.size() <= kMaxLength);
+  memcpy(&prefix_, key.data(), std::min(key.size(), kPrefixSize));
+  rest_ = ((uint64_t) key.size() << 56) | (kTransientPoolId << 48) | ((uintptr_t) key.data() & kOffsetMask);
+}
+
+inline VariableLengthStringKey::VariableLengthStringKey(const uint64_t key) {
+  memcpy(&prefix_, &key, kPrefixSize);
+  rest_ = (uint64_t) kPrefixSize << 56;
+}
+
+inline const char* VariableLengthStringKey::suffix() const {
+  const uint64_t pool_id = (rest_ >> 48) & 0xff;
+  if (pool_id == kTransientPoolId) {
+    return (const char*) (rest_ & kOffsetMask);
+  }
+  return PmemPtr::Compose<char>(pool_id, rest_ & kOffsetMask);
+}
+
+inline const char* VariableLengthStringKey::data() const {
+  return (size() <= kPrefixSize) ? (const char*) &prefix_ : suffix();
+}
+
+inline int VariableLengthStringKey::Compare(const VariableLengthStringKey& other) const {
+  const uint64_t a = key_num();
+  const uint64_t b = other.key_num();
+  if (a != b) {
+    return (a < b) ? -1 : 1;
+  }
+  const size_t a_size = size();
+  const size_t b_size = other.size();
+  const size_t min_size = std::min(a_size, b_size);
+  if (min_size > kPrefixSize) {
+    int rv = memcmp(suffix() + kPrefixSize, other.suffix() + kPrefixSize, min_size - kPrefixSize);
+    if (rv != 0) {
+      return rv;
+    }
+  }
+  return (a_size < b_size) ? -1 : (a_size > b_size);
+}
+
+inline size_t VariableLengthStringKey::out_of_line_size() const {
+  return (size() <= kPrefixSize) ? 0 : ((size() + 7) & ~7ull);
+}
+
+inline VariableLengthStringKey VariableLengthStringKey::StoreOutOfLine(const int pool_id, char* dst) const {
+  if (size() > kPrefixSize) {
+    memcpy(dst, data(), size());
+  }
+  return OutOfLineAt(pool_id, dst);
+}
+
+inline VariableLengthStringKey VariableLengthStringKey::OutOfLineAt(const int pool_id, const char* dst) const {
+  VariableLengthStringKey rv = *this;
+  if (size() > kPrefixSize) {
+    assert(pool_id < (int) kTransientPoolId);
+    rv.rest_ = ((uint64_t) size() << 56) | ((uint64_t) pool_id << 48) | PmemPtr::OffsetOfVaddr(pool_id, (void*) dst);
+  }
+  return rv;
+}
+
+inline bool operator< (const VariableLengthStringKey& lhs, const VariableLengthStringKey& rhs) {
+  return lhs.Compare(rhs) < 0;
+}
+
+inline bool operator> (const VariableLengthStringKey& lhs, const VariableLengthStringKey& rhs) {
+  return lhs.Compare(rhs) > 0;
+}
+
+#endif  // LISTDB_CORE_VARIABLE_LENGTH_STRING_KEY_H_
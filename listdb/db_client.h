@@ -2,16 +2,19 @@
 #define LISTDB_DB_CLIENT_H_
 
 #include <algorithm>
+#include <string>
+#include <string_view>
 #include <vector>
 
 #include "listdb/common.h"
 #include "listdb/listdb.h"
+#include "listdb/lsm/merging_iterator.h"
 #include "listdb/util.h"
 #include "listdb/util/random.h"
+#include "listdb/write_batch.h"
 
 #define LEVEL_CHECK_PERIOD_FACTOR 1
 
-//#define LOG_NTSTORE
 class DBClient {
  public:
   using MemNode = ListDB::MemNode;
@@ -19,11 +22,40 @@ class DBClient {
 
   DBClient(ListDB* db, int id, int region);
 
+  ~DBClient();
+
   void SetRegion(int region);
 
   void Put(const Key& key, const Value& value);
 
-  bool Get(const Key& key, Value* value_out);
+  // Stores the value bytes inline in the IUL entry. Returns false without
+  // writing if the value is larger than kMaxInlineValueSize bytes.
+  bool Put(const Key& key, const std::string_view& value);
+
+  // Writes a tombstone for the key
+  void Delete(const Key& key);
+
+  // Applies all updates in the batch atomically. Returns false without
+  // applying any if the entries of a shard do not fit in its MemTable.
+  bool Write(const WriteBatch& batch);
+
+  // Reads as of the snapshot if given, otherwise the latest version. For a
+  // value written by Put(key, std::string_view), the address of its bytes
+  // is returned.
+  bool Get(const Key& key, Value* value_out, const Snapshot* snapshot = nullptr);
+
+  // Reads a value written by Put(key, std::string_view). An integer value
+  // is returned as its 8 bytes.
+  bool Get(const Key& key, std::string* value_out, const Snapshot* snapshot = nullptr);
+
+  // Looks up a batch of keys with interleaved traversals.
+  // (*found)[i] tells whether keys[i] exists, with its value in (*values)[i]
+  // as returned by Get.
+  void MultiGet(const std::vector<Key>& keys, std::vector<Value>* values, std::vector<bool>* found);
+
+  // Returns a sorted iterator over all shards and levels, reading as of the
+  // snapshot if given. The caller must delete it when done.
+  Iterator* NewIterator(const Snapshot* snapshot = nullptr);
 
 #if defined(LISTDB_STRING_KEY) && defined(LISTDB_WISCKEY)
   void PutStringKV(const std::string_view& key_sv, const std::string_view& value);
@@ -41,21 +73,81 @@ class DBClient {
   int DramRandomHeight();
   int PmemRandomHeight();
 
-  static int KeyShard(const Key& key);
+  int KeyShard(const Key& key) const;
+
+  void WriteEntry(const Key& key, const Value& value, const ValueType type,
+                  const std::string_view& inline_value = std::string_view());
+
+  // Write paths of each persistence mode. The one of the DB is picked when
+  // the client is created.
+  template <typename Persistence>
+  void WriteEntryImpl(const Key& key, const Value& value, const ValueType type,
+                      const std::string_view& inline_value);
+
+  template <typename Persistence>
+  bool WriteImpl(const WriteBatch& batch);
+
+  // Returns the newest entry of the key visible to the snapshot, which may be
+  // a tombstone, or nullptr if there is none
+  PmemNode* GetEntry(const Key& key, const Snapshot* snapshot);
+
+  // Value of an entry as returned by Get
+  static Value EntryValue(const PmemNode* entry);
+
+#ifdef LISTDB_L0_CACHE
+  PmemNode* L0CacheLookup(const Key& key, const int s);
+#endif
+
+  enum class MultiGetStage { kMemTable, kMemTableValue, kPmemTable, kDone };
+
+  // Traversal state of a key in MultiGet
+  struct MultiGetState {
+    size_t index;
+    int shard;
+    const Key* key;
+    uint64_t key_hash;  // for the filters of L0 tables
+    MultiGetStage stage;
+    Table* table;
+    int list_level;  // 0: MemTables and L0, 1: L1
+    bool l0_visited = false;
+    int pool_id;
+    int height;
+    void* pred;
+    bool found = false;
+    Value value = 0;
+  };
+
+  void MultiGetSeekTable(MultiGetState* st);
+
+  void MultiGetStep(MultiGetState* st);
 
 #ifdef LISTDB_EXPERIMENTAL_SEARCH_LEVEL_CHECK
   PmemPtr LevelLookup(const Key& key, const int pool_id, const int level, BraidedPmemSkipList* skiplist);
 #endif
   PmemPtr Lookup(const Key& key, const int pool_id, BraidedPmemSkipList* skiplist);
-  PmemPtr LookupL1(const Key& key, const int pool_id, BraidedPmemSkipList* skiplist, const int shard);
+  PmemPtr LookupL1(const Key& key, const int pool_id, PmemTable* table, const int shard);
 
   ListDB* db_;
+  ListDB::WriterSlot* writer_slot_;
+  // Pinned while reading MemTables
+  EpochManager::Slot* epoch_slot_;
+  int num_shards_;
   int id_;
   int region_;
   int l0_pool_id_;
   int l1_pool_id_;
+  // Region of l1_pool_id_, resolved once for the L1 caches
+  int l1_region_;
   Random rnd_;
   PmemLog* log_[kNumShards];
+  LogCombiner* log_combiner_[kNumShards];
+  const bool log_nt_store_;
+  void (DBClient::*write_entry_fn_)(const Key&, const Value&, const ValueType,
+                                    const std::string_view&);
+  bool (DBClient::*write_fn_)(const WriteBatch&);
+  // Entries are built here before they are copied to the log with
+  // non-temporal stores
+  std::vector<char> log_stage_;
 #ifdef LISTDB_WISCKEY
   PmemBlob* value_blob_[kNumShards];
 #endif
@@ -64,36 +156,40 @@ class DBClient {
   size_t search_visit_cnt_ = 0;
   size_t height_visit_cnt_[kMaxHeight] = {};
 
-#ifdef GROUP_LOGGING
-  struct LogItem {
-    Key key;
-    uint64_t tag;
-    Value value;
-    MemNode* mem_node;
-    //uint64_t offset;
-  };
-  std::vector<LogItem> log_group_[kNumShards];
-  size_t log_group_alloc_size_[kNumShards];
-#endif
-
   //std::vector<std::chrono::duration<double>> latencies_;
 };
 
-DBClient::DBClient(ListDB* db, int id, int region) : db_(db), id_(id), region_(region % kNumRegions), rnd_(id) {
-  for (int i = 0; i < kNumShards; i++) {
+DBClient::DBClient(ListDB* db, int id, int region)
+    : db_(db), num_shards_(db->num_shards()), id_(id), region_(region % kNumRegions), rnd_(id),
+      log_nt_store_(db->options().log_nt_store) {
+  for (int i = 0; i < num_shards_; i++) {
     log_[i] = db_->log(region_, i);
+    log_combiner_[i] = db_->log_combiner(region_, i);
 #ifdef LISTDB_WISCKEY
     value_blob_[i] = db_->value_blob(region_, i);
 #endif
   }
   l0_pool_id_ = db_->l0_pool_id(region_);
   l1_pool_id_ = db_->l1_pool_id(region_);
+  l1_region_ = db_->pool_id_to_region(l1_pool_id_);
+  writer_slot_ = db_->RegisterWriter();
+  epoch_slot_ = db_->epoch_manager()->Register();
+  WithPersistence(db_->options().persistence, [this](auto p) {
+    write_entry_fn_ = &DBClient::WriteEntryImpl<decltype(p)>;
+    write_fn_ = &DBClient::WriteImpl<decltype(p)>;
+  });
+}
+
+DBClient::~DBClient() {
+  db_->UnregisterWriter(writer_slot_);
+  db_->epoch_manager()->Unregister(epoch_slot_);
 }
 
 void DBClient::SetRegion(int region) {
   region_ = region;
-  for (int i = 0; i < kNumShards; i++) {
+  for (int i = 0; i < num_shards_; i++) {
     log_[i] = db_->log(region_, i);
+    log_combiner_[i] = db_->log_combiner(region_, i);
 #ifdef LISTDB_WISCKEY
     value_blob_[i] = db_->value_blob(region_, i);
 #endif
@@ -101,117 +197,299 @@ void DBClient::SetRegion(int region) {
 }
 
 void DBClient::Put(const Key& key, const Value& value) {
-#ifndef GROUP_LOGGING
+  WriteEntry(key, value, kTypeValue);
+}
+
+bool DBClient::Put(const Key& key, const std::string_view& value) {
+  if (value.size() > kMaxInlineValueSize) {
+    return false;
+  }
+  WriteEntry(key, value.size(), kTypeInlineValue, value);
+  return true;
+}
+
+void DBClient::Delete(const Key& key) {
+  WriteEntry(key, 0, kTypeDeletion);
+}
+
+inline void DBClient::WriteEntry(const Key& key, const Value& value, const ValueType type,
+                                 const std::string_view& inline_value) {
+  (this->*write_entry_fn_)(key, value, type, inline_value);
+}
+
+template <typename Persistence>
+void DBClient::WriteEntryImpl(const Key& key, const Value& value, const ValueType type,
+                              const std::string_view& inline_value) {
   int s = KeyShard(key);
 
   uint64_t pmem_height = PmemRandomHeight();
   size_t iul_entry_size = sizeof(PmemNode) + (pmem_height - 1) * sizeof(uint64_t);
   size_t kv_size = key.size() + sizeof(Value);
+  iul_entry_size += key.out_of_line_size();
+  if (type == kTypeInlineValue) {
+    iul_entry_size += util::AlignedSize(8, inline_value.size());
+    kv_size += inline_value.size();
+  }
+
+  // The MemTable is retired once flushed, so it is pinned until w_UnRef
+  EpochGuard guard(db_->epoch_manager(), epoch_slot_);
 
   // Determine L0 id
-  auto mem = db_->GetWritableMemTable(kv_size, s);
+  auto mem = db_->GetWritableMemTable(kv_size, s, writer_slot_->client);
   uint64_t l0_id = mem->l0_id();
+  uint64_t seq = db_->BeginWrite(writer_slot_);
 
   // Write log
-  auto log_paddr = log_[s]->Allocate(iul_entry_size);
-  PmemNode* iul_entry = (PmemNode*) log_paddr.get();
-#ifdef LOG_NTSTORE
-  _mm_stream_pi((__m64*) &iul_entry->tag, (__m64) pmem_height);
-  _mm_stream_pi((__m64*) &iul_entry->value, (__m64) value);
-  //_mm_sfence();
-  _mm_stream_pi((__m64*) &iul_entry->key, (__m64) (uint64_t) key);
-#else
-  iul_entry->tag = (l0_id << 32) | pmem_height;
-  iul_entry->value = value;
-  clwb(&iul_entry->tag, 16);
-  _mm_sfence();
-  iul_entry->key = key;
-  clwb(iul_entry, 8);
-  //clwb(iul_entry, sizeof(PmemNode) - sizeof(uint64_t));
-#endif
+  PmemPtr log_paddr;
+  Key stored_key = key;
+  LogCombiner::Entry entry{key, MakeTag(seq, l0_id, type, pmem_height), value,
+                           inline_value, (int) pmem_height, iul_entry_size};
+  if (log_combiner_[s] && writer_slot_->client != Table::kSharedClient) {
+    log_paddr = log_combiner_[s]->Append(writer_slot_->client, entry);
+    // May refer to the out-of-line key bytes in the log
+    stored_key = log_paddr.get<PmemNode>()->key;
+  } else if (Persistence::kMode == PersistenceMode::kADR && log_nt_store_) {
+    log_paddr = log_[s]->Allocate(iul_entry_size);
+    char* dst = (char*) log_paddr.get();
+    log_stage_.assign(iul_entry_size, 0);
+    stored_key = LogCombiner::StageEntry(entry, log_paddr.pool_id(), log_stage_.data(), dst);
+    memcpy_nt(dst + sizeof(Key), log_stage_.data() + sizeof(Key), iul_entry_size - sizeof(Key));
+    _mm_sfence();
+    store_words_nt(dst, &stored_key, sizeof(Key));
+    // Orders the key before the MemTable node that publishes the entry
+    _mm_sfence();
+  } else {
+    log_paddr = log_[s]->Allocate(iul_entry_size);
+    PmemNode* iul_entry = (PmemNode*) log_paddr.get();
+    // Key bytes past the node key, then value bytes, go after the next pointers
+    char* data_p = (char*) &iul_entry->next[pmem_height];
+    stored_key = key.StoreOutOfLine(log_paddr.pool_id(), data_p);
+    data_p += key.out_of_line_size();
+    if (type == kTypeInlineValue) {
+      memcpy(data_p, inline_value.data(), inline_value.size());
+      data_p += inline_value.size();
+    }
+    if (data_p != (char*) &iul_entry->next[pmem_height]) {
+      Persistence::Flush(&iul_entry->next[pmem_height], data_p - (char*) &iul_entry->next[pmem_height]);
+    }
+    iul_entry->tag = entry.tag;
+    iul_entry->value = value;
+    Persistence::Flush(&iul_entry->tag, 16);
+    Persistence::Fence();
+    iul_entry->key = stored_key;
+    Persistence::Flush(iul_entry, sizeof(Key));
+    //clwb(iul_entry, sizeof(PmemNode) - sizeof(uint64_t));
+  }
 
   // Create skiplist node
   uint64_t dram_height = DramRandomHeight();
-  MemNode* node = (MemNode*) malloc(sizeof(MemNode) + (dram_height - 1) * sizeof(uint64_t));
-  node->key = key;
-  node->tag = (l0_id << 32) | dram_height;
-  // node->value = log_paddr.dump();
-  node->value = value;
+  MemNode* node = (MemNode*) mem->AllocateNode(sizeof(MemNode) + (dram_height - 1) * sizeof(uint64_t));
+  node->key = stored_key;
+  node->tag = MakeTag(seq, l0_id, type, dram_height);
+  node->value = log_paddr.dump();
   memset((void*) &node->next[0], 0, dram_height * sizeof(uint64_t));
 
   auto skiplist = mem->skiplist();
   skiplist->Insert(node);
-  mem->w_UnRef();
-#else
-  int s = KeyShard(key);
+  db_->FinishWrite(writer_slot_);
+  mem->w_UnRef(writer_slot_->client);
+}
 
-  uint64_t height = RandomHeight();
+bool DBClient::Write(const WriteBatch& batch) {
+  return (this->*write_fn_)(batch);
+}
 
-  size_t kv_size = key.size() + sizeof(Value);
+template <typename Persistence>
+bool DBClient::WriteImpl(const WriteBatch& batch) {
+  auto& entries = batch.entries();
+  if (entries.empty()) {
+    return true;
+  }
 
+  struct BatchItem {
+    int shard;
+    int pmem_height;
+    const WriteBatch::Entry* entry;
+  };
+  struct ShardGroup {
+    size_t begin;
+    size_t end;
+    size_t kv_size;
+    MemTable* mem;
+  };
+  struct BatchRun {
+    MemTable* mem;  // set on the last run of a shard
+    PmemPtr paddr;
+    size_t begin;
+    size_t end;
+  };
 
-  // Create skiplist node
-  MemNode* node = (MemNode*) malloc(sizeof(MemNode) + (height - 1) * sizeof(uint64_t));
-  node->key = key;
-  node->tag = height;
-  node->value = value;
-  // node->value = 0;
-  memset(&node->next[0], 0, height * sizeof(uint64_t));
-
-  auto mem = db_->GetWritableMemTable(kv_size, s);
-  auto skiplist = mem->skiplist();
+  // Group by shard, keeping the order of entries within a shard
+  std::vector<BatchItem> items;
+  items.reserve(entries.size());
+  for (auto& entry : entries) {
+    items.push_back(BatchItem{KeyShard(entry.key), PmemRandomHeight(), &entry});
+  }
+  std::stable_sort(items.begin(), items.end(),
+                   [](const BatchItem& a, const BatchItem& b) { return a.shard < b.shard; });
 
-  size_t iul_entry_size = sizeof(PmemNode) + (height - 1) * sizeof(uint64_t);
-  log_group_[s].emplace_back(LogItem{ key, height, value, node });
-  log_group_alloc_size_[s] += iul_entry_size;
-  if (log_group_[s].size() > 7) {
-    int group_size = log_group_[s].size();
-    //size_t log_space = 0;
-    //std::vector<size_t> offset;
-    //for (int i = 0; i < group_size; i++) {
-    //  size_t iul_entry_size = sizeof(PmemNode) + (log_group_[s][i].tag - 1) * sizeof(uint64_t);
-    //  offset.push_back(log_space);
-    //  log_space += iul_entry_size;
-    //}
-    // Write log
-    auto log_paddr = log_[s]->Allocate(log_group_alloc_size_[s]);
-    char* p = (char*) log_paddr.get();
-    auto pool_id = log_paddr.pool_id();
-    auto pool_offset = log_paddr.offset();
-
-    for (int i = 0; i < group_size; i++) {
-      PmemNode* iul_entry = (PmemNode*) (p);
-      iul_entry->key = log_group_[s][i].key;
-      iul_entry->tag = log_group_[s][i].tag;
-      iul_entry->value = log_group_[s][i].value;
-      log_group_[s][i].mem_node->value = PmemPtr(pool_id, p).dump();
-      p += sizeof(PmemNode) + (log_group_[s][i].tag - 1) * 8;
-    }
-
-    clwb(log_paddr.get(), log_group_alloc_size_[s]);
-    log_group_[s].clear();
-    log_group_alloc_size_[s] = 0;
+  // The MemTable of a shard holds all its entries until the batch is inserted
+  const size_t shard_capacity = db_->options().memtable_capacity / num_shards_;
+  std::vector<ShardGroup> groups;
+  for (size_t i = 0; i < items.size(); i++) {
+    if (i == 0 || items[i].shard != items[i - 1].shard) {
+      groups.push_back(ShardGroup{i, i, 0, nullptr});
+    }
+    auto& group = groups.back();
+    group.end = i + 1;
+    group.kv_size += items[i].entry->key.size() + sizeof(Value);
+    if (group.kv_size > shard_capacity) {
+      return false;
+    }
   }
 
-  skiplist->Insert(node);
-  mem->w_UnRef();
-#endif
+  // Pinned until every MemTable is unreferenced, as in WriteEntryImpl
+  EpochGuard guard(db_->epoch_manager(), epoch_slot_);
+
+  // Taken before the seqorder, so that no snapshot waits for this writer
+  // while it is stalled on a full MemTable. A referenced MemTable cannot be
+  // flushed, so the references are dropped before waiting on a stalled
+  // shard, which another batch holding it may wait for in turn.
+  size_t num_taken = 0;
+  while (num_taken < groups.size()) {
+    auto& group = groups[num_taken];
+    const int s = items[group.begin].shard;
+    group.mem = db_->TryGetWritableMemTable(group.kv_size, s, writer_slot_->client);
+    if (group.mem == nullptr) {
+      for (size_t g = 0; g < num_taken; g++) {
+        groups[g].mem->w_UnRef(writer_slot_->client);
+      }
+      num_taken = 0;
+      db_->WaitForWritableMemTable(s);
+      continue;
+    }
+    num_taken++;
+  }
 
-  //size_t log_alloc_size = util::AlignedSize(8, LogWriter::Entry::ComputeAllocSize(key, height));
-  //size_t node_alloc_size = util::AlignedSize(8, MemNode::ComputeAllocSize(key, height));
+  // All entries of the batch share one seqorder
+  uint64_t seq = db_->BeginWrite(writer_slot_);
 
-  //put_group_[s].emplace_back(key, value, height, log_alloc_size, node_alloc_size);
-  //group_state_[s].kv_size += key.size() + /* value.size() */ 8;
-  //group_state_[s].log_alloc_size += log_alloc_size;
-  //group_state_[s].node_alloc_size += node_alloc_size;
-  //if (group_state_[s].log_alloc_size >= 1024) {
-  //  ProcessPutGroup(s);
-  //}
+  // Write one contiguous run per shard. A run never spans log blocks, so a
+  // large group is split into several runs of the same MemTable.
+  std::vector<BatchRun> runs;
+  PmemPtr commit_paddr;
+  for (auto& group : groups) {
+    const int s = items[group.begin].shard;
+    const size_t group_end = group.end;
+    auto mem = group.mem;
+    uint64_t l0_id = mem->l0_id();
+
+    size_t begin = group.begin;
+    while (begin < group_end) {
+      size_t run_size = batch_log::kHeaderSize;
+      size_t end = begin;
+      while (end < group_end) {
+        size_t iul_entry_size = sizeof(PmemNode) + (items[end].pmem_height - 1) * sizeof(uint64_t) +
+                                items[end].entry->key.out_of_line_size();
+        if (end > begin && run_size + iul_entry_size > db_->options().log_block_size) {
+          break;
+        }
+        run_size += iul_entry_size;
+        end++;
+      }
+
+      auto log_paddr = log_[s]->Allocate(run_size);
+      if (runs.empty()) {
+        commit_paddr = log_paddr;
+      }
+      char* p = (char*) log_paddr.get();
+      batch_log::InitHeader((PmemNode*) p, l0_id, run_size, commit_paddr);
+      p += batch_log::kHeaderSize;
+      for (size_t i = begin; i < end; i++) {
+        PmemNode* iul_entry = (PmemNode*) p;
+        iul_entry->key = items[i].entry->key.StoreOutOfLine(log_paddr.pool_id(),
+                                                            (char*) &iul_entry->next[items[i].pmem_height]);
+        iul_entry->tag = MakeTag(seq, l0_id, items[i].entry->type, items[i].pmem_height);
+        iul_entry->value = items[i].entry->value;
+        p += iul_entry->alloc_size();
+      }
+      Persistence::Flush(log_paddr.get(), run_size);
+      runs.push_back(BatchRun{(end == group_end) ? mem : nullptr, log_paddr, begin, end});
+      begin = end;
+    }
+  }
+  Persistence::Fence();
+
+  // Commit
+  PmemNode* commit_header = commit_paddr.get<PmemNode>();
+  commit_header->next[0] = 1;
+  Persistence::Flush(&commit_header->next[0], 8);
+  Persistence::Fence();
+
+  // Create skiplist nodes
+  size_t run_begin = 0;
+  for (size_t r = 0; r < runs.size(); r++) {
+    if (runs[r].mem == nullptr) {
+      continue;
+    }
+    // runs[run_begin..r] share the MemTable of the last run
+    auto mem = runs[r].mem;
+    auto skiplist = mem->skiplist();
+    uint64_t l0_id = mem->l0_id();
+    for (; run_begin <= r; run_begin++) {
+      auto& run = runs[run_begin];
+      char* p = (char*) run.paddr.get() + batch_log::kHeaderSize;
+      for (size_t i = run.begin; i < run.end; i++) {
+        PmemNode* iul_entry = (PmemNode*) p;
+        uint64_t dram_height = DramRandomHeight();
+        MemNode* node = (MemNode*) mem->AllocateNode(sizeof(MemNode) + (dram_height - 1) * sizeof(uint64_t));
+        node->key = iul_entry->key;
+        node->tag = MakeTag(seq, l0_id, items[i].entry->type, dram_height);
+        node->value = PmemPtr(run.paddr.pool_id(), p).dump();
+        memset((void*) &node->next[0], 0, dram_height * sizeof(uint64_t));
+        skiplist->Insert(node);
+        p += iul_entry->alloc_size();
+      }
+    }
+    mem->w_UnRef(writer_slot_->client);
+  }
+  db_->FinishWrite(writer_slot_);
+  return true;
+}
+
+bool DBClient::Get(const Key& key, Value* value_out, const Snapshot* snapshot) {
+  PmemNode* entry = GetEntry(key, snapshot);
+  if (entry == nullptr || entry->type() == kTypeDeletion) {
+    return false;
+  }
+  *value_out = EntryValue(entry);
+  return true;
+}
+
+bool DBClient::Get(const Key& key, std::string* value_out, const Snapshot* snapshot) {
+  PmemNode* entry = GetEntry(key, snapshot);
+  if (entry == nullptr || entry->type() == kTypeDeletion) {
+    return false;
+  }
+  if (entry->type() == kTypeInlineValue) {
+    value_out->assign(entry->inline_value(), entry->value);
+  } else {
+    value_out->assign((char*) &entry->value, sizeof(Value));
+  }
+  return true;
+}
+
+inline Value DBClient::EntryValue(const PmemNode* entry) {
+  if (entry->type() == kTypeInlineValue) {
+    return (Value) entry->inline_value();
+  }
+  return entry->value;
 }
 
-bool DBClient::Get(const Key& key, Value* value_out) {
+DBClient::PmemNode* DBClient::GetEntry(const Key& key, const Snapshot* snapshot) {
   int s = KeyShard(key);
   {
+    EpochGuard guard(db_->epoch_manager(), epoch_slot_);
     MemTableList* tl = (MemTableList*) db_->GetTableList(0, s);
 
     auto table = tl->GetFront();
@@ -220,9 +498,13 @@ bool DBClient::Get(const Key& key, Value* value_out) {
         auto mem = (MemTable*) table;
         auto skiplist = mem->skiplist();
         auto found = skiplist->Lookup(key);
+        if (snapshot) {
+          while (found && found->key == key && !SeqVisible(found->seq(), snapshot->seq())) {
+            found = found->next[0].load(std::memory_order_acquire);
+          }
+        }
         if (found && found->key == key) {
-          *value_out = found->value;
-          return true;
+          return PmemPtr::Decode<PmemNode>(found->value);
         }
       } else if (table->type() == TableType::kPmemTable) {
         break;
@@ -232,78 +514,298 @@ bool DBClient::Get(const Key& key, Value* value_out) {
 
 #ifdef LISTDB_L0_CACHE
     {
-      auto ht = db_->GetHashTable(s);
-#if LISTDB_L0_CACHE == L0_CACHE_T_SIMPLE
-      if (ht->Get(key, value_out)) {
-        return true;
-      }
-#elif LISTDB_L0_CACHE == L0_CACHE_T_STATIC
-      ListDB::PmemNode* rv = ht->Lookup(key);
-      if (rv) {
-        *value_out = rv->value;
-        return true;
+      PmemNode* rv = L0CacheLookup(key, s);
+      if (rv && (!snapshot || SeqVisible(rv->seq(), snapshot->seq()))) {
+        return rv;
       }
-#elif LISTDB_L0_CACHE == L0_CACHE_T_DOUBLE_HASHING
-      ListDB::PmemNode* rv = ht->Lookup(key);
-      if (rv) {
-        *value_out = rv->value;
-        return true;
-      }
-#elif LISTDB_L0_CACHE == L0_CACHE_T_LINEAR_PROBING
-      ListDB::PmemNode* rv = ht->Lookup(key);
-      if (rv) {
-        *value_out = rv->value;
-        return true;
-      }
-#endif
     }
 #endif
     pmem_get_cnt_++;
+    const uint64_t key_hash = BloomFilter::Hash(key);
     while (table) {
       auto pmem = (PmemTable*) table;
+      if (!pmem->MayContain(key_hash)) {
+        table = table->Next();
+        continue;
+      }
       auto skiplist = pmem->skiplist();
       //auto found_paddr = skiplist->Lookup(key, region_);
       auto found_paddr = Lookup(key, l0_pool_id_, skiplist);
       ListDB::PmemNode* found = (ListDB::PmemNode*) found_paddr.get();
+      if (snapshot) {
+        while (found && found->key == key && !SeqVisible(found->seq(), snapshot->seq())) {
+          found = PmemPtr::Decode<PmemNode>(found->next[0]);
+        }
+      }
       if (found && found->key == key) {
         //fprintf(stdout, "found on pmem\n");
-        *value_out = found->value;
-        return true;
+        return found;
       }
       table = table->Next();
     }
   }
   {
     // Level 1 Lookup
+#if defined(LISTDB_DRAM_LAYERED_L1) || defined(LISTDB_L1_LRU) || defined(LISTDB_SKIPLIST_CACHE)
+    // DRAM nodes of L1 caches are retired through the epoch manager
+    EpochGuard guard(db_->epoch_manager(), epoch_slot_);
+#endif
     auto tl = (PmemTableList*) db_->GetTableList(1, s);
     auto table = tl->GetFront();
     while (table) {
       auto pmem = (PmemTable*) table;
-      auto skiplist = pmem->skiplist();
       //auto found_paddr = skiplist->Lookup(key, region_);
-      auto found_paddr = LookupL1(key, l1_pool_id_, skiplist, s);
+      auto found_paddr = LookupL1(key, l1_pool_id_, pmem, s);
       ListDB::PmemNode* found = (ListDB::PmemNode*) found_paddr.get();
+      if (snapshot) {
+        while (found && found->key == key && !SeqVisible(found->seq(), snapshot->seq())) {
+          found = PmemPtr::Decode<PmemNode>(found->next[0]);
+        }
+      }
       if (found && found->key == key) {
         //fprintf(stdout, "found on pmem\n");
-        *value_out = found->value;
-        return true;
+        return found;
       }
       table = table->Next();
     }
   }
-  return false;
+  return nullptr;
+}
+
+#ifdef LISTDB_L0_CACHE
+inline DBClient::PmemNode* DBClient::L0CacheLookup(const Key& key, const int s) {
+  auto ht = db_->GetHashTable(s);
+#if LISTDB_L0_CACHE == L0_CACHE_T_SIMPLE
+  uint64_t iul_paddr;
+  if (ht->Get(key, &iul_paddr)) {
+    return PmemPtr::Decode<PmemNode>(iul_paddr);
+  }
+  return nullptr;
+#else
+  return ht->Lookup(key);
+#endif
+}
+#endif
+
+void DBClient::MultiGet(const std::vector<Key>& keys, std::vector<Value>* values,
+                        std::vector<bool>* found) {
+  const size_t n = keys.size();
+  values->assign(n, 0);
+  found->assign(n, false);
+  EpochGuard guard(db_->epoch_manager(), epoch_slot_);
+
+  // Group by shard so that keys of the same shard share table lists and
+  // upper layers in cache
+  std::vector<MultiGetState> states(n);
+  for (size_t i = 0; i < n; i++) {
+    states[i].index = i;
+    states[i].shard = KeyShard(keys[i]);
+  }
+  std::stable_sort(states.begin(), states.end(),
+                   [](const MultiGetState& a, const MultiGetState& b) { return a.shard < b.shard; });
+  for (auto& st : states) {
+    st.key = &keys[st.index];
+    st.key_hash = BloomFilter::Hash(keys[st.index]);
+    st.table = db_->GetTableList(0, st.shard)->GetFront();
+    st.list_level = 0;
+    MultiGetSeekTable(&st);
+  }
+
+  // Advance the traversals in lock-step. Each step ends with a prefetch of
+  // the node the next step of the same key will touch, so the misses of all
+  // keys are in flight together.
+  std::vector<MultiGetState*> active;
+  active.reserve(n);
+  for (auto& st : states) {
+    if (st.stage != MultiGetStage::kDone) {
+      active.push_back(&st);
+    }
+  }
+  while (!active.empty()) {
+    size_t num_active = 0;
+    for (auto st : active) {
+      MultiGetStep(st);
+      if (st->stage != MultiGetStage::kDone) {
+        active[num_active++] = st;
+      }
+    }
+    active.resize(num_active);
+  }
+
+  for (auto& st : states) {
+    (*found)[st.index] = st.found;
+    (*values)[st.index] = st.value;
+  }
+}
+
+// Positions the state at the beginning of st->table, moving on to the next
+// table (and level) as needed.
+void DBClient::MultiGetSeekTable(MultiGetState* st) {
+  while (true) {
+    if (st->table == nullptr) {
+      if (st->list_level == 0) {
+        st->list_level = 1;
+        st->table = db_->GetTableList(1, st->shard)->GetFront();
+        continue;
+      }
+      st->stage = MultiGetStage::kDone;
+      return;
+    }
+    if (st->table->type() == TableType::kMemTable) {
+      auto pred = ((MemTable*) st->table)->skiplist()->head();
+      st->stage = MultiGetStage::kMemTable;
+      st->pred = pred;
+      st->height = pred->height() - 1;
+      _mm_prefetch((const char*) pred->next[st->height].load(std::memory_order_acquire), _MM_HINT_T0);
+      return;
+    }
+    if (st->list_level == 0 && !st->l0_visited) {
+      st->l0_visited = true;
+      pmem_get_cnt_++;
+#ifdef LISTDB_L0_CACHE
+      PmemNode* rv = L0CacheLookup(*st->key, st->shard);
+      if (rv) {
+        st->found = (rv->type() != kTypeDeletion);
+        st->value = EntryValue(rv);
+        st->stage = MultiGetStage::kDone;
+        return;
+      }
+#endif
+    }
+    if (st->list_level == 0 && !((PmemTable*) st->table)->MayContain(st->key_hash)) {
+      st->table = st->table->Next();
+      continue;
+    }
+    auto skiplist = ((PmemTable*) st->table)->skiplist();
+    st->pool_id = (st->list_level == 0) ? l0_pool_id_ : l1_pool_id_;
+#if defined(LISTDB_L1_LRU) || defined(LISTDB_SKIPLIST_CACHE) || defined(LISTDB_DRAM_LAYERED_L1)
+    if (st->list_level == 1) {
+      // L1 caches pick their own start node
+      auto found = LookupL1(*st->key, st->pool_id, (PmemTable*) st->table, st->shard).get<PmemNode>();
+      if (found && found->key == *st->key) {
+        st->found = (found->type() != kTypeDeletion);
+        st->value = EntryValue(found);
+        st->stage = MultiGetStage::kDone;
+        return;
+      }
+      st->table = st->table->Next();
+      continue;
+    }
+#endif
+    auto pred = skiplist->head(st->pool_id);
+    st->stage = MultiGetStage::kPmemTable;
+    st->pred = pred;
+    st->height = pred->height() - 1;
+    _mm_prefetch((const char*) PmemPtr::Decode<PmemNode>(pred->next[st->height]), _MM_HINT_T0);
+    return;
+  }
+}
+
+void DBClient::MultiGetStep(MultiGetState* st) {
+  const Key& key = *st->key;
+  if (st->stage == MultiGetStage::kMemTable) {
+    auto pred = (MemNode*) st->pred;
+    MemNode* curr = pred->next[st->height].load(std::memory_order_acquire);
+    if (curr && curr->key.Compare(key) < 0) {
+      st->pred = curr;
+      _mm_prefetch((const char*) curr->next[st->height].load(std::memory_order_acquire), _MM_HINT_T0);
+      return;
+    }
+    if (st->height > 0) {
+      st->height--;
+      _mm_prefetch((const char*) pred->next[st->height].load(std::memory_order_acquire), _MM_HINT_T0);
+      return;
+    }
+    if (curr && curr->key == key) {
+      if (curr->type() == kTypeDeletion) {
+        st->stage = MultiGetStage::kDone;
+        return;
+      }
+      // Read the value from the IUL entry in the next step
+      st->pred = PmemPtr::Decode<PmemNode>(curr->value);
+      st->stage = MultiGetStage::kMemTableValue;
+      _mm_prefetch((const char*) st->pred, _MM_HINT_T0);
+      return;
+    }
+  } else if (st->stage == MultiGetStage::kMemTableValue) {
+    st->found = true;
+    st->value = EntryValue((PmemNode*) st->pred);
+    st->stage = MultiGetStage::kDone;
+    return;
+  } else if (st->stage == MultiGetStage::kPmemTable) {
+    auto pred = (PmemNode*) st->pred;
+    auto curr = PmemPtr::Decode<PmemNode>(pred->next[st->height]);
+    if (curr && curr->key.Compare(key) < 0) {
+      st->pred = curr;
+      _mm_prefetch((const char*) PmemPtr::Decode<PmemNode>(curr->next[st->height]), _MM_HINT_T0);
+      return;
+    }
+    if (st->height > 0) {
+      st->height--;
+      if (st->height == 0) {
+        // Braided bottom layer
+        auto skiplist = ((PmemTable*) st->table)->skiplist();
+        if (pred == skiplist->head(st->pool_id)) {
+          pred = skiplist->head();
+          st->pred = pred;
+        }
+      }
+      _mm_prefetch((const char*) PmemPtr::Decode<PmemNode>(pred->next[st->height]), _MM_HINT_T0);
+      return;
+    }
+    if (curr && curr->key == key) {
+      st->found = (curr->type() != kTypeDeletion);
+      st->value = EntryValue(curr);
+      st->stage = MultiGetStage::kDone;
+      return;
+    }
+  }
+  // Not found in this table
+  st->table = st->table->Next();
+  MultiGetSeekTable(st);
+}
+
+Iterator* DBClient::NewIterator(const Snapshot* snapshot) {
+  // The MemTables are kept alive until the iterator is deleted
+  auto guard = new EpochGuard(db_->epoch_manager());
+  std::vector<Iterator*> children;
+  for (int s = 0; s < num_shards_; s++) {
+    // Level 0 (MemTables and L0 PmemTables) from the newest to the oldest
+    auto table = db_->GetTableList(0, s)->GetFront();
+    while (table) {
+      if (table->type() == TableType::kMemTable) {
+        children.push_back(table->NewIterator(snapshot));
+      } else {
+        children.push_back(((PmemTable*) table)->NewIterator(l0_pool_id_, snapshot));
+      }
+      table = table->Next();
+    }
+    // Level 1
+    table = db_->GetTableList(1, s)->GetFront();
+    while (table) {
+      children.push_back(((PmemTable*) table)->NewIterator(l1_pool_id_, snapshot));
+      table = table->Next();
+    }
+  }
+  auto iter = new MergingIterator(std::move(children));
+  iter->RegisterCleanup([guard] { delete guard; });
+  return iter;
 }
 
 #if defined(LISTDB_STRING_KEY) && defined(LISTDB_WISCKEY)
 void DBClient::PutStringKV(const std::string_view& key_sv, const std::string_view& value) {
+#ifdef LISTDB_VARIABLE_LENGTH_KEY
+  Key key(key_sv);
+#else
   Key& key = *((Key*) key_sv.data());
+#endif
   //if (!key.Valid()) {
   //  fprintf(stdout, "key is not valid: %s, %zu, key_num=%zu\n", std::string(key_sv).c_str(), *((uint64_t*) key.data()), key.key_num());
   //}
   int s = KeyShard(key);
 
   uint64_t pmem_height = PmemRandomHeight();
-  size_t iul_entry_size = sizeof(PmemNode) + (pmem_height - 1) * sizeof(uint64_t);
+  size_t iul_entry_size = sizeof(PmemNode) + (pmem_height - 1) * sizeof(uint64_t) + key.out_of_line_size();
   //size_t kv_size = key.size() + value.size();
 
   // Write value
@@ -316,37 +818,48 @@ void DBClient::PutStringKV(const std::string_view& key_sv, const std::string_vie
 
   uint64_t dram_height = DramRandomHeight();
   size_t mem_node_size = sizeof(MemNode) + (dram_height - 1) * sizeof(uint64_t);
-  auto mem = db_->GetWritableMemTable(mem_node_size, s);
+  EpochGuard guard(db_->epoch_manager(), epoch_slot_);
+  auto mem = db_->GetWritableMemTable(mem_node_size, s, writer_slot_->client);
   uint64_t l0_id = mem->l0_id();
+  uint64_t seq = db_->BeginWrite(writer_slot_);
 
   // Write log
   auto log_paddr = log_[s]->Allocate(iul_entry_size);
   PmemNode* iul_entry = (PmemNode*) log_paddr.get();
-  iul_entry->tag = (l0_id << 32) | pmem_height;
+  Key stored_key = key.StoreOutOfLine(log_paddr.pool_id(), (char*) &iul_entry->next[pmem_height]);
+  if (key.out_of_line_size() > 0) {
+    clwb(&iul_entry->next[pmem_height], key.out_of_line_size());
+  }
+  iul_entry->tag = MakeTag(seq, l0_id, kTypeValue, pmem_height);
   iul_entry->value = value_paddr.dump();
   clwb(&iul_entry->tag, 16);
   _mm_sfence();
-  iul_entry->key = key;
-  clwb(iul_entry, key.size());
+  iul_entry->key = stored_key;
+  clwb(iul_entry, sizeof(Key));
   //clwb(iul_entry, sizeof(PmemNode) - sizeof(uint64_t));
 
   // Create skiplist node
-  MemNode* node = (MemNode*) malloc(mem_node_size);
-  node->key = key;
-  node->tag = (l0_id << 32) | dram_height;
-  node->value = value;
-  // node->value = log_paddr.dump();
+  MemNode* node = (MemNode*) mem->AllocateNode(mem_node_size);
+  node->key = stored_key;
+  node->tag = MakeTag(seq, l0_id, kTypeValue, dram_height);
+  node->value = log_paddr.dump();
   memset((void*) &node->next[0], 0, dram_height * sizeof(uint64_t));
 
   auto skiplist = mem->skiplist();
   skiplist->Insert(node);
-  mem->w_UnRef();
+  db_->FinishWrite(writer_slot_);
+  mem->w_UnRef(writer_slot_->client);
 }
 
 bool DBClient::GetStringKV(const std::string_view& key_sv, Value* value_out) {
+#ifdef LISTDB_VARIABLE_LENGTH_KEY
+  Key key(key_sv);
+#else
   Key& key = *((Key*) key_sv.data());
+#endif
   int s = KeyShard(key);
   {
+    EpochGuard guard(db_->epoch_manager(), epoch_slot_);
     MemTableList* tl = (MemTableList*) db_->GetTableList(0, s);
 
     auto table = tl->GetFront();
@@ -390,12 +903,23 @@ bool DBClient::GetStringKV(const std::string_view& key_sv, Value* value_out) {
         *value_out = (uint64_t) PmemPtr::Decode<char>(rv->value);
         return true;
       }
+#elif LISTDB_L0_CACHE == L0_CACHE_T_CUCKOO
+      ListDB::PmemNode* rv = ht->Lookup(key);
+      if (rv) {
+        *value_out = (uint64_t) PmemPtr::Decode<char>(rv->value);
+        return true;
+      }
 #endif
     }
 #endif
     pmem_get_cnt_++;
+    const uint64_t key_hash = BloomFilter::Hash(key);
     while (table) {
       auto pmem = (PmemTable*) table;
+      if (!pmem->MayContain(key_hash)) {
+        table = table->Next();
+        continue;
+      }
       auto skiplist = pmem->skiplist();
       //auto found_paddr = skiplist->Lookup(key, region_);
       auto found_paddr = Lookup(key, l0_pool_id_, skiplist);
@@ -415,13 +939,16 @@ bool DBClient::GetStringKV(const std::string_view& key_sv, Value* value_out) {
   }
   {
     // Level 1 Lookup
+#if defined(LISTDB_DRAM_LAYERED_L1) || defined(LISTDB_L1_LRU) || defined(LISTDB_SKIPLIST_CACHE)
+    // DRAM nodes of L1 caches are retired through the epoch manager
+    EpochGuard guard(db_->epoch_manager(), epoch_slot_);
+#endif
     auto tl = (PmemTableList*) db_->GetTableList(1, s);
     auto table = tl->GetFront();
     while (table) {
       auto pmem = (PmemTable*) table;
-      auto skiplist = pmem->skiplist();
       //auto found_paddr = skiplist->Lookup(key, region_);
-      auto found_paddr = LookupL1(key, l1_pool_id_, skiplist, s);
+      auto found_paddr = LookupL1(key, l1_pool_id_, pmem, s);
       ListDB::PmemNode* found = (ListDB::PmemNode*) found_paddr.get();
       if (found && found->key == key) {
         //fprintf(stdout, "found on pmem\n");
@@ -471,8 +998,12 @@ inline int DBClient::DramRandomHeight() {
   return height;
 }
 
-inline int DBClient::KeyShard(const Key& key) {
-  return key.key_num() % kNumShards;
+inline int DBClient::KeyShard(const Key& key) const {
+  // The default shard count keeps a constant divisor
+  if (num_shards_ == kNumShards) {
+    return key.key_num() % kNumShards;
+  }
+  return key.key_num() % num_shards_;
   //return key.key_num() / kShardSize;
 }
 
@@ -584,8 +1115,9 @@ PmemPtr DBClient::Lookup(const Key& key, const int pool_id, BraidedPmemSkipList*
   return curr_paddr_dump;
 }
 
-PmemPtr DBClient::LookupL1(const Key& key, const int pool_id, BraidedPmemSkipList* skiplist, const int shard) {
+PmemPtr DBClient::LookupL1(const Key& key, const int pool_id, PmemTable* table, const int shard) {
   using Node = PmemNode;
+  auto skiplist = table->skiplist();
   Node* pred = skiplist->head(pool_id);
   uint64_t curr_paddr_dump;
   Node* curr;
@@ -607,7 +1139,7 @@ PmemPtr DBClient::LookupL1(const Key& key, const int pool_id, BraidedPmemSkipLis
   } 
 
   {
-    auto c = db_->lru_cache(shard, pool_id);
+    auto c = db_->lru_cache(shard, l1_region_);
     uint64_t lt = c->FindLessThan(key);
     if (lt != 0) {
       pred = (Node*) ((PmemPtr*) &lt)->get();
@@ -616,7 +1148,7 @@ PmemPtr DBClient::LookupL1(const Key& key, const int pool_id, BraidedPmemSkipLis
   }
 #endif
 #ifdef LISTDB_SKIPLIST_CACHE
-  auto c = db_->skiplist_cache(shard, db_->pool_id_to_region(pool_id));
+  auto c = db_->skiplist_cache(shard, l1_region_);
   #if 0
   PmemNode* rv = c->LookupLessThan(key);
   if (rv) {
@@ -637,6 +1169,16 @@ PmemPtr DBClient::LookupL1(const Key& key, const int pool_id, BraidedPmemSkipLis
   }
 
   #endif
+#endif
+#ifdef LISTDB_DRAM_LAYERED_L1
+  {
+    // Levels above the bottom kDramLayerMinHeight - 1 are searched in DRAM
+    Node* dram_pred = ((DramLayeredPmemTable*) table)->FindPred(l1_region_, key);
+    if (dram_pred) {
+      pred = dram_pred;
+    }
+    height = kDramLayerMinHeight - 1;
+  }
 #endif
   search_visit_cnt_++;
   height_visit_cnt_[height - 1]++;
@@ -20,5 +20,46 @@ int main() {
   client->Get(5, &val_read);
   std::cout << val_read << std::endl;
 
+  Iterator* iter = client->NewIterator();
+  for (iter->SeekToFirst(); iter->Valid(); iter->Next()) {
+    std::cout << iter->key() << " " << iter->value() << std::endl;
+  }
+  delete iter;
+
+  client->Delete(5);
+  std::cout << client->Get(5, &val_read) << std::endl;
+
+  WriteBatch batch;
+  batch.Put(20, 20);
+  batch.Delete(10);
+  client->Write(batch);
+  client->Get(20, &val_read);
+  std::cout << val_read << std::endl;
+  std::cout << client->Get(10, &val_read) << std::endl;
+
+  std::vector<Key> keys = {1, 5, 10, 20};
+  std::vector<Value> values;
+  std::vector<bool> found;
+  client->MultiGet(keys, &values, &found);
+  for (size_t i = 0; i < keys.size(); i++) {
+    std::cout << keys[i] << " " << found[i] << " " << values[i] << std::endl;
+  }
+
+  const Snapshot* snapshot = db->GetSnapshot();
+  client->Put(1, 100);
+  client->Get(1, &val_read, snapshot);
+  std::cout << val_read << std::endl;
+  client->Get(1, &val_read);
+  std::cout << val_read << std::endl;
+  db->ReleaseSnapshot(snapshot);
+
+  std::string str_read;
+  client->Put(30, std::string_view("inline value"));
+  client->Get(30, &str_read);
+  std::cout << str_read << std::endl;
+  client->Get(30, &val_read);
+  std::cout << std::string_view((const char*) val_read, str_read.size()) << std::endl;
+  std::cout << client->Put(31, std::string(kMaxInlineValueSize + 1, 'x')) << std::endl;
+
   return 0;
 }
@@ -29,6 +29,7 @@
 #include "listdb/lsm/memtable_list.h"
 #include "listdb/lsm/pmemtable.h"
 #include "listdb/lsm/pmemtable_list.h"
+#include "listdb/pmem/persistence.h"
 #include "listdb/pmem/pmem_dir.h"
 #include "listdb/pmem/pmem_section.h"
 #include "listdb/separator/separator.h"
@@ -72,15 +73,20 @@ class HotColdListDB {
   HotColdListDB(int region);
   ~HotColdListDB();
 
-  void Init();
+  void Init(const PersistenceMode persistence = PersistenceMode::kADR);
 
-  void Open();
+  void Open(const PersistenceMode persistence = PersistenceMode::kADR);
 
   void Put(const Key& key, const Value& value);
 
   void Close();
 
  private:
+  template <typename Persistence>
+  void PutImpl(const Key& key, const Value& value);
+
+  void SetPersistence(const PersistenceMode persistence);
+
   int DramRandomHeight();
 
   int PmemRandomHeight();
@@ -99,6 +105,7 @@ class HotColdListDB {
   Allocators allocators_;
   HotColdLog log_;
   LevelList* ll_[kNumShards];
+  void (HotColdListDB::*put_fn_)(const Key&, const Value&) = &HotColdListDB::PutImpl<AdrPersistence>;
 };
 
 HotColdListDB::HotColdListDB(int region)
@@ -113,7 +120,8 @@ HotColdListDB::~HotColdListDB() {
   Close();
 }
 
-void HotColdListDB::Init() {
+void HotColdListDB::Init(const PersistenceMode persistence) {
+  SetPersistence(persistence);
   pmem_.Init(ll_);
   for (int i = 0; i < kNumShards; ++i) {
     log_[Temperature::kCold][i] = pmem_.cold_log(region_, i);
@@ -123,11 +131,20 @@ void HotColdListDB::Init() {
   }
 }
 
-void HotColdListDB::Open() {}
+void HotColdListDB::Open(const PersistenceMode persistence) { SetPersistence(persistence); }
+
+void HotColdListDB::SetPersistence(const PersistenceMode persistence) {
+  put_fn_ = WithPersistence(persistence, [](auto p) { return &HotColdListDB::PutImpl<decltype(p)>; });
+}
 
 void HotColdListDB::Close() { pmem_.Clear(); }
 
 void HotColdListDB::Put(const Key& key, const Value& value) {
+  (this->*put_fn_)(key, value);
+}
+
+template <typename Persistence>
+void HotColdListDB::PutImpl(const Key& key, const Value& value) {
   Temperature temp = separator_->separate(key);
   PmemAllocator* allocator = allocators_[temp];
   int shard = KeyShard(key);
@@ -147,15 +164,15 @@ void HotColdListDB::Put(const Key& key, const Value& value) {
   // clwb things
   iul_entry->tag = (l0_id << 32) | pmem_height;
   iul_entry->value = value;
-  clwb(&iul_entry->tag, 16);
-  _mm_sfence();
+  Persistence::Flush(&iul_entry->tag, 16);
+  Persistence::Fence();
   iul_entry->key = key;
-  clwb(iul_entry, 8);
+  Persistence::Flush(iul_entry, 8);
 
   // Create skiplist node
   uint64_t dram_height = DramRandomHeight();
-  MemNode* node = static_cast<MemNode*>(
-      malloc(sizeof(MemNode) + (dram_height - 1) * sizeof(uint64_t)));
+  MemNode* node = reinterpret_cast<MemNode*>(
+      mem->AllocateNode(sizeof(MemNode) + (dram_height - 1) * sizeof(uint64_t)));
   node->key = key;
   node->tag = (l0_id << 32) | dram_height;
   node->value = value;
@@ -3,10 +3,9 @@
 
 #include <x86intrin.h>
 
-#include <map>
-
 #include <libpmemobj++/make_persistent_array_atomic.hpp>
 
+#include "listdb/pmem/persistence.h"
 #include "listdb/pmem/pmem.h"
 #include "listdb/pmem/pmem_ptr.h"
 #include "listdb/core/pmem_log.h"
@@ -15,17 +14,35 @@ class BraidedPmemSkipList {
  public:
   struct Node {
     Key key;
-    uint64_t tag;  // seqorder (56-bit), op (4-bit), height (4-bit)
+    uint64_t tag;  // seqorder (40-bit), l0_id (16-bit), op (4-bit), height (4-bit)
     uint64_t value;
     uint64_t next[1];
 
     int height() const { return tag & 0xf; }
 
-    uint32_t l0_id() const { return (tag >> 32); }
+    ValueType type() const { return ValueType((tag >> 4) & 0xf); }
+
+    uint32_t l0_id() const { return (tag >> 8) & 0xffff; }
+
+    uint64_t seq() const { return tag >> 24; }
+
+    // The out-of-line key bytes follow the next pointers.
+    // kTypeInlineValue: the value bytes follow the key bytes and value holds
+    // their size
+    char* inline_value() const { return (char*) (next + height()) + key.out_of_line_size(); }
+
+    size_t alloc_size() const {
+      size_t size = sizeof(Node) + (height() - 1) * sizeof(uint64_t) + key.out_of_line_size();
+      if (type() == kTypeInlineValue) {
+        size += (value + 7) & ~7ull;
+      }
+      return size;
+    }
   };
 
   BraidedPmemSkipList(int primary_region_pool_id);
 
+  // Regions are numbered in the order their pools are first bound
   void BindArena(int pool_id, PmemLog* arena);
 
   void BindHead(const int pool_id, void* head_addr);
@@ -38,55 +55,83 @@ class BraidedPmemSkipList {
 
   PmemPtr Lookup(const Key& key, int pool_id);
 
+  // Unlinks a node from every layer. pool_id is the pool of the head of the
+  // node's region and pred is its predecessor in the bottom layer.
+  // Not thread-safe against writers.
+  template <typename Persistence = AdrPersistence>
+  void Unlink(int pool_id, PmemPtr node_paddr, Node* pred);
+
   void PrintDebugScan();
 
-  Node* head() { return head_[primary_region_pool_id_]; }
+  Node* head() { return primary_head_; }
 
-  Node* head(int pool_id) { return head_[pool_id]; }
+  // nullptr if the pool has no region in the skiplist
+  Node* head(int pool_id) { return (region_[pool_id] < 0) ? nullptr : head_[region_[pool_id]]; }
 
   int primary_pool_id() { return primary_region_pool_id_; }
 
-  PmemPtr head_paddr() { return PmemPtr(primary_region_pool_id_, (char*) head_[primary_region_pool_id_]); }
+  PmemPtr head_paddr() { return PmemPtr(primary_region_pool_id_, (char*) primary_head_); }
 
-  pmem::obj::persistent_ptr<char[]> p_head(const int pool_id) { return p_head_[pool_id]; }
+  pmem::obj::persistent_ptr<char[]> p_head(const int pool_id) {
+    return (region_[pool_id] < 0) ? nullptr : p_head_[region_[pool_id]];
+  }
 
  private:
+  int Region(const int pool_id);
+
   const int primary_region_pool_id_;
-  std::map<int, PmemLog*> arena_;
-  std::map<int, Node*> head_;
-  std::map<int, pmem::obj::persistent_ptr<char[]>> p_head_;
+  Node* primary_head_ = nullptr;
+  int num_regions_ = 0;
+  // Region of each pool id
+  int8_t region_[Pmem::kMaxPools];
+  PmemLog* arena_[kNumRegions] = {};
+  Node* head_[kNumRegions] = {};
+  pmem::obj::persistent_ptr<char[]> p_head_[kNumRegions];
 };
 
 BraidedPmemSkipList::BraidedPmemSkipList(const int primary_region_pool_id)
-    : primary_region_pool_id_(primary_region_pool_id) { }
+    : primary_region_pool_id_(primary_region_pool_id) {
+  memset(region_, -1, sizeof(region_));
+}
+
+inline int BraidedPmemSkipList::Region(const int pool_id) {
+  if (region_[pool_id] < 0) {
+    assert(num_regions_ < kNumRegions);
+    region_[pool_id] = num_regions_++;
+  }
+  return region_[pool_id];
+}
 
 void BraidedPmemSkipList::BindArena(const int pool_id, PmemLog* arena) {
-  arena_.emplace(pool_id, arena);
+  arena_[Region(pool_id)] = arena;
 }
 
 void BraidedPmemSkipList::BindHead(const int pool_id, void* head_addr) {
-  head_.emplace(pool_id, (Node*) head_addr);
+  head_[Region(pool_id)] = (Node*) head_addr;
+  if (pool_id == primary_region_pool_id_) {
+    primary_head_ = (Node*) head_addr;
+  }
 }
 
 void BraidedPmemSkipList::Init() {
-  for (auto& it : arena_) {
-    int pool_id = it.first;
+  for (int region = 0; region < num_regions_; region++) {
     size_t head_size = sizeof(Node) + (kMaxHeight - 1) * sizeof(uint64_t);
 #if 0
-    auto head_paddr = arena_[pool_id]->Allocate(head_size);
+    auto head_paddr = arena_[region]->Allocate(head_size);
     Node* head = (Node*) head_paddr.get();
 #else
-    auto pool = it.second->pool();
+    auto pool = arena_[region]->pool();
     pmem::obj::persistent_ptr<char[]> pmem_head_buf;
     pmem::obj::make_persistent_atomic<char[]>(pool, pmem_head_buf, head_size);
-    p_head_[pool_id] = pmem_head_buf;
+    p_head_[region] = pmem_head_buf;
     Node* head = (Node*) pmem_head_buf.get();
 #endif
     head->key = 0; 
     head->tag = kMaxHeight;
     memset(&head->next[0], 0, kMaxHeight * sizeof(uint64_t));
-    head_.emplace(pool_id, head);
+    head_[region] = head;
   }
+  primary_head_ = head(primary_region_pool_id_);
 }
 
 void BraidedPmemSkipList::Insert(PmemPtr node_paddr) {
@@ -98,7 +143,7 @@ void BraidedPmemSkipList::Insert(PmemPtr node_paddr) {
   uint64_t succs[kMaxHeight];
 
   while (true) {
-    preds[kMaxHeight - 1] = head_[pool_id];
+    preds[kMaxHeight - 1] = head(pool_id);
     FindPosition(pool_id, node, preds, succs);
 
 #if 0
@@ -125,7 +170,7 @@ void BraidedPmemSkipList::Insert(PmemPtr node_paddr) {
       while (true) {
         if (!std::atomic_compare_exchange_strong((std::atomic<uint64_t>*) &preds[i]->next[i], &succs[i],
               node_paddr.dump())) {
-          preds[kMaxHeight - 1] = head_[pool_id];
+          preds[kMaxHeight - 1] = head(pool_id);
           FindPosition(pool_id, node, preds, succs);
           continue;
         }
@@ -142,7 +187,7 @@ void BraidedPmemSkipList::Insert(PmemPtr node_paddr) {
 }
 
 void BraidedPmemSkipList::FindPosition(const int pool_id, Node* node, Node* preds[], uint64_t succs[]) {
-  //Node* pred = head_[pool_id];
+  //Node* pred = head(pool_id);
   Node* pred = preds[kMaxHeight - 1];
   uint64_t curr_paddr_dump;
   Node* curr;
@@ -153,7 +198,7 @@ void BraidedPmemSkipList::FindPosition(const int pool_id, Node* node, Node* pred
     while (true) {
       curr_paddr_dump = pred->next[i];
       curr = (Node*) ((PmemPtr*) &curr_paddr_dump)->get();
-      if (curr && curr->key.Compare(node->key) < 0) {
+      if (curr && NodePrecedes(curr, node)) {
         pred = curr;
         continue;
       }
@@ -164,13 +209,13 @@ void BraidedPmemSkipList::FindPosition(const int pool_id, Node* node, Node* pred
   }
 
   // Braided bottom layer
-  if (pred == head_[pool_id]) {
-    pred = head_[primary_region_pool_id_];
+  if (pred == head(pool_id)) {
+    pred = primary_head_;
   }
   while (true) {
     curr_paddr_dump = pred->next[0];
     curr = (Node*) ((PmemPtr*) &curr_paddr_dump)->get();
-    if (curr && curr->key.Compare(node->key) < 0) {
+    if (curr && NodePrecedes(curr, node)) {
       pred = curr;
       continue;
     }
@@ -180,8 +225,31 @@ void BraidedPmemSkipList::FindPosition(const int pool_id, Node* node, Node* pred
   succs[0] = curr_paddr_dump;
 }
 
+template <typename Persistence>
+void BraidedPmemSkipList::Unlink(const int pool_id, PmemPtr node_paddr, Node* pred) {
+  Node* node = node_paddr.get<Node>();
+  Node* upper_pred = head(pool_id);
+  for (int i = node->height() - 1; i > 0; i--) {
+    while (true) {
+      Node* curr = ((PmemPtr*) &upper_pred->next[i])->get<Node>();
+      if (curr == nullptr || curr == node || curr->key.Compare(node->key) > 0) {
+        break;
+      }
+      upper_pred = curr;
+    }
+    if (upper_pred->next[i] == node_paddr.dump()) {
+      upper_pred->next[i] = node->next[i];
+      Persistence::Flush(&upper_pred->next[i], 8);
+    }
+  }
+  Persistence::Fence();
+  pred->next[0] = node->next[0];
+  Persistence::Flush(&pred->next[0], 8);
+  Persistence::Fence();
+}
+
 PmemPtr BraidedPmemSkipList::Lookup(const Key& key, const int pool_id) {
-  Node* pred = head_[pool_id];
+  Node* pred = head(pool_id);
   uint64_t curr_paddr_dump;
   Node* curr;
   int height = pred->height();
@@ -200,8 +268,8 @@ PmemPtr BraidedPmemSkipList::Lookup(const Key& key, const int pool_id) {
   }
 
   // Braided bottom layer
-  if (pred == head_[pool_id]) {
-    pred = head_[primary_region_pool_id_];
+  if (pred == head(pool_id)) {
+    pred = primary_head_;
   }
   while (true) {
     curr_paddr_dump = pred->next[0];
@@ -218,7 +286,7 @@ PmemPtr BraidedPmemSkipList::Lookup(const Key& key, const int pool_id) {
 
 void BraidedPmemSkipList::PrintDebugScan() {
   //std::string s;
-  //Node* pred = head_[primary_region_pool_id_];
+  //Node* pred = primary_head_;
   //Node* curr = (Node*) ((PmemPtr*) &pred->next[0])->get();
   //while (curr) {
   //  s.append(std::to_string((uint64_t) curr->key) + "->");
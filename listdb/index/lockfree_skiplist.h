@@ -14,7 +14,7 @@ class lockfree_skiplist {
  public:
   struct Node {
     Key key;       // integer value or offset
-    uint64_t tag;  // seqorder (56-bit), op (4-bit), height (4-bit)
+    uint64_t tag;  // seqorder (40-bit), l0_id (16-bit), op (4-bit), height (4-bit)
     uint64_t value;     // integer value or offset, (SHORTCUT: pointer to next memtable node)
     //uint64_t log_paddr;  // log marked offset, (SHORTCUT: moff to upper pmem node)
     std::atomic<Node*> next[1];
@@ -35,7 +35,7 @@ class lockfree_skiplist {
                            bool init_next_arr = true) {
       Node* node = (Node*) buf;
       node->key = key_;
-      node->tag = (seq_order << 8) | (type << 4) | (height & 0xf);
+      node->tag = (seq_order << 24) | (type << 4) | (height & 0xf);
       node->value = value_;
       if (init_next_arr) {
         memset(node->next, 0, height * 8);
@@ -46,10 +46,13 @@ class lockfree_skiplist {
     int height() const { return tag & 0xf; }
     size_t alloc_size() const { return sizeof(Node) + (height() - 1) * 8; }
     uint8_t type() const { return ValueType((tag & 0xf0) >> 4); }
+    uint64_t seq() const { return tag >> 24; }
     char* data() const { return (char*) this; }
   };
 
   lockfree_skiplist();
+  // Nodes are owned by the caller of Insert
+  ~lockfree_skiplist();
   // Returns pred
   Node* Insert(Node* const node, Node* pred = NULL);
   // Returns (node->key == key) ? node : NULL
@@ -130,11 +133,15 @@ lockfree_skiplist::lockfree_skiplist() {
   const size_t alloc_size = Node::compute_alloc_size(head_key, kMaxHeight);
   void* buf = aligned_alloc(8, alloc_size);
   //void* buf = malloc(alloc_size);
-  head_ = Node::init_node((char*) buf, head_key, 0x00ffffffffffffff, ValueType(0xf), kMaxHeight, 0);
+  head_ = Node::init_node((char*) buf, head_key, kSeqMask, ValueType(0xf), kMaxHeight, 0);
   head_->value = PmemPtr(-1, (uint64_t) 0).dump();  // pool_id: -1, offset: 0
   std::atomic_thread_fence(std::memory_order_release);
 }
 
+lockfree_skiplist::~lockfree_skiplist() {
+  free(head_);
+}
+
 //void lockfree_skiplist::insert(const Key& key, const Value& value, const int height) {
 //}
 
@@ -194,7 +201,7 @@ void lockfree_skiplist::find_position(Node* node, Node* preds[], Node* succs[],
     while (true) {
       curr = pred->next[l].load(std::memory_order_relaxed);
       //curr = pred->next[l].load();
-      if (curr && curr->key.Compare(node->key) < 0) {
+      if (curr && NodePrecedes(curr, node)) {
         pred = curr;
         continue;
       }
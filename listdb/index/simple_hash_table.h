@@ -1,123 +1,212 @@
 #ifndef LISTDB_INDEX_SIMPLE_HASH_TABLE_H_
 #define LISTDB_INDEX_SIMPLE_HASH_TABLE_H_
 
+#include <algorithm>
+#include <cstring>
+
 #include "listdb/common.h"
+#include "listdb/core/cache_table.h"
+#include "listdb/index/braided_pmem_skiplist.h"
+#include "listdb/lib/epoch.h"
 #include "listdb/lib/hash.h"
+#include "listdb/pmem/pmem_ptr.h"
 
+// Values are PmemPtrs of the IUL entries of the keys.
 class SimpleHashTable {
  public:
+  // version 0 while a writer holds the bucket, 1 until it is first written.
+  // An erased bucket keeps its version with a zero value.
+  // A string key is kept as the address of the key bytes in the IUL entry,
+  // with the key length in the upper 16 bits.
   struct Bucket {
     uint64_t version;
     uint64_t key;
     uint64_t value;
+
+    Bucket() : version(1), key(0), value(0) { }
   };
 
+  using Table = CacheTable<Bucket>;
+
+  static constexpr size_t kEntrySize = sizeof(Bucket);
+
   SimpleHashTable(size_t size);
 
-  Bucket* at(const int i) { return &(buckets_[i]); }
+  ~SimpleHashTable();
 
+  Bucket* at(const int i) { return &(table_.load()->buckets[i]); }
+
+  // Replaces the value of the key if any, unless it is a newer version
   void Add(const Key& key, const Value& value);
 
   bool Get(const Key& key, Value* value_out);
 
+  // Drops the entry of the key if it still holds the value
+  void Erase(const Key& key, const Value& value);
+
+  size_t size() { return table_.load()->size; }
+
+  // Rehashes the entries into a new table of the given size. Must not run
+  // concurrently with Add or Erase.
+  void Resize(const size_t size, EpochManager* epoch_manager);
+
  private:
-  const size_t size_;
-  Bucket* buckets_;
+  void Add(Table* table, const Key& key, const Value& value);
+
+  static bool KeyEquals(const uint64_t k, const Key& key);
+
+#ifdef LISTDB_STRING_KEY
+  static constexpr uint64_t kAddrMask = (1ull << 48) - 1;
+
+  static uint64_t EncodeKey(const Value& value);
+#endif
+
+  // Reads a consistent copy of the bucket. Returns its version.
+  static uint64_t Read(Bucket& buckt, uint64_t* k, uint64_t* v);
+
+  static uint64_t Lock(Bucket& buckt);
+
+  std::atomic<Table*> table_;
 };
 
-SimpleHashTable::SimpleHashTable(size_t size) : size_(size) {
-  buckets_ = new Bucket[size];
+SimpleHashTable::SimpleHashTable(size_t size) : table_(new Table(size)) { }
+
+SimpleHashTable::~SimpleHashTable() {
+  delete table_.load();
 }
 
-void SimpleHashTable::Add(const Key& key, const Value& value) {
-  // key: integer key
-  uint32_t idx = ht_murmur3(key);
-  uint32_t idx2 = ht_sha1(key);
-  auto& buckt = buckets_[idx];
-  auto& buckt2 = buckets_[idx2];
-  uint64_t prev_ver = std::atomic_load((std::atomic<uint64_t>*) &buckt.version);
-  uint64_t prev_ver2 = std::atomic_load((std::atomic<uint64_t>*) &buckt2.version);
-  if (prev_ver > prev_ver2) {
-    while (!std::atomic_compare_exchange_weak((std::atomic<uint64_t>*) &buckt2.version, &prev_ver2, 0UL)) continue;
-#ifndef LISTDB_STRING_KEY
-    buckt2.key = key;
-#else
-    buckt2.key = (uint64_t) key.data();
-#endif
-    buckt2.value = value;
-    std::atomic_store((std::atomic<uint64_t>*) &buckt2.version, prev_ver2 + 1);
-  } else {
-    while (!std::atomic_compare_exchange_weak((std::atomic<uint64_t>*) &buckt.version, &prev_ver, 0UL)) continue;
+inline bool SimpleHashTable::KeyEquals(const uint64_t k, const Key& key) {
 #ifndef LISTDB_STRING_KEY
-    buckt.key = key;
+  return (k == key);
 #else
-    buckt.key = (uint64_t) key.data();
+  return (k >> 48) == key.size() && memcmp((char*) (k & kAddrMask), key.data(), key.size()) == 0;
 #endif
-    buckt.value = value;
-    std::atomic_store((std::atomic<uint64_t>*) &buckt.version, prev_ver + 1);
-  }
 }
 
-bool SimpleHashTable::Get(const Key& key, Value* value_out) {
-  uint64_t k;
-  uint64_t v;
-  uint64_t k2;
-  uint64_t v2;
-  uint32_t idx = ht_murmur3(key);
-  uint32_t idx2 = ht_sha1(key);
-  auto& buckt = buckets_[idx];
-  auto& buckt2 = buckets_[idx2];
-  uint64_t prev_ver;
-  uint64_t prev_ver2;
+#ifdef LISTDB_STRING_KEY
+inline uint64_t SimpleHashTable::EncodeKey(const Value& value) {
+  // The key of a MemNode may live in its arena, which is freed after the
+  // flush
+  const Key& key = PmemPtr::Decode<BraidedPmemSkipList::Node>(value)->key;
+  return ((uint64_t) key.size() << 48) | (uint64_t) key.data();
+}
+#endif
+
+inline uint64_t SimpleHashTable::Read(Bucket& buckt, uint64_t* k, uint64_t* v) {
   while (true) {
     //prev_ver = std::atomic_load_explicit((std::atomic<uint64_t>*) &buckt.version, MO_RELAXED);
-    prev_ver = buckt.version;
+    uint64_t prev_ver = std::atomic_load((std::atomic<uint64_t>*) &buckt.version);
     if (prev_ver == 0) continue;
-    k = buckt.key;
-    v = buckt.value;
-    //auto curr_ver = std::atomic_load_explicit((std::atomic<uint64_t>*) &buckt.version, MO_RELAXED);
-    //if (prev_ver != curr_ver) continue;
-    if (prev_ver != buckt.version) continue;
-    break;
+    *k = buckt.key;
+    *v = buckt.value;
+    if (prev_ver != std::atomic_load((std::atomic<uint64_t>*) &buckt.version)) continue;
+    return prev_ver;
   }
-  if (buckt.version > 1) {
+}
+
+inline uint64_t SimpleHashTable::Lock(Bucket& buckt) {
+  uint64_t prev_ver = std::atomic_load((std::atomic<uint64_t>*) &buckt.version);
+  while (prev_ver == 0 ||
+         !std::atomic_compare_exchange_weak((std::atomic<uint64_t>*) &buckt.version, &prev_ver, 0UL)) {
+    prev_ver = std::atomic_load((std::atomic<uint64_t>*) &buckt.version);
+  }
+  return prev_ver;
+}
+
+void SimpleHashTable::Add(const Key& key, const Value& value) {
+  Add(table_.load(std::memory_order_acquire), key, value);
+}
+
+void SimpleHashTable::Add(Table* table, const Key& key, const Value& value) {
+  // key: integer key
+  uint32_t idx = ht_murmur3(key, table->size);
+  uint32_t idx2 = ht_sha1(key, table->size);
+  Bucket* buckts[2] = {&table->buckets[std::min(idx, idx2)], &table->buckets[std::max(idx, idx2)]};
+  const int num_buckts = (idx == idx2) ? 1 : 2;
+  // Both buckets are locked, in index order, so that a concurrent Add of
+  // the key cannot place it in the other one
+  uint64_t prev_vers[2];
+  for (int i = 0; i < num_buckts; i++) {
+    prev_vers[i] = Lock(*buckts[i]);
+  }
+  // A bucket holding the key is replaced, as Get could find the older
+  // version first otherwise
+  int t = -1;
+  for (int i = 0; i < num_buckts; i++) {
+    if (prev_vers[i] > 1 && buckts[i]->value != 0 && KeyEquals(buckts[i]->key, key)) {
+      t = i;
+      break;
+    }
+  }
+  // Flushes of a shard may finish out of order. A newer version stays.
+  if (t < 0) {
+    t = (num_buckts == 2 && prev_vers[0] > prev_vers[1]) ? 1 : 0;
+  } else if (SeqNewer(PmemPtr::Decode<BraidedPmemSkipList::Node>(buckts[t]->value)->seq(),
+                      PmemPtr::Decode<BraidedPmemSkipList::Node>(value)->seq())) {
+    t = -1;
+  }
+  if (t >= 0) {
+    Bucket* target = buckts[t];
 #ifndef LISTDB_STRING_KEY
-    bool key_cmp = (k == key);
+    target->key = key;
 #else
-    bool key_cmp = (strncmp((char*) k, key.data(), kStringKeyLength) == 0);
+    target->key = EncodeKey(value);
 #endif
-    if (key_cmp) {
+    target->value = value;
+    prev_vers[t]++;
+  }
+  for (int i = num_buckts - 1; i >= 0; i--) {
+    std::atomic_store((std::atomic<uint64_t>*) &buckts[i]->version, prev_vers[i]);
+  }
+}
+
+bool SimpleHashTable::Get(const Key& key, Value* value_out) {
+  Table* table = table_.load(std::memory_order_acquire);
+  uint64_t k;
+  uint64_t v;
+  uint32_t idx = ht_murmur3(key, table->size);
+  uint32_t idx2 = ht_sha1(key, table->size);
+  for (auto buckt : {&table->buckets[idx], &table->buckets[idx2]}) {
+    if (Read(*buckt, &k, &v) > 1 && v != 0 && KeyEquals(k, key)) {
       if (value_out) {
         *value_out = v;
       }
       return true;
     }
   }
-  while (true) {
-    //prev_ver2 = std::atomic_load_explicit((std::atomic<uint64_t>*) &buckt2.version, MO_RELAXED);
-    prev_ver2 = buckt2.version;
-    if (prev_ver2 == 0) continue;
-    k2 = buckt2.key;
-    v2 = buckt2.value;
-    //auto curr_ver = std::atomic_load_explicit((std::atomic<uint64_t>*) &buckt2.version, MO_RELAXED);
-    //if (prev_ver2 != curr_ver) continue;
-    if (prev_ver2 != buckt2.version) continue;
-    break;
+  return false;
+}
+
+void SimpleHashTable::Erase(const Key& key, const Value& value) {
+  Table* table = table_.load(std::memory_order_acquire);
+  uint32_t idx = ht_murmur3(key, table->size);
+  uint32_t idx2 = ht_sha1(key, table->size);
+  for (auto buckt : {&table->buckets[idx], &table->buckets[idx2]}) {
+    uint64_t prev_ver = Lock(*buckt);
+    if (buckt->value == value) {
+      buckt->value = 0;
+      prev_ver++;
+    }
+    std::atomic_store((std::atomic<uint64_t>*) &buckt->version, prev_ver);
   }
-  if (buckt2.version > 1) {
+}
+
+void SimpleHashTable::Resize(const size_t size, EpochManager* epoch_manager) {
+  Table* old_table = table_.load();
+  Table* new_table = new Table(size);
+  for (size_t i = 0; i < old_table->size; i++) {
+    auto& buckt = old_table->buckets[i];
+    if (buckt.version > 1 && buckt.value != 0) {
 #ifndef LISTDB_STRING_KEY
-    bool key_cmp = (k2 == key);
+      Add(new_table, Key(buckt.key), buckt.value);
 #else
-    bool key_cmp = (strncmp((char*) k2, key.data(), kStringKeyLength) == 0);
+      // The key bytes are read from the IUL entry the value points to
+      Add(new_table, PmemPtr::Decode<BraidedPmemSkipList::Node>(buckt.value)->key, buckt.value);
 #endif
-    if (key_cmp) {
-      if (value_out) {
-        *value_out = v2;
-      }
-      return true;
     }
   }
-  return false;
+  table_.store(new_table, std::memory_order_release);
+  epoch_manager->Retire([old_table] { delete old_table; });
 }
 
 #endif  // LISTDB_INDEX_SIMPLE_HASH_TABLE_H_
@@ -0,0 +1,137 @@
+#ifndef LISTDB_STRING_KEY
+#include <iostream>
+int main() {
+  std::cerr << "cmake .. -DSTRING_KEY=ON" << std::endl;
+  return 1;
+}
+#else
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <string>
+
+#include <experimental/filesystem>
+namespace fs = std::experimental::filesystem::v1;
+
+#include "listdb/pmem/pmem.h"
+#include "listdb/core/pmem_log.h"
+#include "listdb/index/braided_pmem_skiplist.h"
+#include "listdb/index/simple_hash_table.h"
+#include "listdb/lib/epoch.h"
+
+static int pool_id;
+
+void InitPoolSet() {
+  std::string path = "/pmem0/wkim/simple_hash_table_test";
+  fs::remove_all(path);
+  fs::create_directories(path);
+
+  std::string poolset = path + ".set";
+  std::fstream strm(poolset, strm.out);
+  strm << "PMEMPOOLSET" << std::endl;
+  strm << "OPTION SINGLEHDR" << std::endl;
+  strm << "400G " << path << "/" << std::endl;
+  strm.close();
+
+  pool_id = Pmem::BindPoolSet<pmem_log_root>(poolset, "");
+}
+
+using PmemNode = BraidedPmemSkipList::Node;
+static PmemLog* log_;
+
+// Returns the PmemPtr of a new IUL entry of the key
+uint64_t CreateIULNode(const Key& key, const uint64_t seq = 0) {
+  size_t iul_entry_size = sizeof(PmemNode) + key.out_of_line_size();
+  auto log_paddr = log_->Allocate(iul_entry_size);
+  PmemNode* iul_entry = (PmemNode*) log_paddr.get();
+  iul_entry->key = key.StoreOutOfLine(log_paddr.pool_id(), (char*) &iul_entry->next[1]);
+  iul_entry->tag = MakeTag(seq, 0, kTypeValue, 1);
+  iul_entry->value = 1234;
+  return log_paddr.dump();
+}
+
+int main() {
+  InitPoolSet();
+  log_ = new PmemLog(pool_id, 0);
+
+  auto ht = new SimpleHashTable(1024);
+  const std::string names[] = {"key1", "key10", "key100000000"};
+  uint64_t values[3];
+  for (int i = 0; i < 3; i++) {
+    // Stands for a MemNode key, whose arena is freed after the flush
+    std::string mem_key_bytes = names[i];
+    Key* mem_key = new Key(mem_key_bytes);
+    values[i] = CreateIULNode(*mem_key);
+    ht->Add(*mem_key, values[i]);
+    memset((void*) mem_key, 0xff, sizeof(Key));
+    mem_key_bytes.assign(mem_key_bytes.size(), '#');
+    delete mem_key;
+  }
+
+  int bad = 0;
+  for (int i = 0; i < 3; i++) {
+    std::string lookup_key_bytes = names[i];
+    Value v;
+    bool found = ht->Get(Key(lookup_key_bytes), &v);
+    std::cout << names[i] << ": " << found << std::endl;
+    if (!found || v != values[i]) {
+      bad++;
+    }
+  }
+  // Keys extending a stored key are different keys
+  {
+    std::string lookup_key_bytes = "key1000";
+    bool found = ht->Get(Key(lookup_key_bytes), nullptr);
+    std::cout << lookup_key_bytes << ": " << found << std::endl;
+    if (found) {
+      bad++;
+    }
+  }
+  // Nor does a key match a stored key it prefixes
+  {
+    ht->Erase(Key(names[0]), values[0]);
+    std::string lookup_key_bytes = names[0];
+    bool found = ht->Get(Key(lookup_key_bytes), nullptr);
+    std::cout << lookup_key_bytes << " after erase: " << found << std::endl;
+    if (found) {
+      bad++;
+    }
+  }
+  // Entries are rehashed by their keys in the IUL entries
+  {
+    EpochManager epoch_manager;
+    ht->Resize(4096, &epoch_manager);
+    for (int i = 1; i < 3; i++) {
+      std::string lookup_key_bytes = names[i];
+      Value v;
+      bool found = ht->Get(Key(lookup_key_bytes), &v);
+      std::cout << names[i] << " after resize: " << found << std::endl;
+      if (!found || v != values[i]) {
+        bad++;
+      }
+    }
+    if (ht->Get(Key(names[0]), nullptr)) {
+      bad++;
+    }
+    epoch_manager.Reclaim();
+  }
+  // An older version added later does not replace a newer one
+  {
+    std::string key_bytes = "key2";
+    uint64_t newer = CreateIULNode(Key(key_bytes), 20);
+    uint64_t older = CreateIULNode(Key(key_bytes), 10);
+    ht->Add(Key(key_bytes), newer);
+    ht->Add(Key(key_bytes), older);
+    Value v;
+    bool found = ht->Get(Key(key_bytes), &v);
+    std::cout << key_bytes << " newer kept: " << (found && v == newer) << std::endl;
+    if (!found || v != newer) {
+      bad++;
+    }
+  }
+
+  std::cout << "bad=" << bad << std::endl;
+  delete ht;
+  return (bad == 0) ? 0 : 1;
+}
+#endif  // LISTDB_STRING_KEY
@@ -0,0 +1,34 @@
+#ifndef LISTDB_ITERATOR_H_
+#define LISTDB_ITERATOR_H_
+
+#include <string_view>
+
+#include "listdb/common.h"
+
+// Sorted iterator over key-value entries.
+// Entries having the same key are returned newest first.
+class Iterator {
+ public:
+  virtual ~Iterator() = default;
+
+  virtual bool Valid() const = 0;
+
+  virtual void SeekToFirst() = 0;
+
+  // Positions at the first entry with a key >= the given key
+  virtual void Seek(const Key& key) = 0;
+
+  virtual void Next() = 0;
+
+  virtual Key key() const = 0;
+
+  virtual Value value() const = 0;
+
+  // Value bytes of kTypeInlineValue entries
+  virtual std::string_view inline_value() const = 0;
+
+  // kTypeDeletion for tombstones
+  virtual ValueType type() const = 0;
+};
+
+#endif  // LISTDB_ITERATOR_H_
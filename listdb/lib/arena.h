@@ -2,8 +2,16 @@
 #define ARENA_H_
 
 #include <atomic>
+#include <cassert>
 #include <mutex>
+#include <new>
 
+#include <numa.h>
+
+// Concurrent bump allocator. Memory is released only when the arena is
+// destroyed, one block at a time.
+// Blocks are allocated on the given NUMA node, or on the node of the thread
+// that needs a new block if numa_node is -1.
 class Arena {
   struct Block {
     std::atomic<size_t> p;
@@ -12,16 +20,21 @@ class Arena {
     Block() : p(0), next(NULL) { }
   };
  public:
-  Arena(const size_t block_size) : head_(NULL), curr_(NULL), block_size_(block_size) { }
+  Arena(const size_t block_size, const int numa_node = -1)
+      : head_(NULL), curr_(NULL), block_size_(block_size), numa_node_(numa_node), num_blocks_(0) { }
   ~Arena() {
     Block* b = head_;
     while (b) {
       auto nb = b->next.load();
-      delete b;
+      numa_free(b, alloc_size());
       b = nb;
     }
   }
 
+  Arena(const Arena&) = delete;
+  Arena& operator=(const Arena&) = delete;
+
+  // Returns 8-byte aligned memory. size must not exceed the block size.
   char* allocate(const size_t size) {
     char* ret;
     Block* nb = NULL;
@@ -30,6 +43,7 @@ class Arena {
     int mod = size & 7;
     int slop = (mod == 0) ? 0 : 8 - mod;
     size_t asize = size + slop;
+    assert(asize <= block_size_);
 
     auto block = curr_.load();
     while (true) {
@@ -78,16 +92,27 @@ class Arena {
     return ret;
   }
 
+  size_t MemoryUsage() const { return num_blocks_.load(std::memory_order_relaxed) * alloc_size(); }
+
  private:
+  size_t alloc_size() const { return sizeof(Block) + (block_size_ - 1); }
+
   Block* new_block() {
-    void* buf = aligned_alloc(8, sizeof(Block) + (block_size_ - 1));
-    return (Block*) buf;
+    void* buf = (numa_node_ >= 0) ? numa_alloc_onnode(alloc_size(), numa_node_)
+                                  : numa_alloc_local(alloc_size());
+    if (buf == NULL) {
+      throw std::bad_alloc();
+    }
+    num_blocks_.fetch_add(1, std::memory_order_relaxed);
+    return new (buf) Block();
   }
 
  private:
   Block* head_;
   std::atomic<Block*> curr_;
   const size_t block_size_;
+  const int numa_node_;
+  std::atomic<size_t> num_blocks_;
   std::mutex mu_;
 };
 
@@ -0,0 +1,90 @@
+#ifndef LISTDB_LIB_BLOOM_FILTER_H_
+#define LISTDB_LIB_BLOOM_FILTER_H_
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+
+#include "listdb/common.h"
+#include "listdb/lib/murmur3.h"
+
+// Blocked Bloom filter.
+// Every probe of a key falls into one cache line picked by the upper half of
+// the key hash, so a query costs at most one cache miss. The filter is built
+// by a single writer before it is published and is read-only afterwards.
+class BloomFilter {
+ public:
+  BloomFilter(const size_t num_keys, const int bits_per_key);
+
+  ~BloomFilter() { free(blocks_); }
+
+  BloomFilter(const BloomFilter&) = delete;
+  BloomFilter& operator=(const BloomFilter&) = delete;
+
+  static uint64_t Hash(const Key& key);
+
+  void Add(const uint64_t h);
+
+  bool MayContain(const uint64_t h) const;
+
+  size_t MemoryUsage() const { return num_blocks_ * sizeof(Block); }
+
+ private:
+  struct alignas(64) Block {
+    uint64_t words[8];
+  };
+
+  const Block& GetBlock(const uint64_t h) const {
+    return blocks_[((h >> 32) * num_blocks_) >> 32];
+  }
+
+  size_t num_blocks_;
+  int num_probes_;
+  Block* blocks_;
+};
+
+BloomFilter::BloomFilter(const size_t num_keys, const int bits_per_key)
+    : num_blocks_(std::max<size_t>((num_keys * bits_per_key + 511) / 512, 1)),
+      // k = ln2 * bits_per_key minimizes the false positive rate
+      num_probes_(std::min(std::max(bits_per_key * 69 / 100, 1), 16)) {
+  blocks_ = (Block*) aligned_alloc(sizeof(Block), num_blocks_ * sizeof(Block));
+  memset((void*) blocks_, 0, num_blocks_ * sizeof(Block));
+}
+
+inline uint64_t BloomFilter::Hash(const Key& key) {
+#ifndef LISTDB_STRING_KEY
+  uint64_t h = key.key_num();
+  h = (h ^ (h >> 33)) * 0xff51afd7ed558ccdull;
+  h = (h ^ (h >> 33)) * 0xc4ceb9fe1a85ec53ull;
+  return h ^ (h >> 33);
+#else
+  uint64_t h[2];
+  MurmurHash3_x64_128(key.data(), key.size(), 0xb10f, (void*) h);
+  return h[0];
+#endif
+}
+
+inline void BloomFilter::Add(const uint64_t h) {
+  Block& block = const_cast<Block&>(GetBlock(h));
+  uint32_t g = (uint32_t) h;
+  for (int i = 0; i < num_probes_; i++) {
+    // The top 9 bits select a bit of the block
+    block.words[g >> 29] |= 1ull << ((g >> 23) & 63);
+    g *= 0x9e3779b9;
+  }
+}
+
+inline bool BloomFilter::MayContain(const uint64_t h) const {
+  const Block& block = GetBlock(h);
+  uint32_t g = (uint32_t) h;
+  for (int i = 0; i < num_probes_; i++) {
+    if ((block.words[g >> 29] & (1ull << ((g >> 23) & 63))) == 0) {
+      return false;
+    }
+    g *= 0x9e3779b9;
+  }
+  return true;
+}
+
+#endif  // LISTDB_LIB_BLOOM_FILTER_H_
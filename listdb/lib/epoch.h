@@ -0,0 +1,149 @@
+#ifndef LISTDB_LIB_EPOCH_H_
+#define LISTDB_LIB_EPOCH_H_
+
+#include <algorithm>
+#include <atomic>
+#include <deque>
+#include <functional>
+#include <limits>
+#include <mutex>
+#include <vector>
+
+// Epoch-based reclamation.
+// A reader pins the global epoch in its slot while it may hold pointers to
+// shared objects. An object is retired after it has been unlinked, and its
+// deleter runs once every pinned slot has an epoch later than the one the
+// object was retired in.
+class EpochManager {
+ public:
+  struct alignas(64) Slot {
+    std::atomic<uint64_t> epoch{kIdle};
+  };
+
+  static constexpr uint64_t kIdle = std::numeric_limits<uint64_t>::max();
+
+  ~EpochManager();
+
+  Slot* Register();
+
+  void Unregister(Slot* slot);
+
+  // A slot must not be pinned twice
+  void Pin(Slot* slot);
+
+  void Unpin(Slot* slot) { slot->epoch.store(kIdle, std::memory_order_release); }
+
+  // The object must no longer be reachable by readers that pin after this
+  void Retire(std::function<void()> deleter);
+
+  // Runs the deleters of the objects no pinned reader can reach.
+  // Returns the number of reclaimed objects.
+  size_t Reclaim();
+
+  size_t num_retired();
+
+ private:
+  struct Retired {
+    uint64_t epoch;
+    std::function<void()> deleter;
+  };
+
+  std::atomic<uint64_t> epoch_{1};
+  std::mutex mu_;
+  std::vector<Slot*> slots_;
+  std::deque<Retired> retired_;
+};
+
+// Pins a slot for the lifetime of the guard. The guard registers a slot of
+// its own if none is given.
+class EpochGuard {
+ public:
+  EpochGuard(EpochManager* manager, EpochManager::Slot* slot)
+      : manager_(manager), slot_(slot), owns_slot_(false) {
+    manager_->Pin(slot_);
+  }
+
+  explicit EpochGuard(EpochManager* manager)
+      : manager_(manager), slot_(manager->Register()), owns_slot_(true) {
+    manager_->Pin(slot_);
+  }
+
+  ~EpochGuard() {
+    manager_->Unpin(slot_);
+    if (owns_slot_) {
+      manager_->Unregister(slot_);
+    }
+  }
+
+  EpochGuard(const EpochGuard&) = delete;
+  EpochGuard& operator=(const EpochGuard&) = delete;
+
+ private:
+  EpochManager* manager_;
+  EpochManager::Slot* slot_;
+  const bool owns_slot_;
+};
+
+inline EpochManager::~EpochManager() {
+  for (auto& r : retired_) {
+    r.deleter();
+  }
+  for (auto& slot : slots_) {
+    delete slot;
+  }
+}
+
+inline EpochManager::Slot* EpochManager::Register() {
+  auto slot = new Slot();
+  std::lock_guard<std::mutex> lk(mu_);
+  slots_.push_back(slot);
+  return slot;
+}
+
+inline void EpochManager::Unregister(Slot* slot) {
+  {
+    std::lock_guard<std::mutex> lk(mu_);
+    slots_.erase(std::find(slots_.begin(), slots_.end(), slot));
+  }
+  delete slot;
+}
+
+inline void EpochManager::Pin(Slot* slot) {
+  // The store must be ordered before the loads of shared pointers that
+  // follow, and it is checked by Reclaim after the object was unlinked
+  slot->epoch.store(epoch_.load(std::memory_order_seq_cst), std::memory_order_seq_cst);
+}
+
+inline void EpochManager::Retire(std::function<void()> deleter) {
+  std::lock_guard<std::mutex> lk(mu_);
+  // Readers that pin the advanced epoch load pointers after the unlink
+  const uint64_t epoch = epoch_.fetch_add(1, std::memory_order_seq_cst);
+  retired_.push_back(Retired{epoch, std::move(deleter)});
+}
+
+inline size_t EpochManager::Reclaim() {
+  std::deque<Retired> reclaimable;
+  {
+    std::lock_guard<std::mutex> lk(mu_);
+    uint64_t min_epoch = kIdle;
+    for (auto& slot : slots_) {
+      min_epoch = std::min(min_epoch, slot->epoch.load(std::memory_order_seq_cst));
+    }
+    // Retired epochs are increasing in the queue
+    while (!retired_.empty() && retired_.front().epoch < min_epoch) {
+      reclaimable.push_back(std::move(retired_.front()));
+      retired_.pop_front();
+    }
+  }
+  for (auto& r : reclaimable) {
+    r.deleter();
+  }
+  return reclaimable.size();
+}
+
+inline size_t EpochManager::num_retired() {
+  std::lock_guard<std::mutex> lk(mu_);
+  return retired_.size();
+}
+
+#endif  // LISTDB_LIB_EPOCH_H_
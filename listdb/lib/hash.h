@@ -7,27 +7,27 @@
 
 //constexpr uint64_t kHTMask = 0x07ffffff;
 
-inline uint32_t ht_murmur3(const Key& key) {
+inline uint32_t ht_murmur3(const Key& key, const size_t size) {
 	uint32_t h;
 	static const uint32_t seed = 0xcafeb0ba;
 #ifndef LISTDB_STRING_KEY
 	MurmurHash3_x86_32(&key, sizeof(uint64_t), seed, (void*) &h);
 #else
-	MurmurHash3_x86_32(key.data(), kStringKeyLength, seed, (void*) &h);
+	MurmurHash3_x86_32(key.data(), key.size(), seed, (void*) &h);
 #endif
 	//return h & kHTMask;
-	return h % kHTSize;
+	return h % size;
 }
 
-inline uint32_t ht_sha1(const Key& key) {
+inline uint32_t ht_sha1(const Key& key, const size_t size) {
 	char result[21];  // 5 * 32bit
 #ifndef LISTDB_STRING_KEY
 	SHA1(result, (char*) &key, 8);
 #else
-	SHA1(result, key.data(), kStringKeyLength);
+	SHA1(result, key.data(), key.size());
 #endif
 	//return *reinterpret_cast<uint32_t*>(result) & kHTMask;
-	return *reinterpret_cast<uint32_t*>(result) % kHTSize;
+	return *reinterpret_cast<uint32_t*>(result) % size;
 }
 
 #endif  // LISTDB_LIB_HASH_H_
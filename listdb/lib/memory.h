@@ -1,6 +1,11 @@
 #ifndef LISTDB_LIB_MEMORY_H_
 #define LISTDB_LIB_MEMORY_H_
 
+#include <cstdint>
+#include <cstring>
+
+#include <immintrin.h>
+
 inline size_t aligned_size(const size_t align, const size_t size) {
   int mod = size % align;
   return (mod == 0) ? size : size + (align - mod);
@@ -17,4 +22,79 @@ inline void clwb(const void *addr, const size_t size) {
   }
 }
 
+// Non-temporal stores of whole 64-byte lines, one function per ISA.
+// size must be a multiple of 64 and dst 64-byte aligned.
+
+__attribute__((target("avx512f")))
+inline void stream_lines_avx512(char* dst, const char* src, size_t size) {
+  for (size_t i = 0; i < size; i += 64) {
+    _mm512_stream_si512((__m512i*) (dst + i), _mm512_loadu_si512((const void*) (src + i)));
+  }
+}
+
+__attribute__((target("avx")))
+inline void stream_lines_avx(char* dst, const char* src, size_t size) {
+  for (size_t i = 0; i < size; i += 32) {
+    _mm256_stream_si256((__m256i*) (dst + i), _mm256_loadu_si256((const __m256i*) (src + i)));
+  }
+}
+
+inline void stream_lines_sse2(char* dst, const char* src, size_t size) {
+  for (size_t i = 0; i < size; i += 16) {
+    _mm_stream_si128((__m128i*) (dst + i), _mm_loadu_si128((const __m128i*) (src + i)));
+  }
+}
+
+inline void stream_lines(char* dst, const char* src, size_t size) {
+  using StreamLinesFn = void (*)(char*, const char*, size_t);
+  static const StreamLinesFn fn = [] {
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512f")) {
+      return &stream_lines_avx512;
+    } else if (__builtin_cpu_supports("avx")) {
+      return &stream_lines_avx;
+    }
+    return &stream_lines_sse2;
+  }();
+  fn(dst, src, size);
+}
+
+// Copies size bytes to dst. The lines dst covers entirely are written with
+// non-temporal stores, and a partly covered line at either end is stored
+// and flushed by clwb, so bytes of dst's neighbors are never written.
+// The copy is persisted by the next sfence.
+inline void memcpy_nt(void* dst, const void* src, size_t size) {
+  char* d = (char*) dst;
+  const char* s = (const char*) src;
+  size_t head = (64 - ((uintptr_t) d & 63)) & 63;
+  if (head >= size) {
+    memcpy(d, s, size);
+    clwb(d, size);
+    return;
+  }
+  if (head > 0) {
+    memcpy(d, s, head);
+    clwb(d, head);
+    d += head;
+    s += head;
+    size -= head;
+  }
+  size_t body = size & ~63ull;
+  stream_lines(d, s, body);
+  if (size > body) {
+    memcpy(d + body, s + body, size - body);
+    clwb(d + body, size - body);
+  }
+}
+
+// Stores 8-byte words with non-temporal stores. dst must be 8-byte aligned.
+// Later stores may become visible first, up to the next sfence.
+inline void store_words_nt(void* dst, const void* src, size_t size) {
+  for (size_t i = 0; i < size; i += 8) {
+    long long w;
+    memcpy(&w, (const char*) src + i, 8);
+    _mm_stream_si64((long long*) ((char*) dst + i), w);
+  }
+}
+
 #endif  // LISTDB_LIB_MEMORY_H_
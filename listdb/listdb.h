@@ -10,10 +10,13 @@
 #include <iostream>
 #include <libpmemobj++/pexceptions.hpp>
 #include <queue>
+#include <set>
+#include <shared_mutex>
 #include <sstream>
 #include <stack>
 #include <thread>
 #include <unordered_map>
+#include <vector>
 
 #include "listdb/common.h"
 #ifdef LISTDB_L1_LRU
@@ -22,8 +25,10 @@
 #ifdef LISTDB_SKIPLIST_CACHE
 #include "listdb/core/skiplist_cache.h"
 #endif
+#include "listdb/core/cuckoo_cache.h"
 #include "listdb/core/double_hashing_cache.h"
 #include "listdb/core/linear_probing_hashtable_cache.h"
+#include "listdb/core/log_combiner.h"
 #include "listdb/core/pmem_blob.h"
 #include "listdb/core/pmem_db.h"
 #include "listdb/core/pmem_log.h"
@@ -31,15 +36,22 @@
 #include "listdb/index/braided_pmem_skiplist.h"
 #include "listdb/index/lockfree_skiplist.h"
 #include "listdb/index/simple_hash_table.h"
+#include "listdb/lib/epoch.h"
+#ifdef LISTDB_DRAM_LAYERED_L1
+#include "listdb/lsm/dram_layered_pmemtable.h"
+#endif
 #include "listdb/lsm/level_list.h"
 #include "listdb/lsm/memtable_list.h"
 #include "listdb/lsm/pmemtable.h"
 #include "listdb/lsm/pmemtable_list.h"
+#include "listdb/pmem/persistence.h"
+#include "listdb/snapshot.h"
 #include "listdb/tasks/Task.h"
 #include "listdb/util/clock.h"
 #include "listdb/util/random.h"
 #include "listdb/util/reporter.h"
 #include "listdb/util/reporter_client.h"
+#include "listdb/write_batch.h"
 
 #define L0_COMPACTION_ON_IDLE
 #define L0_COMPACTION_YIELD
@@ -70,11 +82,56 @@ class ListDB {
   using MemNode = lockfree_skiplist::Node;
   using PmemNode = BraidedPmemSkipList::Node;
 
+  // Runtime configuration. The compile-time constants in common.h are the
+  // defaults, and kNumShards and kNumWorkers are also the upper bounds.
+  struct Options {
+    std::string path_prefix = std::string(kPathPrefix);
+    int num_shards = kNumShards;
+    int num_workers = kNumWorkers;
+    // Total over all shards
+    size_t memtable_capacity = kMemTableCapacity;
+    int max_num_memtables = kMaxNumMemTables;
+    // DRAM bytes of the L0 caches over all shards. A cache is sized by the
+    // entries of the live L0 tables it covers, within this budget.
+    size_t l0_cache_budget = kL0CacheBudget;
+    // Bits per key of the DRAM filter built for each L0 table, 0 for none.
+    // A Get skips the L0 tables whose filters rule the key out.
+    int l0_filter_bits_per_key = kL0FilterBitsPerKey;
+    // Size of the log blocks allocated from now on. A log entry must fit in
+    // a block.
+    size_t log_block_size = kPmemLogBlockSize;
+    // Writers of a log commit their entries in groups
+    bool log_group_commit = false;
+    // How long a group waits at most for more writers. It stops waiting once
+    // writers stop joining.
+    uint64_t log_group_commit_wait_usec = 0;
+    // Log entries are copied to PMem with non-temporal stores instead of
+    // being flushed by clwb. This pays off with group commit, where most
+    // lines of a group are written whole. Batches and string values are
+    // always written with cached stores.
+    bool log_nt_store = false;
+    // Decides how the write paths persist their stores. It is not stored,
+    // as it depends on the platform the DB is opened on.
+    PersistenceMode persistence = PersistenceMode::kADR;
+  };
+
   ~ListDB();
 
-  void Init();
+  // Creates a new DB. The options are persisted in the root pool.
+  void Init() { Init(Options()); }
+
+  void Init(const Options& options);
+
+  // Opens an existing DB. num_shards is taken from the root pool since it
+  // decides the placement of keys. The other persisted options apply where
+  // the given ones are left at their defaults.
+  void Open() { Open(Options()); }
+
+  void Open(const Options& options);
+
+  const Options& options() const { return opts_; }
 
-  void Open();
+  int num_shards() const { return opts_.num_shards; }
 
   void Close();
 
@@ -84,8 +141,50 @@ class ListDB {
 
   Reporter* GetOrCreateReporter(const std::string& fname);
 
+  // Snapshots
+  struct alignas(64) WriterSlot {
+    std::atomic<uint64_t> seq{0};
+    // Index of the writer accounting slot in tables, unique among writers
+    // unless there are more than Table::kNumClients of them
+    int client = Table::kSharedClient;
+  };
+
+  static constexpr uint64_t kWriterPending = std::numeric_limits<uint64_t>::max();
+
+  // The returned snapshot must be released by ReleaseSnapshot
+  const Snapshot* GetSnapshot();
+
+  void ReleaseSnapshot(const Snapshot* snapshot);
+
+  // Returns the seqorder of the oldest live snapshot, or the latest seqorder
+  // if there is none. Versions visible at this seqorder are visible to all.
+  uint64_t OldestSnapshotSeq();
+
+  WriterSlot* RegisterWriter();
+
+  void UnregisterWriter(WriterSlot* slot);
+
+  // Assigns a new seqorder to a write. Must be paired with FinishWrite after
+  // the write is inserted into the MemTable.
+  uint64_t BeginWrite(WriterSlot* slot);
+
+  void FinishWrite(WriterSlot* slot) { slot->seq.store(0, std::memory_order_release); }
+
+  // Flushed immutable MemTables are retired here. Readers of MemTables
+  // must pin a slot of it.
+  EpochManager* epoch_manager() { return &epoch_manager_; }
+
   // private:
-  MemTable* GetWritableMemTable(size_t kv_size, int shard);
+  // The table must be unreferenced with w_UnRef(client)
+  MemTable* GetWritableMemTable(size_t kv_size, int shard,
+                                const int client = Table::kSharedClient);
+
+  // Returns nullptr instead of stalling on the MemTable limit of the shard
+  MemTable* TryGetWritableMemTable(size_t kv_size, int shard,
+                                   const int client = Table::kSharedClient);
+
+  // Waits until the shard is below its MemTable limit
+  void WaitForWritableMemTable(int shard);
 
   MemTable* GetMemTable(int shard);
 
@@ -97,7 +196,53 @@ class ListDB {
   DoubleHashingCache* GetHashTable(int shard);
 #elif LISTDB_L0_CACHE == L0_CACHE_T_LINEAR_PROBING
   LinearProbingHashTableCache* GetHashTable(int shard);
+#elif LISTDB_L0_CACHE == L0_CACHE_T_CUCKOO
+  CuckooCache* GetHashTable(int shard);
+#endif
+
+#ifdef LISTDB_L0_CACHE
+  // Shards share one cache with L0_CACHE_T_SIMPLE
+  int L0CacheIndex(int shard);
+
+  // Sizes the cache of the shard for the nodes of its live L0 tables and of
+  // the next flush. The caller holds l0_cache_mu_ of the cache exclusively.
+  void ResizeL0Cache(int shard);
+
+  // Drops the entries of L0 nodes merged into L1, where they are found from
+  // now on
+  void EraseFromL0Cache(int shard, const std::vector<PmemPtr>& nodes);
+#endif
+
+  // Filter for the L0 table the MemTable is flushed into, sized for the most
+  // nodes it can hold. nullptr if disabled.
+  BloomFilter* NewL0Filter(MemTable* mem);
+
+  // Retires the filter of an L0 table that has been merged and unlinked
+  void DropL0Filter(PmemTable* l0);
+
+  // L0 cache entries and filter of the L0 table a flush links, built as its
+  // nodes are linked in key order
+  struct L0FlushIndex {
+#ifdef LISTDB_L0_CACHE
+    int shard;
+    int l0_cache;
+    std::shared_lock<std::shared_mutex> l0_cache_lk;
+    size_t l0_cache_cnt = 0;
+    MemNode* prev_mem_node = nullptr;
 #endif
+    BloomFilter* filter = nullptr;
+  };
+
+  // Sizes the L0 cache of the shard for the flush of the MemTable and holds
+  // it shared until FinishL0Index
+  void BeginL0Index(int shard, MemTable* mem, L0FlushIndex* index);
+
+  // Called for every node linked into the L0 table, mem_node being the node
+  // it is flushed from
+  void IndexL0Node(L0FlushIndex* index, MemNode* mem_node, PmemNode* node);
+
+  // Returns the filter of the L0 table
+  BloomFilter* FinishL0Index(L0FlushIndex* index);
 
   TableList* GetTableList(int level, int shard);
 
@@ -106,6 +251,9 @@ class ListDB {
 
   PmemLog* log(int region, int shard) { return log_[region][shard]; }
 
+  // nullptr unless log_group_commit is set
+  LogCombiner* log_combiner(int region, int shard) { return log_combiner_[region][shard]; }
+
 #ifdef LISTDB_WISCKEY
   PmemBlob* value_blob(const int region, const int shard) {
     return value_blob_[region][shard];
@@ -123,7 +271,19 @@ class ListDB {
   // Background Works
   void SetL0CompactionSchedulerStatus(const ServiceStatus& status);
 
-  void BackgroundThreadLoop();
+  // Pushes a task to the queue of the NUMA node of the calling thread and
+  // wakes a sleeping worker
+  void EnqueueTask(Task* task);
+
+  // Returns nullptr if every queue is empty
+  Task* DequeueTask(CompactionWorkerData* td);
+
+  // Enqueues an L0 compaction of the shard if it has an L0 table and none is
+  // in progress
+  void ScheduleL0Compaction(const int shard);
+
+  // Has the free blocks of the log refilled by the workers
+  void BindLogRefill(PmemLog* log, const int shard);
 
   void CompactionWorkerThreadLoop(CompactionWorkerData* td);
 
@@ -135,6 +295,7 @@ class ListDB {
 
   void ManualFlushMemTable(int shard);
 
+  template <typename Persistence>
   void ZipperCompactionL0(CompactionWorkerData* td, L0CompactionTask* task);
 
   void L0CompactionCopyOnWrite(L0CompactionTask* task);
@@ -169,6 +330,7 @@ class ListDB {
   PmemBlob* value_blob_[kNumRegions][kNumShards];
 #endif
   PmemLog* log_[kNumRegions][kNumShards];
+  LogCombiner* log_combiner_[kNumRegions][kNumShards] = {};
   PmemLog* l0_arena_[kNumRegions][kNumShards];
   PmemLog* l1_arena_[kNumRegions][kNumShards];
   LevelList* ll_[kNumShards];
@@ -181,8 +343,46 @@ class ListDB {
   DoubleHashingCache* hash_table_[kNumShards];
 #elif LISTDB_L0_CACHE == L0_CACHE_T_LINEAR_PROBING
   LinearProbingHashTableCache* hash_table_[kNumShards];
+#elif LISTDB_L0_CACHE == L0_CACHE_T_CUCKOO
+  CuckooCache* hash_table_[kNumShards];
+#endif
+
+#ifdef LISTDB_L0_CACHE
+  // Flushes and compactions update a cache under a shared lock, resizes
+  // take it exclusively
+  std::shared_mutex l0_cache_mu_[kNumShards];
+  // Nodes of the live L0 tables of a cache
+  std::atomic<size_t> l0_cache_live_[kNumShards] = {};
+  std::atomic<size_t> l0_cache_last_flush_[kNumShards] = {};
+  // Bytes over all caches
+  std::atomic<size_t> l0_cache_usage_{0};
 #endif
 
+  Options opts_;
+
+  void SetOptions(const Options& options);
+
+  void PersistOptions(pmem_db* db_root);
+
+  void StartWorkers();
+
+  // Creates the empty L1 table of the shard and links its heads to the
+  // manifest, so that the nodes compacted into it are recovered
+  void InitL1Table(const int shard);
+
+  // Waits until the queues are empty and every worker sleeps
+  void DrainTasks();
+
+  // Pools are bound through these, to be released by Close
+  template <typename T>
+  int BindPool(const std::string& path, const size_t size);
+
+  template <typename T>
+  int BindPoolSet(const std::string& path, const int pool_id = Pmem::kAnyPoolId);
+
+  int root_pool_id_ = 0;
+  std::vector<int> pool_ids_;
+
   std::unordered_map<int, int> pool_id_to_region_;
   std::unordered_map<int, int> log_pool_id_;
   std::unordered_map<int, int> l0_pool_id_;
@@ -192,17 +392,18 @@ class ListDB {
   // std::mutex bg_mu_;
   // std::condition_variable bg_cv_;
 
-  std::deque<Task*> work_request_queue_;
-  std::deque<Task*> work_completion_queue_;
-  std::mutex wq_mu_;
-  std::condition_variable wq_cv_;
+  NodeTaskQueue task_queues_[kNumRegions];
+  std::atomic<int> num_queued_tasks_{0};
+  std::atomic<int> num_sleeping_workers_{0};
+  std::mutex sleep_mu_;
+  std::condition_variable sleep_cv_;
+  std::atomic<bool> l0_compaction_scheduled_[kNumShards] = {};
 
-  std::thread bg_thread_;
-  bool stop_ = false;
-  ServiceStatus l0_compaction_scheduler_status_ = ServiceStatus::kActive;
+  std::atomic<bool> stop_{false};
+  std::atomic<ServiceStatus> l0_compaction_scheduler_status_{ServiceStatus::kActive};
 
-  CompactionWorkerData worker_data_[kNumWorkers];
-  std::thread worker_threads_[kNumWorkers];
+  CompactionWorkerData* worker_data_ = nullptr;
+  std::thread* worker_threads_ = nullptr;
 
 #ifdef LISTDB_L1_LRU
   std::vector<std::pair<uint64_t, uint64_t>> sorted_arr_[kNumRegions]
@@ -216,6 +417,21 @@ class ListDB {
 
   std::atomic<Reporter*> reporter_;
   std::mutex mu_;
+
+  // Snapshots
+  void ReserveSeq(const uint64_t seq);
+
+  static constexpr uint64_t kSeqReserveStep = 1ull << 20;
+
+  std::atomic<uint64_t> seq_{1};
+  std::atomic<uint64_t> seq_reserved_{0};
+  std::mutex seq_reserve_mu_;
+  std::vector<WriterSlot*> writers_;
+  bool client_used_[Table::kNumClients] = {};
+  std::multiset<uint64_t> snapshots_;
+  std::mutex snapshot_mu_;
+
+  EpochManager epoch_manager_;
 };
 
 ListDB::~ListDB() {
@@ -223,20 +439,98 @@ ListDB::~ListDB() {
   Close();
 }
 
-void ListDB::Init() {
+void ListDB::SetOptions(const Options& options) {
+  // The workers of the options in use are running until Close
+  if (worker_data_ != nullptr) {
+    std::cerr << "options cannot be changed before Close\n";
+    exit(1);
+  }
+  opts_ = options;
+  if (opts_.num_shards < 1 || opts_.num_shards > kNumShards) {
+    std::cerr << "num_shards must be in [1, " << kNumShards << "] (current: " << opts_.num_shards << ")\n";
+    exit(1);
+  }
+  if (opts_.num_workers < 1 || opts_.num_workers > kNumWorkers) {
+    std::cerr << "num_workers must be in [1, " << kNumWorkers << "] (current: " << opts_.num_workers << ")\n";
+    exit(1);
+  }
+  if (opts_.log_block_size < kMinPmemLogBlockSize) {
+    std::cerr << "log_block_size must be at least " << kMinPmemLogBlockSize << " (current: " << opts_.log_block_size << ")\n";
+    exit(1);
+  }
+  worker_data_ = new CompactionWorkerData[opts_.num_workers];
+  worker_threads_ = new std::thread[opts_.num_workers];
+}
+
+void ListDB::StartWorkers() {
+  for (int i = 0; i < opts_.num_workers; i++) {
+    worker_data_[i].id = i;
+    worker_data_[i].numa_node = i % kNumRegions;
+    worker_threads_[i] = std::thread(
+        std::bind(&ListDB::CompactionWorkerThreadLoop, this, &worker_data_[i]));
+
+    // sched_param sch;
+    // int policy;
+    // pthread_getschedparam(worker_threads_[i].native_handle(), &policy, &sch);
+    // sch.sched_priority = 20;
+    // pthread_setschedparam(worker_threads_[i].native_handle(), SCHED_FIFO,
+    // &sch);
+  }
+}
+
+void ListDB::InitL1Table(const int shard) {
+  auto l1_tl = ll_[shard]->GetTableList(1);
+  // TODO: impl InitFrontOnce() and use it instead of GetFront()
+  auto l1_table = (PmemTable*)l1_tl->GetFront();
+
+  pmem::obj::persistent_ptr<pmem_l1_info> l1_manifest;
+  auto db_pool = Pmem::pool<pmem_db>(root_pool_id_);
+  pmem::obj::make_persistent_atomic<pmem_l1_info>(db_pool, l1_manifest);
+  for (int i = 0; i < kNumRegions; i++) {
+    l1_manifest->head[i] = l1_table->skiplist()->p_head(l1_pool_id_[i]);
+  }
+  clwb(l1_manifest.get(), sizeof(pmem_l1_info));
+  _mm_sfence();
+  auto shard_manifest = db_pool.root()->shard[shard];
+  shard_manifest->l1_info = l1_manifest;
+  clwb(&shard_manifest->l1_info, sizeof(shard_manifest->l1_info));
+  _mm_sfence();
+}
+
+void ListDB::PersistOptions(pmem_db* db_root) {
+  db_root->options.num_shards = opts_.num_shards;
+  db_root->options.num_workers = opts_.num_workers;
+  db_root->options.memtable_capacity = opts_.memtable_capacity;
+  db_root->options.max_num_memtables = opts_.max_num_memtables;
+  db_root->options.l0_cache_budget = opts_.l0_cache_budget;
+  clwb(&db_root->options, sizeof(pmem_db_options));
+  _mm_sfence();
+}
+
+template <typename T>
+int ListDB::BindPool(const std::string& path, const size_t size) {
+  int pool_id = Pmem::BindPool<T>(path, "", size);
+  pool_ids_.push_back(pool_id);
+  return pool_id;
+}
+
+template <typename T>
+int ListDB::BindPoolSet(const std::string& path, const int pool_id) {
+  int bound_id = Pmem::BindPoolSet<T>(path, "", pool_id);
+  pool_ids_.push_back(bound_id);
+  return bound_id;
+}
+
+void ListDB::Init(const Options& options) {
+  SetOptions(options);
   std::stringstream pss;
-  pss << kPathPrefix << "/listdb";
+  pss << opts_.path_prefix << "/listdb";
   std::string db_path = pss.str();
   fs::remove_all(db_path);
-  int root_pool_id = Pmem::BindPool<pmem_db>(db_path, "", 64 * 1024 * 1024);
-  if (root_pool_id != 0) {
-    std::cerr << "root_pool_id must be zero (current: " << root_pool_id
-              << ")\n";
-    exit(1);
-  }
-  auto db_pool = Pmem::pool<pmem_db>(root_pool_id);
+  root_pool_id_ = BindPool<pmem_db>(db_path, 64 * 1024 * 1024);
+  auto db_pool = Pmem::pool<pmem_db>(root_pool_id_);
   auto db_root = db_pool.root();
-  for (int i = 0; i < kNumShards; i++) {
+  for (int i = 0; i < opts_.num_shards; i++) {
     pmem::obj::persistent_ptr<pmem_db_shard> p_shard_manifest;
     pmem::obj::make_persistent_atomic<pmem_db_shard>(db_pool, p_shard_manifest);
     pmem::obj::persistent_ptr<pmem_l0_info> p_l0_manifest;
@@ -244,12 +538,18 @@ void ListDB::Init() {
     p_shard_manifest->l0_list_head = p_l0_manifest;
     db_root->shard[i] = p_shard_manifest;
   }
+  db_root->seq_reserved = 0;
+  clwb(&db_root->seq_reserved, sizeof(uint64_t));
+  db_root->format_version = kPmemFormatVersion;
+  clwb(&db_root->format_version, sizeof(uint64_t));
+  _mm_sfence();
+  PersistOptions(db_root.get());
   // TODO(wkim): write log path on db_root
 
   // Log Pmem Pool
   for (int i = 0; i < kNumRegions; i++) {
     std::stringstream pss;
-    pss << kPathPrefix << "/" << i << "/listdb_log";
+    pss << opts_.path_prefix << "/" << i << "/listdb_log";
     std::string path = pss.str();
     fs::remove_all(path);
     fs::create_directories(path);
@@ -261,20 +561,29 @@ void ListDB::Init() {
     strm << "400G " << path << "/" << std::endl;
     strm.close();
 
-    int pool_id = Pmem::BindPoolSet<pmem_log_root>(poolset, "");
+    int pool_id = BindPoolSet<pmem_log_root>(poolset);
     pool_id_to_region_[pool_id] = i;
     log_pool_id_[i] = pool_id;
+    db_root->log_pool_id[i] = pool_id;
+    clwb(&db_root->log_pool_id[i], sizeof(uint64_t));
+    _mm_sfence();
     auto pool = Pmem::pool<pmem_log_root>(pool_id);
 
-    for (int j = 0; j < kNumShards; j++) {
-      log_[i][j] = new PmemLog(pool_id, j);
+    for (int j = 0; j < opts_.num_shards; j++) {
+      log_[i][j] = new PmemLog(pool_id, j, opts_.log_block_size);
+      BindLogRefill(log_[i][j], j);
+      if (opts_.log_group_commit) {
+        log_combiner_[i][j] = new LogCombiner(log_[i][j], Table::kNumClients,
+                                              opts_.log_group_commit_wait_usec,
+                                              opts_.log_nt_store, opts_.persistence);
+      }
     }
   }
 #ifndef LISTDB_WAL
   // IUL
   for (int i = 0; i < kNumRegions; i++) {
     l0_pool_id_[i] = log_pool_id_[i];
-    for (int j = 0; j < kNumShards; j++) {
+    for (int j = 0; j < opts_.num_shards; j++) {
       l0_arena_[i][j] = log_[i][j];
     }
   }
@@ -282,7 +591,7 @@ void ListDB::Init() {
 #if LISTDB_FLUSH_MEMTABLE_TO_L1 == 1
   for (int i = 0; i < kNumRegions; i++) {
     l0_pool_id_[i] = log_pool_id_[i];
-    for (int j = 0; j < kNumShards; j++) {
+    for (int j = 0; j < opts_.num_shards; j++) {
       l0_arena_[i][j] = log_[i][j];
     }
   }
@@ -290,7 +599,7 @@ void ListDB::Init() {
   // WAL
   for (int i = 0; i < kNumRegions; i++) {
     std::stringstream pss;
-    pss << kPathPrefix << "/" << i << "/listdb_nonunified_l0";
+    pss << opts_.path_prefix << "/" << i << "/listdb_nonunified_l0";
     std::string path = pss.str();
     fs::remove_all(path);
     fs::create_directories(path);
@@ -302,12 +611,12 @@ void ListDB::Init() {
     strm << "400G " << path << "/" << std::endl;
     strm.close();
 
-    int pool_id = Pmem::BindPoolSet<pmem_blob_root>(poolset, "");
+    int pool_id = BindPoolSet<pmem_blob_root>(poolset);
     pool_id_to_region_[pool_id] = i;
     l0_pool_id_[i] = pool_id;
     auto pool = Pmem::pool<pmem_blob_root>(pool_id);
 
-    for (int j = 0; j < kNumShards; j++) {
+    for (int j = 0; j < opts_.num_shards; j++) {
       l0_arena_[i][j] = new PmemLog(pool_id, j);
     }
   }
@@ -317,8 +626,7 @@ void ListDB::Init() {
 #ifdef LISTDB_WISCKEY
   for (int i = 0; i < kNumRegions; i++) {
     std::stringstream pss;
-    pss << "kPathPrefix"
-        << "/" << i << "/listdb_value";
+    pss << opts_.path_prefix << "/" << i << "/listdb_value";
     std::string path = pss.str();
     fs::remove_all(path);
     fs::create_directories(path);
@@ -330,11 +638,14 @@ void ListDB::Init() {
     strm << "400G " << path << "/" << std::endl;
     strm.close();
 
-    int pool_id = Pmem::BindPoolSet<pmem_blob_root>(poolset, "");
+    int pool_id = BindPoolSet<pmem_blob_root>(poolset);
     pool_id_to_region_[pool_id] = i;
+    db_root->value_pool_id[i] = pool_id;
+    clwb(&db_root->value_pool_id[i], sizeof(uint64_t));
+    _mm_sfence();
     auto pool = Pmem::pool<pmem_blob_root>(pool_id);
 
-    for (int j = 0; j < kNumShards; j++) {
+    for (int j = 0; j < opts_.num_shards; j++) {
       value_blob_[i][j] = new PmemBlob(pool_id, j);
     }
   }
@@ -344,8 +655,7 @@ void ListDB::Init() {
   // Pmem Pool for L1
   for (int i = 0; i < kNumRegions; i++) {
     std::stringstream pss;
-    pss << "kPathPrefix"
-        << "/" << i << "/listdb_l1";
+    pss << opts_.path_prefix << "/" << i << "/listdb_l1";
     std::string path = pss.str();
     fs::remove_all(path);
     fs::create_directories(path);
@@ -357,17 +667,17 @@ void ListDB::Init() {
     strm << "400G " << path << "/" << std::endl;
     strm.close();
 
-    int pool_id = Pmem::BindPoolSet<pmem_log_root>(poolset, "");
+    int pool_id = BindPoolSet<pmem_log_root>(poolset);
     pool_id_to_region_[pool_id] = i;
     auto pool = Pmem::pool<pmem_log_root>(pool_id);
 
-    for (int j = 0; j < kNumShards; j++) {
+    for (int j = 0; j < opts_.num_shards; j++) {
       l1_arena_[i][j] = new PmemLog(pool_id, j);
     }
   }
 #else
   for (int i = 0; i < kNumRegions; i++) {
-    for (int j = 0; j < kNumShards; j++) {
+    for (int j = 0; j < opts_.num_shards; j++) {
       l1_arena_[i][j] = l0_arena_[i][j];
     }
   }
@@ -376,11 +686,13 @@ void ListDB::Init() {
     l1_pool_id_[i] = l1_arena_[i][0]->pool_id();
   }
 
-  for (int i = 0; i < kNumShards; i++) {
+  for (int i = 0; i < opts_.num_shards; i++) {
     ll_[i] = new LevelList();
     // MemTableList
     {
-      auto tl = new MemTableList(kMemTableCapacity / kNumShards, i);
+      auto tl = new MemTableList(opts_.memtable_capacity / opts_.num_shards, i,
+                                 opts_.max_num_memtables);
+      tl->BindRootPool(root_pool_id_);
       tl->BindEnqueueFunction([&, tl, i](MemTable* mem) {
         // fprintf(stdout, "binded enq fn, mem = %p\n", mem);
         auto task = new MemTableFlushTask();
@@ -388,14 +700,20 @@ void ListDB::Init() {
         task->shard = i;
         task->imm = mem;
         task->memtable_list = tl;
-        std::unique_lock<std::mutex> lk(wq_mu_);
-        work_request_queue_.push_back(task);
-        lk.unlock();
-        wq_cv_.notify_one();
+        // The flush is queued once the last writer of the table leaves
+        mem->SealWriters([this, task] { EnqueueTask(task); });
+      });
+      tl->BindPrepareFunction([this, tl, i] {
+        auto task = new MemTablePrepareTask();
+        task->type = TaskType::kMemTablePrepare;
+        task->shard = i;
+        task->memtable_list = tl;
+        EnqueueTask(task);
       });
       for (int j = 0; j < kNumRegions; j++) {
         tl->BindArena(j, l0_arena_[j][i]);
       }
+      tl->BindEpochManager(&epoch_manager_);
       ll_[i]->SetTableList(0, tl);
     }
 
@@ -404,109 +722,140 @@ void ListDB::Init() {
       auto tl = new PmemTableList(std::numeric_limits<size_t>::max(),
                                   l1_arena_[0][0]->pool_id());
       for (int j = 0; j < kNumRegions; j++) {
-        tl->BindArena(l1_arena_[j][i]->pool_id(), l1_arena_[j][i]);
+        tl->BindArena(j, l1_arena_[j][i]);
       }
+      tl->BindEpochManager(&epoch_manager_);
       ll_[i]->SetTableList(1, tl);
     }
   }
 
-#if 1
-  for (int i = 0; i < kNumShards; i++) {
-    auto l1_tl = ll_[i]->GetTableList(1);
-    // TODO: impl InitFrontOnce() and use it instead of GetFront()
-    [[maybe_unused]] auto l1_table = (PmemTable*)l1_tl->GetFront();
+  for (int i = 0; i < opts_.num_shards; i++) {
+    InitL1Table(i);
   }
-#endif
 
 #ifdef LISTDB_L1_LRU
-  for (int i = 0; i < kNumShards; i++) {
+  for (int i = 0; i < opts_.num_shards; i++) {
     for (int j = 0; j < kNumRegions; j++) {
-      cache_[i][j] = new LruSkipList(100000000);
+      cache_[i][j] = new LruSkipList(
+          kLruCacheCapacity / opts_.num_shards / kNumRegions, &epoch_manager_);
     }
   }
 #endif
 #ifdef LISTDB_SKIPLIST_CACHE
-  for (int i = 0; i < kNumShards; i++) {
+  for (int i = 0; i < opts_.num_shards; i++) {
     for (int j = 0; j < kNumRegions; j++) {
       cache_[i][j] = new SkipListCacheRep(
-          l1_arena_[j][i]->pool_id(),
-          kSkipListCacheCapacity / kNumShards / kNumRegions);
+          l1_arena_[j][i]->pool_id(), &epoch_manager_,
+          kSkipListCacheCapacity / opts_.num_shards / kNumRegions);
     }
   }
 #endif
 
+#ifdef LISTDB_L0_CACHE
+  // Caches start small and grow with the L0 tables
+  const int num_l0_caches = (LISTDB_L0_CACHE == L0_CACHE_T_SIMPLE) ? 1 : opts_.num_shards;
+  size_t l0_cache_size = std::min(kMinL0CacheSize, opts_.l0_cache_budget / num_l0_caches /
+                                  std::remove_pointer_t<decltype(GetHashTable(0))>::kEntrySize);
+#endif
 #if LISTDB_L0_CACHE == L0_CACHE_T_SIMPLE
   for (int i = 0; i < 1; i++) {
-    hash_table_[i] = new SimpleHashTable(kHTSize);
-    for (size_t j = 0; j < kHTSize; j++) {
-      hash_table_[i]->at(j)->version = 1UL;
-    }
+    hash_table_[i] = new SimpleHashTable(l0_cache_size);
   }
 #elif LISTDB_L0_CACHE == L0_CACHE_T_STATIC
-  for (int i = 0; i < kNumShards; i++) {
-    hash_table_[i] = new StaticHashTableCache(kHTSize / kNumShards, i);
+  for (int i = 0; i < opts_.num_shards; i++) {
+    hash_table_[i] = new StaticHashTableCache(l0_cache_size, i);
   }
 #elif LISTDB_L0_CACHE == L0_CACHE_T_DOUBLE_HASHING
-  for (int i = 0; i < kNumShards; i++) {
-    hash_table_[i] = new DoubleHashingCache(kHTSize / kNumShards, i);
+  for (int i = 0; i < opts_.num_shards; i++) {
+    hash_table_[i] = new DoubleHashingCache(l0_cache_size, i);
   }
 #elif LISTDB_L0_CACHE == L0_CACHE_T_LINEAR_PROBING
-  for (int i = 0; i < kNumShards; i++) {
-    hash_table_[i] = new LinearProbingHashTableCache(kHTSize / kNumShards, i);
+  for (int i = 0; i < opts_.num_shards; i++) {
+    hash_table_[i] = new LinearProbingHashTableCache(l0_cache_size, i);
+  }
+#elif LISTDB_L0_CACHE == L0_CACHE_T_CUCKOO
+  for (int i = 0; i < opts_.num_shards; i++) {
+    hash_table_[i] = new CuckooCache(l0_cache_size, i);
   }
 #endif
-
-  bg_thread_ = std::thread(std::bind(&ListDB::BackgroundThreadLoop, this));
-
-  for (int i = 0; i < kNumWorkers; i++) {
-    worker_data_[i].id = i;
-    worker_data_[i].stop = false;
-    worker_threads_[i] = std::thread(
-        std::bind(&ListDB::CompactionWorkerThreadLoop, this, &worker_data_[i]));
-
-    // sched_param sch;
-    // int policy;
-    // pthread_getschedparam(worker_threads_[i].native_handle(), &policy, &sch);
-    // sch.sched_priority = 20;
-    // pthread_setschedparam(worker_threads_[i].native_handle(), SCHED_FIFO,
-    // &sch);
+#ifdef LISTDB_L0_CACHE
+  for (int i = 0; i < num_l0_caches; i++) {
+    l0_cache_usage_ += hash_table_[i]->size() * hash_table_[i]->kEntrySize;
   }
+#endif
+
+  StartWorkers();
 }
 
-void ListDB::Open() {
+void ListDB::Open(const Options& options) {
+  opts_.path_prefix = options.path_prefix;
   std::stringstream pss;
-  pss << kPathPrefix << "/listdb";
+  pss << opts_.path_prefix << "/listdb";
   std::string db_path = pss.str();
-  int root_pool_id = Pmem::BindPool<pmem_db>(db_path, "", 64 * 1024 * 1024);
-  if (root_pool_id != 0) {
-    std::cerr << "root_pool_id must be zero (current: " << root_pool_id
-              << ")\n";
+  // No persisted pointer carries the id of the root pool, so it may differ
+  // from the one at Init
+  root_pool_id_ = BindPool<pmem_db>(db_path, 64 * 1024 * 1024);
+  auto db_pool = Pmem::pool<pmem_db>(root_pool_id_);
+  auto db_root = db_pool.root();
+  if (db_root->format_version != kPmemFormatVersion) {
+    std::cerr << "format_version must be " << kPmemFormatVersion
+              << " (current: " << db_root->format_version << ")\n";
     exit(1);
   }
-  auto db_pool = Pmem::pool<pmem_db>(root_pool_id);
-  auto db_root = db_pool.root();
+  {
+    const Options defaults;
+    const auto& persisted = db_root->options;
+    Options opened = options;
+    if (persisted.num_shards != 0) {
+      opened.num_shards = persisted.num_shards;
+      if (opened.num_workers == defaults.num_workers) {
+        opened.num_workers = persisted.num_workers;
+      }
+      if (opened.memtable_capacity == defaults.memtable_capacity) {
+        opened.memtable_capacity = persisted.memtable_capacity;
+      }
+      if (opened.max_num_memtables == defaults.max_num_memtables) {
+        opened.max_num_memtables = persisted.max_num_memtables;
+      }
+      if (opened.l0_cache_budget == defaults.l0_cache_budget) {
+        opened.l0_cache_budget = persisted.l0_cache_budget;
+      }
+    }
+    SetOptions(opened);
+    PersistOptions(db_root.get());
+  }
+
+  // Resume seqorders above every one that may have been logged
+  seq_reserved_.store(db_root->seq_reserved);
+  seq_.store(std::max<uint64_t>(db_root->seq_reserved, 1));
 
   // Log Pmem Pool
   for (int i = 0; i < kNumRegions; i++) {
     std::stringstream pss;
-    pss << kPathPrefix << "/" << i << "/listdb_log";
+    pss << opts_.path_prefix << "/" << i << "/listdb_log";
     std::string path = pss.str();
     std::string poolset = path + ".set";
 
-    int pool_id = Pmem::BindPoolSet<pmem_log_root>(poolset, "");
+    int pool_id = BindPoolSet<pmem_log_root>(poolset, db_root->log_pool_id[i]);
     pool_id_to_region_[pool_id] = i;
     // auto pool = Pmem::pool<pmem_log_root>(pool_id);
-    l0_pool_id_[i] = pool_id;
+    log_pool_id_[i] = pool_id;
 
-    for (int j = 0; j < kNumShards; j++) {
-      log_[i][j] = new PmemLog(pool_id, j);
+    for (int j = 0; j < opts_.num_shards; j++) {
+      log_[i][j] = new PmemLog(pool_id, j, opts_.log_block_size);
+      BindLogRefill(log_[i][j], j);
+      if (opts_.log_group_commit) {
+        log_combiner_[i][j] = new LogCombiner(log_[i][j], Table::kNumClients,
+                                              opts_.log_group_commit_wait_usec,
+                                              opts_.log_nt_store, opts_.persistence);
+      }
     }
   }
 #ifndef LISTDB_WAL
   // IUL
   for (int i = 0; i < kNumRegions; i++) {
     l0_pool_id_[i] = log_pool_id_[i];
-    for (int j = 0; j < kNumShards; j++) {
+    for (int j = 0; j < opts_.num_shards; j++) {
       l0_arena_[i][j] = log_[i][j];
     }
   }
@@ -518,15 +867,15 @@ void ListDB::Open() {
 #ifdef LISTDB_WISCKEY
   for (int i = 0; i < kNumRegions; i++) {
     std::stringstream pss;
-    pss << kPathPrefix << "/" << i << "/wkim/listdb_value";
+    pss << opts_.path_prefix << "/" << i << "/listdb_value";
     std::string path = pss.str();
     std::string poolset = path + ".set";
 
-    int pool_id = Pmem::BindPoolSet<pmem_blob_root>(poolset, "");
+    int pool_id = BindPoolSet<pmem_blob_root>(poolset, db_root->value_pool_id[i]);
     pool_id_to_region_[pool_id] = i;
     auto pool = Pmem::pool<pmem_blob_root>(pool_id);
 
-    for (int j = 0; j < kNumShards; j++) {
+    for (int j = 0; j < opts_.num_shards; j++) {
       value_blob_[i][j] = new PmemBlob(pool_id, j);
     }
   }
@@ -537,7 +886,7 @@ void ListDB::Open() {
   exit(1);
 #else
   for (int i = 0; i < kNumRegions; i++) {
-    for (int j = 0; j < kNumShards; j++) {
+    for (int j = 0; j < opts_.num_shards; j++) {
       l1_arena_[i][j] = l0_arena_[i][j];
     }
   }
@@ -546,11 +895,13 @@ void ListDB::Open() {
     l1_pool_id_[i] = l1_arena_[i][0]->pool_id();
   }
 
-  for (int i = 0; i < kNumShards; i++) {
+  for (int i = 0; i < opts_.num_shards; i++) {
     ll_[i] = new LevelList();
     // MemTableList
     {
-      auto tl = new MemTableList(kMemTableCapacity / kNumShards, i);
+      auto tl = new MemTableList(opts_.memtable_capacity / opts_.num_shards, i,
+                                 opts_.max_num_memtables);
+      tl->BindRootPool(root_pool_id_);
       tl->BindEnqueueFunction([&, tl, i](MemTable* mem) {
         // fprintf(stdout, "binded enq fn, mem = %p\n", mem);
         auto task = new MemTableFlushTask();
@@ -558,14 +909,20 @@ void ListDB::Open() {
         task->shard = i;
         task->imm = mem;
         task->memtable_list = tl;
-        std::unique_lock<std::mutex> lk(wq_mu_);
-        work_request_queue_.push_back(task);
-        lk.unlock();
-        wq_cv_.notify_one();
+        // The flush is queued once the last writer of the table leaves
+        mem->SealWriters([this, task] { EnqueueTask(task); });
+      });
+      tl->BindPrepareFunction([this, tl, i] {
+        auto task = new MemTablePrepareTask();
+        task->type = TaskType::kMemTablePrepare;
+        task->shard = i;
+        task->memtable_list = tl;
+        EnqueueTask(task);
       });
       for (int j = 0; j < kNumRegions; j++) {
         tl->BindArena(j, l0_arena_[j][i]);
       }
+      tl->BindEpochManager(&epoch_manager_);
       ll_[i]->SetTableList(0, tl);
     }
 
@@ -574,8 +931,9 @@ void ListDB::Open() {
       auto tl = new PmemTableList(std::numeric_limits<size_t>::max(),
                                   l1_arena_[0][0]->pool_id());
       for (int j = 0; j < kNumRegions; j++) {
-        tl->BindArena(l1_arena_[j][i]->pool_id(), l1_arena_[j][i]);
+        tl->BindArena(j, l1_arena_[j][i]);
       }
+      tl->BindEpochManager(&epoch_manager_);
       ll_[i]->SetTableList(1, tl);
     }
   }
@@ -599,8 +957,8 @@ void ListDB::Open() {
 
   // TODO(wkim): Parallel execution.
   std::vector<std::thread> recovery_workers;
-  static const int kNumRecoveryThreads = kNumShards;
-  for (int wid = 0; wid < kNumRecoveryThreads; wid++) {
+  const int num_recovery_threads = opts_.num_shards;
+  for (int wid = 0; wid < num_recovery_threads; wid++) {
     recovery_workers.push_back(std::thread([&, wid] {
       int memtable_recovery_cnt = 0;
       int l0_recovery_cnt = 0;
@@ -609,8 +967,8 @@ void ListDB::Open() {
       int l1_recovery_cnt = 0;
       size_t mem_insert_cnt = 0;
       size_t l0_insert_cnt = 0;
-      int shard_begin = (kNumShards / kNumRecoveryThreads) * wid;
-      int shard_end = (kNumShards / kNumRecoveryThreads) * (wid + 1);
+      int shard_begin = (opts_.num_shards / num_recovery_threads) * wid;
+      int shard_end = (opts_.num_shards / num_recovery_threads) * (wid + 1);
       for (int i = shard_begin; i < shard_end; i++) {
         auto shard = db_root->shard[i];
 
@@ -626,9 +984,17 @@ void ListDB::Open() {
             l1_skiplist->BindArena(pool_id, l1_arena_[j][i]);
             l1_skiplist->BindHead(pool_id, (void*)l1_info->head[j].get());
           }
+#ifndef LISTDB_DRAM_LAYERED_L1
           auto l1_table =
               new PmemTable(std::numeric_limits<size_t>::max(), l1_skiplist);
-          // l1_table->SetSize(kMemTableCapacity);
+#else
+          auto l1_table = new DramLayeredPmemTable(
+              std::numeric_limits<size_t>::max(), l1_skiplist, &epoch_manager_);
+          for (int j = 0; j < kNumRegions; j++) {
+            l1_table->BuildLayers(j, l1_pool_id_[j]);
+          }
+#endif
+          // l1_table->SetSize(opts_.memtable_capacity);
           auto l1_tl = ll_[i]->GetTableList(1);
           l1_tl->SetFront(l1_table);
         }
@@ -659,6 +1025,7 @@ void ListDB::Open() {
           }
           min_l0_id = curr_l0_info->id;
           l0_manifests.push_front(curr_l0_info);
+          pred_l0_info = curr_l0_info;
           curr_l0_info = curr_l0_info->next;
         }
 
@@ -674,9 +1041,10 @@ void ListDB::Open() {
           // cursor[j].data = cursor[j].p_block->data;
           auto curr_block = log_shard->head;
           while (curr_block) {
-            PmemNode* first_record = (PmemNode*)curr_block->data;
+            PmemNode* first_record = (PmemNode*)curr_block->data.get();
             log_blocks[j].push_front(curr_block);
-            if (first_record->l0_id() < min_l0_id) {
+            if (l0_manifests.empty() ||
+                CompareL0Id(first_record->l0_id(), min_l0_id) < 0) {
               break;
             }
             curr_block = curr_block->next;
@@ -694,7 +1062,9 @@ void ListDB::Open() {
         } cursor[kNumRegions];
         for (int j = 0; j < kNumRegions; j++) {
           cursor[j].block_iter = log_blocks[j].begin();
-          cursor[j].data = (*(cursor[j].block_iter))->data;
+          if (cursor[j].block_iter != log_blocks[j].end()) {
+            cursor[j].data = (*(cursor[j].block_iter))->data.get();
+          }
         }
 
         std::deque<Table*> tables;
@@ -716,8 +1086,9 @@ void ListDB::Open() {
             // TODO(wkim): Continue and finish L0 to L1 compaction
           } else if (l0->status == Level0Status::kPersisted) {
             l0_persisted_cnt++;
-            auto l0_table = new PmemTable(kMemTableCapacity, l0_skiplist);
-            l0_table->SetSize(kMemTableCapacity);
+            auto l0_table = new PmemTable(opts_.memtable_capacity, l0_skiplist);
+            l0_table->SetSize(opts_.memtable_capacity);
+            l0_table->SetManifest(l0);
             // memtable_list->PushFront(l0_table);
             tables.push_back((Table*)l0_table);
           } else if (l0->status == Level0Status::kFull) {
@@ -739,10 +1110,12 @@ void ListDB::Open() {
 
               bool current_table_done = false;
               while (cursor[j].block_iter != log_blocks[j].end()) {
-                while (cursor[j].offset < kPmemLogBlockSize - 7) {
+                while (cursor[j].offset < (*(cursor[j].block_iter))->size - 7) {
                   char* p = cursor[j].p();
                   PmemNode* p_node = (PmemNode*)p;
-                  if (!p_node->key.Valid()) {
+                  // The key of a batch header holds the run size, which is
+                  // not a valid key of every key type
+                  if (p_node->type() != kTypeBatchHeader && !p_node->key.Valid()) {
                     break;
                   }
                   // fprintf(stdout, "key:
@@ -750,11 +1123,18 @@ void ListDB::Open() {
                   // std::string(p_node->key.data(), 8).c_str(), *((uint64_t*)
                   // &p_node->key), p_node->height(), p_node->l0_id(), l0->id,
                   // p_node->value);
-                  if (p_node->l0_id() > l0->id) {
+                  if (CompareL0Id(p_node->l0_id(), l0->id) > 0) {
                     current_table_done = true;
                     break;
                   }
-                  if (p_node->l0_id() == l0->id) {
+                  if (p_node->type() == kTypeBatchHeader) {
+                    // Skip the run of an uncommitted batch as a whole
+                    cursor[j].offset += batch_log::Committed(p_node)
+                                            ? batch_log::kHeaderSize
+                                            : batch_log::RunSize(p_node);
+                    continue;
+                  }
+                  if (CompareL0Id(p_node->l0_id(), l0->id) == 0) {
                     // DO REPLAY
                     PmemPtr node_paddr(
                         pool_id,
@@ -762,24 +1142,22 @@ void ListDB::Open() {
                     l0_skiplist->Insert(node_paddr);
                     l0_insert_cnt++;
                   }
-                  int height = p_node->height();
-                  size_t iul_entry_size =
-                      sizeof(PmemNode) + (height - 1) * sizeof(uint64_t);
-                  cursor[j].offset += iul_entry_size;
+                  cursor[j].offset += p_node->alloc_size();
                 }
                 if (current_table_done) {
                   break;
                 }
                 ++cursor[j].block_iter;
                 if (cursor[j].block_iter != log_blocks[j].end()) {
-                  cursor[j].data = (*(cursor[j].block_iter))->data;
+                  cursor[j].data = (*(cursor[j].block_iter))->data.get();
                   cursor[j].offset = 0;
                 }
               }
             }
 
-            auto l0_table = new PmemTable(kMemTableCapacity, l0_skiplist);
-            l0_table->SetSize(kMemTableCapacity);
+            auto l0_table = new PmemTable(opts_.memtable_capacity, l0_skiplist);
+            l0_table->SetSize(opts_.memtable_capacity);
+            l0_table->SetManifest(l0);
             // memtable_list->PushFront(l0_table);
             tables.push_back((Table*)l0_table);
           } else if (l0->status == Level0Status::kInitialized) {
@@ -794,8 +1172,9 @@ void ListDB::Open() {
             }
 
             // Init MemTable SkipList
-            auto memtable = new MemTable(kMemTableCapacity);
+            auto memtable = new MemTable(opts_.memtable_capacity / opts_.num_shards);
             memtable->SetL0SkipList(l0_skiplist);
+            memtable->SetL0Manifest(l0);
             auto skiplist = memtable->skiplist();
             size_t kv_size_total = 0;
 
@@ -807,10 +1186,12 @@ void ListDB::Open() {
 
               bool current_table_done = false;
               while (cursor[j].block_iter != log_blocks[j].end()) {
-                while (cursor[j].offset < kPmemLogBlockSize - 7) {
+                while (cursor[j].offset < (*(cursor[j].block_iter))->size - 7) {
                   char* p = cursor[j].p();
                   PmemNode* p_node = (PmemNode*)p;
-                  if (!p_node->key.Valid()) {
+                  // The key of a batch header holds the run size, which is
+                  // not a valid key of every key type
+                  if (p_node->type() != kTypeBatchHeader && !p_node->key.Valid()) {
                     break;
                   }
                   // fprintf(stdout, "key:
@@ -818,40 +1199,48 @@ void ListDB::Open() {
                   // std::string(p_node->key.data(), 8).c_str(), *((uint64_t*)
                   // &p_node->key), p_node->height(), p_node->l0_id(), l0->id,
                   // p_node->value);
-                  if (p_node->l0_id() > l0->id) {
+                  if (CompareL0Id(p_node->l0_id(), l0->id) > 0) {
                     current_table_done = true;
                     break;
                   }
+                  if (p_node->type() == kTypeBatchHeader) {
+                    // Skip the run of an uncommitted batch as a whole
+                    cursor[j].offset += batch_log::Committed(p_node)
+                                            ? batch_log::kHeaderSize
+                                            : batch_log::RunSize(p_node);
+                    continue;
+                  }
                   int height = p_node->height();
-                  if (p_node->l0_id() == l0->id) {
+                  if (CompareL0Id(p_node->l0_id(), l0->id) == 0) {
                     // DO REPLAY
                     PmemPtr log_paddr(
                         pool_id,
                         (uint64_t)((uintptr_t)p - (uintptr_t)pool.handle()));
 
                     // Create skiplist node
-                    MemNode* node = (MemNode*)malloc(
+                    MemNode* node = (MemNode*)memtable->AllocateNode(
                         sizeof(MemNode) + (height - 1) * sizeof(uint64_t));
                     node->key = p_node->key;
-                    node->tag = height;
+                    node->tag = p_node->tag;
                     node->value = log_paddr.dump();
                     memset((void*)&node->next[0], 0, height * sizeof(uint64_t));
 
                     kv_size_total += node->key.size() + sizeof(Value);
+                    if (p_node->type() == kTypeInlineValue) {
+                      kv_size_total += p_node->value;
+                    }
 
                     skiplist->Insert(node);
                     mem_insert_cnt++;
                   }
-                  size_t iul_entry_size =
-                      sizeof(PmemNode) + (height - 1) * sizeof(uint64_t);
-                  cursor[j].offset += iul_entry_size;
+                  cursor[j].offset += p_node->alloc_size();
                 }
                 if (current_table_done) {
                   break;
                 }
                 ++cursor[j].block_iter;
                 if (cursor[j].block_iter != log_blocks[j].end()) {
-                  cursor[j].data = (*(cursor[j].block_iter))->data;
+                  cursor[j].data = (*(cursor[j].block_iter))->data.get();
                   cursor[j].offset = 0;
                 }
               }
@@ -899,21 +1288,40 @@ void ListDB::Open() {
   fprintf(stdout, "  -    merged l0: %d\n", merge_done_cnt_total.load());
   fprintf(stdout, "mem insert cnt: %zu\n", mem_insert_cnt_total.load());
   fprintf(stdout, " l0 insert cnt: %zu\n", l0_insert_cnt_total.load());
+
+  for (int i = 0; i < opts_.num_shards; i++) {
+    if (ll_[i]->GetTableList(1)->IsEmpty()) {
+      InitL1Table(i);
+    }
+  }
+
+  StartWorkers();
+  // Resumes the compactions of the L0 tables left by the last run
+  for (int i = 0; i < opts_.num_shards; i++) {
+    ScheduleL0Compaction(i);
+  }
 }
 
 void ListDB::Close() {
-  stop_ = true;
-  if (bg_thread_.joinable()) {
-    bg_thread_.join();
+  // Queued tasks run to the end, along with the tasks they enqueue
+  if (worker_data_) {
+    DrainTasks();
+  }
+  {
+    std::lock_guard<std::mutex> lk(sleep_mu_);
+    stop_ = true;
   }
+  sleep_cv_.notify_all();
 
-  for (int i = 0; i < kNumWorkers; i++) {
-    worker_data_[i].stop = true;
-    worker_data_[i].cv.notify_one();
+  for (int i = 0; worker_data_ && i < opts_.num_workers; i++) {
     if (worker_threads_[i].joinable()) {
       worker_threads_[i].join();
     }
   }
+  delete[] worker_threads_;
+  delete[] worker_data_;
+  worker_threads_ = nullptr;
+  worker_data_ = nullptr;
 
   {
     std::lock_guard<std::mutex> lk(mu_);
@@ -923,14 +1331,38 @@ void ListDB::Close() {
     }
   }
 
+  // The queued preparations have run, and no rollover takes the standby
+  // tables anymore
+  for (int i = 0; i < opts_.num_shards; i++) {
+    GetTableList<MemTableList>(0, i)->DropStandby();
+  }
+
   // Save log cursor info
-  for (int i = 0; i < kNumShards; i++) {
+  for (int i = 0; i < opts_.num_shards; i++) {
     for (int j = 0; j < kNumRegions; j++) {
+      delete log_combiner_[j][i];
       delete log_[j][i];
     }
   }
 
-  Pmem::Clear();
+  for (auto pool_id : pool_ids_) {
+    Pmem::Release(pool_id);
+  }
+  pool_ids_.clear();
+}
+
+void ListDB::DrainTasks() {
+  while (true) {
+    {
+      std::lock_guard<std::mutex> lk(sleep_mu_);
+      // A worker sleeps only while holding no task
+      if (num_queued_tasks_.load() == 0 &&
+          num_sleeping_workers_.load() == opts_.num_workers) {
+        return;
+      }
+    }
+    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+  }
 }
 
 void ListDB::WaitForStableState() {
@@ -952,172 +1384,233 @@ Reporter* ListDB::GetOrCreateReporter(const std::string& fname) {
   return rv;
 }
 
-void ListDB::SetL0CompactionSchedulerStatus(const ServiceStatus& status) {
-  std::lock_guard<std::mutex> guard(wq_mu_);
-  l0_compaction_scheduler_status_ = status;
+const Snapshot* ListDB::GetSnapshot() {
+  uint64_t snapshot_seq;
+  std::vector<WriterSlot*> writers;
+  {
+    std::lock_guard<std::mutex> lk(snapshot_mu_);
+    snapshot_seq = seq_.load() - 1;
+    snapshots_.insert(snapshot_seq);
+    writers = writers_;
+  }
+  // Wait for in-flight writes that took a seqorder within the snapshot
+  for (auto& w : writers) {
+    while (true) {
+      uint64_t s = w->seq.load(std::memory_order_acquire);
+      if (s == 0 || (s != kWriterPending && !SeqVisible(s, snapshot_seq))) {
+        break;
+      }
+      _mm_pause();
+    }
+  }
+  return new Snapshot(snapshot_seq);
 }
 
-void ListDB::BackgroundThreadLoop() {
-#if 0
-  numa_run_on_node(0);
-#endif
-  static const int kWorkerQueueDepth = 2;
-  std::vector<int> num_assigned_tasks(kNumWorkers);
-  std::unordered_map<Task*, int> task_to_worker;
-  std::deque<Task*> memtable_flush_requests;
-  std::deque<Task*> l0_compaction_requests;
-  std::vector<int> l0_compaction_state(kNumShards);
-  struct ReqCompCounter {
-    size_t req_cnt = 0;
-    size_t comp_cnt = 0;
-  };
-  std::map<TaskType, ReqCompCounter> req_comp_cnt;
-  req_comp_cnt.emplace(TaskType::kMemTableFlush, ReqCompCounter());
+void ListDB::ReleaseSnapshot(const Snapshot* snapshot) {
+  {
+    std::lock_guard<std::mutex> lk(snapshot_mu_);
+    auto it = snapshots_.find(snapshot->seq());
+    if (it != snapshots_.end()) {
+      snapshots_.erase(it);
+    }
+  }
+  delete snapshot;
+}
 
-  while (true) {
-    std::deque<Task*> new_work_requests;
-    std::deque<Task*> work_completions;
-    std::unique_lock<std::mutex> lk(wq_mu_);
-    bool schedule_l0_compaction;
-    wq_cv_.wait_for(lk, std::chrono::seconds(1), [&] {
-      // return !work_request_queue_.empty() || !work_completion_queue_.empty();
-      return !work_request_queue_.empty() || !memtable_flush_requests.empty();
-    });
-    new_work_requests.swap(work_request_queue_);
-    work_completions.swap(work_completion_queue_);
-    schedule_l0_compaction =
-        (l0_compaction_scheduler_status_ == ServiceStatus::kActive);
-    lk.unlock();
-
-    for (auto& task : work_completions) {
-      auto it = task_to_worker.find(task);
-      int worker_id = it->second;
-      task_to_worker.erase(it);
-      if (task->type == TaskType::kL0Compaction) {
-        l0_compaction_state[task->shard] = 0;
-      }
-      num_assigned_tasks[worker_id]--;
-      req_comp_cnt[task->type].comp_cnt++;
-      delete task;
+uint64_t ListDB::OldestSnapshotSeq() {
+  std::lock_guard<std::mutex> lk(snapshot_mu_);
+  if (snapshots_.empty()) {
+    return seq_.load() - 1;
+  }
+  return *snapshots_.begin();
+}
+
+ListDB::WriterSlot* ListDB::RegisterWriter() {
+  auto slot = new WriterSlot();
+  std::lock_guard<std::mutex> lk(snapshot_mu_);
+  for (int i = 0; i < Table::kNumClients; i++) {
+    if (!client_used_[i]) {
+      client_used_[i] = true;
+      slot->client = i;
+      break;
     }
+  }
+  writers_.push_back(slot);
+  return slot;
+}
 
-    for (auto& task : new_work_requests) {
-      if (task->type == TaskType::kMemTableFlush) {
-        memtable_flush_requests.push_back(task);
-      } else {
-        fprintf(stdout, "unknown task request: %d\n", (int)task->type);
-        exit(1);
-      }
-      req_comp_cnt[task->type].req_cnt++;
-    }
-    if (schedule_l0_compaction) {
-      for (int i = 0; i < kNumShards; i++) {
-        if (l0_compaction_state[i] == 0) {
-          auto tl = ll_[i]->GetTableList(0);
-          auto table = tl->GetFront();
-          while (true) {
-            auto next_table = table->Next();
-            if (next_table) {
-              table = next_table;
-            } else {
-              break;
-            }
-          }
-          if (table->type() == TableType::kPmemTable) {
-            auto task = new L0CompactionTask();
-            task->type = TaskType::kL0Compaction;
-            task->shard = i;
-            task->l0 = (PmemTable*)table;
-            task->memtable_list = (MemTableList*)tl;
-            l0_compaction_state[i] = 1;  // configured
-            l0_compaction_requests.push_back(task);
-            req_comp_cnt[task->type].req_cnt++;
-          }
-        }
-      }
+void ListDB::UnregisterWriter(WriterSlot* slot) {
+  {
+    std::lock_guard<std::mutex> lk(snapshot_mu_);
+    writers_.erase(std::find(writers_.begin(), writers_.end(), slot));
+    if (slot->client != Table::kSharedClient) {
+      client_used_[slot->client] = false;
     }
+  }
+  delete slot;
+}
 
-    std::vector<CompactionWorkerData*> available_workers;
-    for (int i = 0; i < kNumWorkers; i++) {
-      if (num_assigned_tasks[i] < kWorkerQueueDepth) {
-        available_workers.push_back(&worker_data_[i]);
-      }
+uint64_t ListDB::BeginWrite(WriterSlot* slot) {
+  // Published before taking a seqorder so that GetSnapshot cannot miss it
+  slot->seq.store(kWriterPending, std::memory_order_seq_cst);
+  uint64_t seq = seq_.fetch_add(1);
+  while ((seq & kSeqMask) == 0) {
+    seq = seq_.fetch_add(1);
+  }
+  if (seq >= seq_reserved_.load(std::memory_order_acquire)) {
+    ReserveSeq(seq);
+  }
+  slot->seq.store(seq, std::memory_order_release);
+  return seq;
+}
+
+// Persists an upper bound of the assigned seqorders so that a recovered DB
+// never reuses a seqorder that may already be logged.
+void ListDB::ReserveSeq(const uint64_t seq) {
+  std::lock_guard<std::mutex> lk(seq_reserve_mu_);
+  if (seq < seq_reserved_.load()) {
+    return;
+  }
+  auto db_root = Pmem::pool<pmem_db>(root_pool_id_).root();
+  db_root->seq_reserved = seq + kSeqReserveStep;
+  clwb(&db_root->seq_reserved, sizeof(uint64_t));
+  _mm_sfence();
+  seq_reserved_.store(seq + kSeqReserveStep, std::memory_order_release);
+}
+
+void ListDB::SetL0CompactionSchedulerStatus(const ServiceStatus& status) {
+  l0_compaction_scheduler_status_ = status;
+  if (status == ServiceStatus::kActive) {
+    for (int i = 0; i < opts_.num_shards; i++) {
+      ScheduleL0Compaction(i);
     }
+  }
+}
 
-    if (!memtable_flush_requests.empty()) {
-      while (!available_workers.empty() && !memtable_flush_requests.empty()) {
-        std::sort(available_workers.begin(), available_workers.end(),
-                  [&](auto& a, auto& b) {
-                    return num_assigned_tasks[a->id] >
-                           num_assigned_tasks[b->id];
-                  });
-        auto& worker = available_workers.back();
-        auto& task = memtable_flush_requests.front();
-        memtable_flush_requests.pop_front();
-        std::unique_lock<std::mutex> wlk(worker->mu);
-        worker->q.push(task);
-        wlk.unlock();
-        worker->cv.notify_one();
-        task_to_worker[task] = worker->id;
-        num_assigned_tasks[worker->id]++;
-        if (num_assigned_tasks[worker->id] >= kWorkerQueueDepth) {
-          available_workers.pop_back();
-        }
-      }
+void ListDB::EnqueueTask(Task* task) {
+  int node = 0;
+  if (kNumRegions > 1) {
+    int cpu = sched_getcpu();
+    node = (cpu < 0) ? 0 : numa_node_of_cpu(cpu) % kNumRegions;
+  }
+  auto& tq = task_queues_[node];
+  {
+    std::lock_guard<std::mutex> lk(tq.mu);
+    if (task->type == TaskType::kL0Compaction) {
+      tq.compaction_q.push_back(task);
+    } else {
+      tq.flush_q.push_back(task);
+    }
+  }
+  // Pairs with the check of num_queued_tasks_ by a worker going to sleep
+  num_queued_tasks_.fetch_add(1);
+  if (num_sleeping_workers_.load() > 0) {
+    std::lock_guard<std::mutex> lk(sleep_mu_);
+    sleep_cv_.notify_one();
+  }
+}
+
+Task* ListDB::DequeueTask(CompactionWorkerData* td) {
+  if (num_queued_tasks_.load() == 0) {
+    return nullptr;
+  }
+  auto pop = [&](const int node, const bool flush) -> Task* {
+    auto& tq = task_queues_[node];
+    std::lock_guard<std::mutex> lk(tq.mu);
+    auto& q = flush ? tq.flush_q : tq.compaction_q;
+    if (q.empty()) {
+      return nullptr;
+    }
+    Task* task = q.front();
+    q.pop_front();
+    num_queued_tasks_.fetch_sub(1);
+    return task;
+  };
+  Task* task = nullptr;
 #ifdef L0_COMPACTION_ON_IDLE
-      continue;
-#endif
+  // L0 compactions run only when no flush is queued on any node
+  for (int flush = 1; flush >= 0 && !task; flush--) {
+    for (int i = 0; i < kNumRegions && !task; i++) {
+      task = pop((td->numa_node + i) % kNumRegions, flush);
+    }
+  }
+#else
+  for (int i = 0; i < kNumRegions && !task; i++) {
+    const int node = (td->numa_node + i) % kNumRegions;
+    task = pop(node, true);
+    if (!task) {
+      task = pop(node, false);
     }
+  }
+#endif
+  return task;
+}
 
-    // available_workers.clear();
-    // for (int i = 0; i < kNumWorkers; i++) {
-    //   if (num_assigned_tasks[i] == 0) {
-    //     available_workers.push_back(&worker_data_[i]);
-    //   }
-    // }
+void ListDB::ScheduleL0Compaction(const int shard) {
 #ifndef LISTDB_NO_L0_COMPACTION
-    while (!available_workers.empty() && !l0_compaction_requests.empty()) {
-      std::sort(available_workers.begin(), available_workers.end(),
-                [&](auto& a, auto& b) {
-                  return num_assigned_tasks[a->id] > num_assigned_tasks[b->id];
-                });
-      auto& worker = available_workers.back();
-      auto& task = l0_compaction_requests.front();
-      l0_compaction_requests.pop_front();
-
-      std::unique_lock<std::mutex> wlk(worker->mu);
-      worker->q.push(task);
-      wlk.unlock();
-      worker->cv.notify_one();
-
-      task_to_worker[task] = worker->id;
-      num_assigned_tasks[worker->id]++;
-      l0_compaction_state[task->shard] = 2;  // assigned
-      if (num_assigned_tasks[worker->id] >= kWorkerQueueDepth) {
-        available_workers.pop_back();
+  if (l0_compaction_scheduler_status_ != ServiceStatus::kActive ||
+      l0_compaction_scheduled_[shard].exchange(true)) {
+    return;
+  }
+  auto tl = ll_[shard]->GetTableList(0);
+  Table* table;
+  {
+    EpochGuard epoch_guard(&epoch_manager_);
+    table = tl->GetFront();
+    while (true) {
+      auto next_table = table->Next();
+      if (next_table) {
+        table = next_table;
+      } else {
+        break;
       }
     }
+  }
+  if (table->type() != TableType::kPmemTable) {
+    l0_compaction_scheduled_[shard] = false;
+    return;
+  }
+  auto task = new L0CompactionTask();
+  task->type = TaskType::kL0Compaction;
+  task->shard = shard;
+  task->l0 = (PmemTable*)table;
+  task->memtable_list = (MemTableList*)tl;
+  EnqueueTask(task);
 #endif
+}
 
-    if (stop_) {
-      fprintf(stdout, "bg thread terminating\n");
-      break;
-    }
-  }
+void ListDB::BindLogRefill(PmemLog* log, const int shard) {
+  log->BindRefillFunction([this, log, shard] {
+    auto task = new PmemLogRefillTask();
+    task->type = TaskType::kPmemLogRefill;
+    task->shard = shard;
+    task->log = log;
+    EnqueueTask(task);
+  });
 }
 
 void ListDB::CompactionWorkerThreadLoop(CompactionWorkerData* td) {
   td->rnd.Reset((td->id + 1) * (td->id + 1));
+  if (kNumRegions > 1 && numa_available() >= 0 && td->numa_node <= numa_max_node()) {
+    numa_run_on_node(td->numa_node);
+  }
   while (true) {
-    std::unique_lock<std::mutex> lk(td->mu);
-    td->cv.wait(lk, [&] { return td->stop || !td->q.empty(); });
-    if (td->stop) {
+    Task* task = DequeueTask(td);
+    if (task == nullptr) {
+      std::unique_lock<std::mutex> lk(sleep_mu_);
+      num_sleeping_workers_.fetch_add(1);
+      sleep_cv_.wait(lk, [&] { return stop_ || num_queued_tasks_.load() > 0; });
+      num_sleeping_workers_.fetch_sub(1);
+      if (stop_) {
+        break;
+      }
+      continue;
+    }
+    if (stop_) {
+      delete task;
       break;
     }
-    auto task = td->q.front();
-    td->q.pop();
     td->current_task = task;
-    lk.unlock();
 
     if (task->type == TaskType::kMemTableFlush) {
 #ifndef LISTDB_WAL
@@ -1126,15 +1619,24 @@ void ListDB::CompactionWorkerThreadLoop(CompactionWorkerData* td) {
       FlushMemTableWAL((MemTableFlushTask*)task, td);
 #endif
       td->current_task = nullptr;
+      ScheduleL0Compaction(task->shard);
     } else if (task->type == TaskType::kL0Compaction) {
-      ZipperCompactionL0(td, (L0CompactionTask*)task);
+      WithPersistence(opts_.persistence, [&](auto p) {
+        ZipperCompactionL0<decltype(p)>(td, (L0CompactionTask*)task);
+      });
       // L0CompactionCopyOnWrite((L0CompactionTask*) task);
       td->current_task = nullptr;
+      // More L0 tables may have been flushed in the meantime
+      l0_compaction_scheduled_[task->shard] = false;
+      ScheduleL0Compaction(task->shard);
+    } else if (task->type == TaskType::kMemTablePrepare) {
+      ((MemTablePrepareTask*)task)->memtable_list->PrepareStandby();
+      td->current_task = nullptr;
+    } else if (task->type == TaskType::kPmemLogRefill) {
+      ((PmemLogRefillTask*)task)->log->Refill();
+      td->current_task = nullptr;
     }
-    std::unique_lock<std::mutex> bg_lk(wq_mu_);
-    work_completion_queue_.push_back(task);
-    bg_lk.unlock();
-    wq_cv_.notify_one();
+    delete task;
   }
 }
 
@@ -1144,12 +1646,24 @@ void ListDB::CompactionWorkerThreadLoop(CompactionWorkerData* td) {
 // Any table this function returns must be unreferenced manually
 // TODO(wkim): Make this function to return a wrapper of table
 //   table is unreferenced on the destruction of its wrapper
-inline MemTable* ListDB::GetWritableMemTable(size_t kv_size, int shard) {
+inline MemTable* ListDB::GetWritableMemTable(size_t kv_size, int shard,
+                                             const int client) {
   auto tl = ll_[shard]->GetTableList(0);
-  auto mem = tl->GetMutable(kv_size);
+  auto mem = tl->GetMutable(kv_size, client);
   return (MemTable*)mem;
 }
 
+inline MemTable* ListDB::TryGetWritableMemTable(size_t kv_size, int shard,
+                                                const int client) {
+  auto tl = ll_[shard]->GetTableList(0);
+  auto mem = tl->TryGetMutable(kv_size, client);
+  return (MemTable*)mem;
+}
+
+inline void ListDB::WaitForWritableMemTable(int shard) {
+  ll_[shard]->GetTableList(0)->WaitForMutable();
+}
+
 inline MemTable* ListDB::GetMemTable(int shard) {
   auto tl = ll_[shard]->GetTableList(0);
   auto mem = tl->GetFront();
@@ -1173,8 +1687,133 @@ inline DoubleHashingCache* ListDB::GetHashTable(int shard) {
 inline LinearProbingHashTableCache* ListDB::GetHashTable(int shard) {
   return hash_table_[shard];
 }
+#elif LISTDB_L0_CACHE == L0_CACHE_T_CUCKOO
+inline CuckooCache* ListDB::GetHashTable(int shard) {
+  return hash_table_[shard];
+}
 #endif
 
+#ifdef LISTDB_L0_CACHE
+inline int ListDB::L0CacheIndex(int shard) {
+  return (LISTDB_L0_CACHE == L0_CACHE_T_SIMPLE) ? 0 : shard;
+}
+
+void ListDB::ResizeL0Cache(int shard) {
+  auto hash_table = GetHashTable(shard);
+  const int c = L0CacheIndex(shard);
+  const size_t entry_size = hash_table->kEntrySize;
+  const size_t size = hash_table->size();
+  // Half full after the next flush
+  const size_t target =
+      std::max(kMinL0CacheSize, 2 * (l0_cache_live_[c].load() + l0_cache_last_flush_[c].load()));
+  size_t new_size;
+  if (target > size) {
+    new_size = std::max(target, 2 * size);
+  } else if (target < size / 4) {
+    new_size = size / 2;
+  } else {
+    return;
+  }
+
+  if (new_size > size) {
+    size_t usage = l0_cache_usage_.load();
+    do {
+      size_t avail = (opts_.l0_cache_budget > usage) ? (opts_.l0_cache_budget - usage) : 0;
+      new_size = std::min(new_size, size + avail / entry_size);
+      if (new_size < size + size / 4) {
+        // Not worth a rehash
+        return;
+      }
+    } while (!l0_cache_usage_.compare_exchange_weak(usage, usage + (new_size - size) * entry_size));
+    hash_table->Resize(new_size, &epoch_manager_);
+    // A cache may round the size down
+    l0_cache_usage_.fetch_sub((new_size - hash_table->size()) * entry_size);
+  } else {
+    hash_table->Resize(new_size, &epoch_manager_);
+    l0_cache_usage_.fetch_sub((size - hash_table->size()) * entry_size);
+  }
+  epoch_manager_.Reclaim();
+}
+
+void ListDB::EraseFromL0Cache(int shard, const std::vector<PmemPtr>& nodes) {
+  auto hash_table = GetHashTable(shard);
+  const int c = L0CacheIndex(shard);
+  {
+    std::shared_lock<std::shared_mutex> lk(l0_cache_mu_[c]);
+    for (PmemPtr paddr : nodes) {
+      auto node = paddr.get<PmemNode>();
+#if LISTDB_L0_CACHE == L0_CACHE_T_SIMPLE
+      hash_table->Erase(node->key, paddr.dump());
+#else
+      hash_table->Erase(node->key, node);
+#endif
+    }
+  }
+  size_t live = l0_cache_live_[c].load();
+  while (!l0_cache_live_[c].compare_exchange_weak(live, live - std::min(live, nodes.size()))) {
+  }
+  std::unique_lock<std::shared_mutex> lk(l0_cache_mu_[c]);
+  ResizeL0Cache(shard);
+}
+#endif
+
+BloomFilter* ListDB::NewL0Filter(MemTable* mem) {
+  if (opts_.l0_filter_bits_per_key <= 0) {
+    return nullptr;
+  }
+  return new BloomFilter(mem->ArenaMemoryUsage() / sizeof(MemNode), opts_.l0_filter_bits_per_key);
+}
+
+void ListDB::DropL0Filter(PmemTable* l0) {
+  auto filter = l0->ReleaseFilter();
+  if (filter) {
+    epoch_manager_.Retire([filter] { delete filter; });
+  }
+}
+
+void ListDB::BeginL0Index(int shard, MemTable* mem, L0FlushIndex* index) {
+#ifdef LISTDB_L0_CACHE
+  index->shard = shard;
+  index->l0_cache = L0CacheIndex(shard);
+  {
+    std::unique_lock<std::shared_mutex> lk(l0_cache_mu_[index->l0_cache]);
+    ResizeL0Cache(shard);
+  }
+  index->l0_cache_lk = std::shared_lock<std::shared_mutex>(l0_cache_mu_[index->l0_cache]);
+#endif
+  index->filter = NewL0Filter(mem);
+}
+
+inline void ListDB::IndexL0Node(L0FlushIndex* index, MemNode* mem_node, PmemNode* node) {
+#ifdef LISTDB_L0_CACHE
+  // Versions of a key are sorted newest first. Cache only the newest one
+  // so that a tombstone is not overwritten by a value it deletes.
+  if (index->prev_mem_node == nullptr || index->prev_mem_node->key.Compare(mem_node->key) != 0) {
+    auto hash_table = GetHashTable(index->shard);
+#if LISTDB_L0_CACHE == L0_CACHE_T_SIMPLE
+    hash_table->Add(mem_node->key, mem_node->value);
+#else
+    hash_table->Insert(mem_node->key, node);
+#endif
+  }
+  index->prev_mem_node = mem_node;
+  index->l0_cache_cnt++;
+#endif
+
+  if (index->filter) {
+    index->filter->Add(BloomFilter::Hash(mem_node->key));
+  }
+}
+
+BloomFilter* ListDB::FinishL0Index(L0FlushIndex* index) {
+#ifdef LISTDB_L0_CACHE
+  index->l0_cache_lk.unlock();
+  l0_cache_live_[index->l0_cache] += index->l0_cache_cnt;
+  l0_cache_last_flush_[index->l0_cache] = index->l0_cache_cnt;
+#endif
+  return index->filter;
+}
+
 inline TableList* ListDB::GetTableList(int level, int shard) {
   auto tl = ll_[shard]->GetTableList(level);
   return tl;
@@ -1192,10 +1831,7 @@ void ListDB::FlushMemTable(MemTableFlushTask* task, CompactionWorkerData* td) {
   abort();
 #endif
   if (task->shard == 0) fprintf(stdout, "FlushMemTable: %p\n", task->imm);
-  // Check Reference Counter
-  while (task->imm->w_RefCount() > 0) {
-    continue;
-  }
+  // The task is queued after the last writer of the table has left
 
   // Flush (IUL)
 #if 0
@@ -1224,20 +1860,14 @@ void ListDB::FlushMemTable(MemTableFlushTask* task, CompactionWorkerData* td) {
     }
   }
 
-#ifdef LISTDB_L0_CACHE
-  auto hash_table = GetHashTable(task->shard);
-#endif
+  L0FlushIndex index;
+  BeginL0Index(task->shard, task->imm, &index);
 
   uint64_t flush_cnt = 0;
   uint64_t begin_micros = Clock::NowMicros();
   INIT_REPORTER_CLIENT;
   while (mem_node) {
     // std::this_thread::yield();
-#ifdef GROUP_LOGGING
-    while (((std::atomic<uint64_t>*)&mem_node->value)
-               ->load(std::memory_order_relaxed) == 0)
-      continue;
-#endif
     int pool_id = ((PmemPtr*)&mem_node->value)->pool_id();
     int region = pool_id_to_region_[pool_id];
     Node* node = ((PmemPtr*)&mem_node->value)->get<Node>();
@@ -1250,15 +1880,7 @@ void ListDB::FlushMemTable(MemTableFlushTask* task, CompactionWorkerData* td) {
     pred->next[0] = mem_node->value;
     pred = ((PmemPtr*)&(pred->next[0]))->get<Node>();
 
-#if LISTDB_L0_CACHE == L0_CACHE_T_SIMPLE
-    hash_table->Add(mem_node->key, mem_node->value);
-#elif LISTDB_L0_CACHE == L0_CACHE_T_STATIC
-    hash_table->Insert(mem_node->key, node);
-#elif LISTDB_L0_CACHE == L0_CACHE_T_DOUBLE_HASHING
-    hash_table->Insert(mem_node->key, node);
-#elif LISTDB_L0_CACHE == L0_CACHE_T_LINEAR_PROBING
-    hash_table->Insert(mem_node->key, node);
-#endif
+    IndexL0Node(&index, mem_node, node);
 
     REPORT_FLUSH_OPS(1);
     flush_cnt++;
@@ -1267,11 +1889,13 @@ void ListDB::FlushMemTable(MemTableFlushTask* task, CompactionWorkerData* td) {
     mem_node = mem_node->next[0].load(MO_RELAXED);
   }
   REPORT_DONE;  // Up report all remainings
+  BloomFilter* filter = FinishL0Index(&index);
   uint64_t end_micros = Clock::NowMicros();
   td->flush_cnt += flush_cnt;
   td->flush_time_usec += (end_micros - begin_micros);
 
-  PmemTable* l0_table = new PmemTable(kMemTableCapacity, l0_skiplist);
+  PmemTable* l0_table = new PmemTable(opts_.memtable_capacity, l0_skiplist);
+  l0_table->SetFilter(filter);
   l0_table->SetManifest(task->imm->l0_manifest());
   task->imm->SetPersistentTable((Table*)l0_table);
   // TODO(wkim): Log this L0 table for recovery
@@ -1282,10 +1906,7 @@ void ListDB::FlushMemTable(MemTableFlushTask* task, CompactionWorkerData* td) {
 void ListDB::FlushMemTableToL1WAL(MemTableFlushTask* task,
                                   CompactionWorkerData* td) {
   if (task->shard == 0) fprintf(stdout, "MemTable -> L1\n");
-  // Check Reference Counter
-  while (task->imm->w_RefCount() > 0) {
-    continue;
-  }
+  // The task is queued after the last writer of the table has left
 
   auto l1_tl = ll_[task->shard]->GetTableList(1);
   auto l1_table = (PmemTable*)l1_tl->GetFront();
@@ -1362,7 +1983,7 @@ void ListDB::FlushMemTableToL1WAL(MemTableFlushTask* task,
     Node* node = (PmemNode*)p_buf.get();
     PmemPtr node_paddr = PmemPtr(mem_value_pool_id,
                                  ((uintptr_t)node - (uintptr_t)pool.handle()));
-    node->tag = height;
+    node->tag = MakeTag(mem_node->seq(), 0, ValueType(mem_node->type()), height);
     node->value = mem_node->value;
     node->next[0] = succs[0][0];
     for (int i = 1; i < height; i++) {
@@ -1391,7 +2012,7 @@ void ListDB::FlushMemTableToL1WAL(MemTableFlushTask* task,
     Node* node = (PmemNode*)p_buf.get();
     PmemPtr node_paddr = PmemPtr(mem_value_pool_id,
                                  ((uintptr_t)node - (uintptr_t)pool.handle()));
-    node->tag = height;
+    node->tag = MakeTag(mem_node->seq(), 0, ValueType(mem_node->type()), height);
     node->value = mem_node->value;
     _mm_sfence();
     node->key = mem_node->key;
@@ -1421,10 +2042,7 @@ void ListDB::FlushMemTableWAL(MemTableFlushTask* task,
   return FlushMemTableToL1WAL(task, td);
 #endif
   if (task->shard == 0) fprintf(stdout, "FlushMemTable: %p\n", task->imm);
-  // Check Reference Counter
-  while (task->imm->w_RefCount() > 0) {
-    continue;
-  }
+  // The task is queued after the last writer of the table has left
 
   // Flush (WAL)
   auto l0_skiplist = task->imm->l0_skiplist();
@@ -1444,20 +2062,14 @@ void ListDB::FlushMemTableWAL(MemTableFlushTask* task,
     }
   }
 
-#ifdef LISTDB_L0_CACHE
-  auto hash_table = GetHashTable(task->shard);
-#endif
+  L0FlushIndex index;
+  BeginL0Index(task->shard, task->imm, &index);
 
   uint64_t flush_cnt = 0;
   uint64_t begin_micros = Clock::NowMicros();
   INIT_REPORTER_CLIENT;
   while (mem_node) {
     // std::this_thread::yield();
-#ifdef GROUP_LOGGING
-    while (((std::atomic<uint64_t>*)&mem_node->value)
-               ->load(std::memory_order_relaxed) == 0)
-      continue;
-#endif
     int mem_value_pool_id = ((PmemPtr*)&mem_node->value)->pool_id();
     int region = pool_id_to_region_[mem_value_pool_id];
 
@@ -1486,7 +2098,7 @@ void ListDB::FlushMemTableWAL(MemTableFlushTask* task,
     PmemPtr node_paddr = PmemPtr(mem_value_pool_id,
                                  ((uintptr_t)node - (uintptr_t)pool.handle()));
 
-    node->tag = height;
+    node->tag = MakeTag(mem_node->seq(), 0, ValueType(mem_node->type()), height);
     node->value = mem_node->value;
     _mm_sfence();
     node->key = mem_node->key;
@@ -1502,15 +2114,7 @@ void ListDB::FlushMemTableWAL(MemTableFlushTask* task,
     }
     pred = ((PmemPtr*)&(pred->next[0]))->get<Node>();
 
-#if LISTDB_L0_CACHE == L0_CACHE_T_SIMPLE
-    hash_table->Add(mem_node->key, mem_node->value);
-#elif LISTDB_L0_CACHE == L0_CACHE_T_STATIC
-    hash_table->Insert(mem_node->key, node);
-#elif LISTDB_L0_CACHE == L0_CACHE_T_DOUBLE_HASHING
-    hash_table->Insert(mem_node->key, node);
-#elif LISTDB_L0_CACHE == L0_CACHE_T_LINEAR_PROBING
-    hash_table->Insert(mem_node->key, node);
-#endif
+    IndexL0Node(&index, mem_node, node);
 
     REPORT_FLUSH_OPS(1);
     flush_cnt++;
@@ -1519,11 +2123,13 @@ void ListDB::FlushMemTableWAL(MemTableFlushTask* task,
     mem_node = mem_node->next[0].load(MO_RELAXED);
   }
   REPORT_DONE;  // Up report all remainings
+  BloomFilter* filter = FinishL0Index(&index);
   uint64_t end_micros = Clock::NowMicros();
   td->flush_cnt += flush_cnt;
   td->flush_time_usec += (end_micros - begin_micros);
 
-  PmemTable* l0_table = new PmemTable(kMemTableCapacity, l0_skiplist);
+  PmemTable* l0_table = new PmemTable(opts_.memtable_capacity, l0_skiplist);
+  l0_table->SetFilter(filter);
   l0_table->SetManifest(task->imm->l0_manifest());
   task->imm->SetPersistentTable((Table*)l0_table);
   // TODO(wkim): Log this L0 table for recovery
@@ -1564,17 +2170,11 @@ void ListDB::ManualFlushMemTable(int shard) {
     }
   }
 
-#ifdef LISTDB_L0_CACHE
-  auto hash_table = GetHashTable(shard);
-#endif
+  L0FlushIndex index;
+  BeginL0Index(shard, reinterpret_cast<MemTable*>(table), &index);
 
   INIT_REPORTER_CLIENT;
   while (mem_node) {
-#ifdef GROUP_LOGGING
-    while (((std::atomic<uint64_t>*)&mem_node->value)
-               ->load(std::memory_order_relaxed) == 0)
-      continue;
-#endif
     int pool_id = ((PmemPtr*)&mem_node->value)->pool_id();
     int region = pool_id_to_region_[pool_id];
     Node* node = ((PmemPtr*)&mem_node->value)->get<Node>();
@@ -1586,15 +2186,7 @@ void ListDB::ManualFlushMemTable(int shard) {
     pred->next[0] = mem_node->value;
     pred = ((PmemPtr*)&(pred->next[0]))->get<Node>();
 
-#if LISTDB_L0_CACHE == L0_CACHE_T_SIMPLE
-    hash_table->Add(mem_node->key, mem_node->value);
-#elif LISTDB_L0_CACHE == L0_CACHE_T_STATIC
-    hash_table->Insert(mem_node->key, node);
-#elif LISTDB_L0_CACHE == L0_CACHE_T_DOUBLE_HASHING
-    hash_table->Insert(mem_node->key, node);
-#elif LISTDB_L0_CACHE == L0_CACHE_T_LINEAR_PROBING
-    hash_table->Insert(mem_node->key, node);
-#endif
+    IndexL0Node(&index, mem_node, node);
 
     REPORT_FLUSH_OPS(1);
 
@@ -1602,8 +2194,10 @@ void ListDB::ManualFlushMemTable(int shard) {
     mem_node = mem_node->next[0].load(MO_RELAXED);
   }
   REPORT_DONE;  // Up report all remainings
+  BloomFilter* filter = FinishL0Index(&index);
 
-  PmemTable* l0_table = new PmemTable(kMemTableCapacity, l0_skiplist);
+  PmemTable* l0_table = new PmemTable(opts_.memtable_capacity, l0_skiplist);
+  l0_table->SetFilter(filter);
   l0_table->SetManifest(reinterpret_cast<MemTable*>(table)->l0_manifest());
   reinterpret_cast<MemTable*>(table)->SetPersistentTable((Table*)l0_table);
   // TODO(wkim): Log this L0 table for recovery
@@ -1641,17 +2235,11 @@ void ListDB::ManualFlushMemTable(int shard) {
     }
   }
 
-#ifdef LISTDB_L0_CACHE
-  auto hash_table = GetHashTable(shard);
-#endif
+  L0FlushIndex index;
+  BeginL0Index(shard, reinterpret_cast<MemTable*>(table), &index);
 
   INIT_REPORTER_CLIENT;
   while (mem_node) {
-#ifdef GROUP_LOGGING
-    while (((std::atomic<uint64_t>*)&mem_node->value)
-               ->load(std::memory_order_relaxed) == 0)
-      continue;
-#endif
     int mem_value_pool_id = ((PmemPtr*)&mem_node->value)->pool_id();
     int region = pool_id_to_region_[mem_value_pool_id];
 
@@ -1680,7 +2268,7 @@ void ListDB::ManualFlushMemTable(int shard) {
     PmemPtr node_paddr = PmemPtr(mem_value_pool_id,
                                  ((uintptr_t)node - (uintptr_t)pool.handle()));
 
-    node->tag = height;
+    node->tag = MakeTag(mem_node->seq(), 0, ValueType(mem_node->type()), height);
     node->value = mem_node->value;
     _mm_sfence();
     node->key = mem_node->key;
@@ -1695,15 +2283,7 @@ void ListDB::ManualFlushMemTable(int shard) {
     }
     pred = ((PmemPtr*)&(pred->next[0]))->get<Node>();
 
-#if LISTDB_L0_CACHE == L0_CACHE_T_SIMPLE
-    hash_table->Add(mem_node->key, mem_node->value);
-#elif LISTDB_L0_CACHE == L0_CACHE_T_STATIC
-    hash_table->Insert(mem_node->key, node);
-#elif LISTDB_L0_CACHE == L0_CACHE_T_DOUBLE_HASHING
-    hash_table->Insert(mem_node->key, node);
-#elif LISTDB_L0_CACHE == L0_CACHE_T_LINEAR_PROBING
-    hash_table->Insert(mem_node->key, node);
-#endif
+    IndexL0Node(&index, mem_node, node);
 
     REPORT_FLUSH_OPS(1);
 
@@ -1711,8 +2291,10 @@ void ListDB::ManualFlushMemTable(int shard) {
     mem_node = mem_node->next[0].load(MO_RELAXED);
   }
   REPORT_DONE;  // Up report all remainings
+  BloomFilter* filter = FinishL0Index(&index);
 
-  PmemTable* l0_table = new PmemTable(kMemTableCapacity, l0_skiplist);
+  PmemTable* l0_table = new PmemTable(opts_.memtable_capacity, l0_skiplist);
+  l0_table->SetFilter(filter);
   l0_table->SetManifest(reinterpret_cast<MemTable*>(table)->l0_manifest());
   reinterpret_cast<MemTable*>(table)->SetPersistentTable((Table*)l0_table);
   // TODO(wkim): Log this L0 table for recovery
@@ -1720,6 +2302,7 @@ void ListDB::ManualFlushMemTable(int shard) {
 #endif
 }
 
+template <typename Persistence>
 void ListDB::ZipperCompactionL0(CompactionWorkerData* td,
                                 L0CompactionTask* task) {
   auto l0_manifest = task->l0->manifest<pmem_l0_info>();
@@ -1734,6 +2317,7 @@ void ListDB::ZipperCompactionL0(CompactionWorkerData* td,
   if (l1_tl->IsEmpty()) {
     auto l1_table = new PmemTable(std::numeric_limits<size_t>::max(), l0_skiplist);
     l1_tl->SetFront(l1_table);
+    EpochGuard epoch_guard(&epoch_manager_);
     auto table = task->memtable_list->GetFront();
     while (true) {
       auto next_table = table->Next();
@@ -1866,6 +2450,7 @@ void ListDB::ZipperCompactionL0(CompactionWorkerData* td,
   }
   // Remove empty L0 from MemTableList
   //auto tl = ll_[task->shard]->GetTableList(0);
+  EpochGuard epoch_guard(&epoch_manager_);
   auto table = task->memtable_list->GetFront();
   while (true) {
     auto next_table = table->Next();
@@ -1892,7 +2477,7 @@ void ListDB::ZipperCompactionL0(CompactionWorkerData* td,
 #else
     // Init the new manifest for a new table
     pmem::obj::persistent_ptr<pmem_l1_info> l1_manifest;
-    auto db_pool = Pmem::pool<pmem_db>(0);
+    auto db_pool = Pmem::pool<pmem_db>(root_pool_id_);
     pmem::obj::make_persistent_atomic<pmem_l1_info>(db_pool, l1_manifest);
     auto db_root = db_pool.root();
     auto shard_manifest = db_root->shard[task->shard];
@@ -1913,10 +2498,30 @@ void ListDB::ZipperCompactionL0(CompactionWorkerData* td,
       l1_manifest->head[i] = p_head;
     }
     shard_manifest->l1_info = l1_manifest;
+#ifndef LISTDB_DRAM_LAYERED_L1
     auto l1_table =
         new PmemTable(std::numeric_limits<size_t>::max(), l1_skiplist);
+#else
+    auto l1_table = new DramLayeredPmemTable(
+        std::numeric_limits<size_t>::max(), l1_skiplist, &epoch_manager_);
+    for (int i = 0; i < kNumRegions; i++) {
+      l1_table->BuildLayers(i, l1_pool_id_[i]);
+    }
+#endif
 #endif
     l1_tl->SetFront(l1_table);
+#ifdef LISTDB_L0_CACHE
+    {
+      // The L0 nodes now make up L1
+      std::vector<PmemPtr> merged_nodes;
+      for (PmemPtr paddr = l0_skiplist->head()->next[0]; paddr.get<Node>() != nullptr;
+           paddr = paddr.get<Node>()->next[0]) {
+        merged_nodes.push_back(paddr);
+      }
+      EraseFromL0Cache(task->shard, merged_nodes);
+    }
+#endif
+    EpochGuard epoch_guard(&epoch_manager_);
     auto table = task->memtable_list->GetFront();
     while (true) {
       auto next_table = table->Next();
@@ -1930,12 +2535,16 @@ void ListDB::ZipperCompactionL0(CompactionWorkerData* td,
         break;
       }
     }
+    DropL0Filter(task->l0);
     // Update manifest
     l0_manifest->status = Level0Status::kMergeDone;
     // call clwb
     return;
   }
   auto l1_skiplist = ((PmemTable*)l1_tl->GetFront())->skiplist();
+#ifdef LISTDB_DRAM_LAYERED_L1
+  auto l1_table = (DramLayeredPmemTable*)l1_tl->GetFront();
+#endif
 
   struct ZipperItem {
     PmemPtr node_paddr;
@@ -1951,7 +2560,17 @@ void ListDB::ZipperCompactionL0(CompactionWorkerData* td,
     }
   }
 
-  PmemPtr node_paddr = l0_skiplist->head_paddr();
+  // The head is not a data node; start from the first node
+  PmemPtr node_paddr = l0_skiplist->head()->next[0];
+  // L1 is the last level, so nothing older than L1 needs a tombstone or the
+  // versions it shadows. They are dropped instead of being merged, unless a
+  // live snapshot predates the tombstone.
+  const uint64_t oldest_snapshot_seq = OldestSnapshotSeq();
+  Node* tombstone = nullptr;
+
+#ifdef LISTDB_L0_CACHE
+  std::vector<PmemPtr> merged_nodes;
+#endif
 
   // 1. Scan
   while (true) {
@@ -1962,6 +2581,18 @@ void ListDB::ZipperCompactionL0(CompactionWorkerData* td,
     if (l0_node == nullptr) {
       break;
     }
+#ifdef LISTDB_L0_CACHE
+    merged_nodes.push_back(node_paddr);
+#endif
+    if (tombstone && tombstone->key.Compare(l0_node->key) == 0) {
+      // Older version in this L0 shadowed by the tombstone
+      node_paddr = l0_node->next[0];
+      continue;
+    }
+    tombstone = (l0_node->type() == kTypeDeletion &&
+                 SeqVisible(l0_node->seq(), oldest_snapshot_seq))
+                    ? l0_node
+                    : nullptr;
     int pool_id = node_paddr.pool_id();
     int region = pool_id_to_region_[pool_id];
     int height = l0_node->height();
@@ -2014,14 +2645,46 @@ void ListDB::ZipperCompactionL0(CompactionWorkerData* td,
     std::this_thread::yield();
 #endif
     auto& z = zstack.top();
-    auto l0_node = z->node_paddr.get<Node>();
+    auto l0_node = z->node_paddr.template get<Node>();
+    if (l0_node->type() == kTypeDeletion &&
+        SeqVisible(l0_node->seq(), oldest_snapshot_seq)) {
+      // Unlink the L1 versions shadowed by the tombstone, which itself is
+      // not merged.
+      while (true) {
+        PmemPtr victim_paddr = z->preds[0]->next[0];
+        auto victim = victim_paddr.get<Node>();
+        if (victim == nullptr || victim->key.Compare(l0_node->key) != 0) {
+          break;
+        }
+        int region = pool_id_to_region_[victim_paddr.pool_id()];
+#ifdef LISTDB_DRAM_LAYERED_L1
+        l1_table->Remove(region, victim_paddr);
+#endif
+#ifdef LISTDB_L1_LRU
+        cache_[task->shard][region]->Erase(victim->key, victim_paddr.dump());
+#endif
+#ifdef LISTDB_SKIPLIST_CACHE
+        cache_[task->shard][region]->Erase(victim->key, victim);
+#endif
+        l1_skiplist->Unlink<Persistence>(l1_pool_id_[region], victim_paddr, z->preds[0]);
+      }
+      zstack.pop();
+      delete z;
+      continue;
+    }
+    if (l0_node->seq() != 0 && SeqVisible(l0_node->seq(), oldest_snapshot_seq)) {
+      // Visible to every snapshot from now on. Clearing the seqorder keeps it
+      // visible after the seqorder wraps around.
+      l0_node->tag &= (1ull << 24) - 1;
+      Persistence::Flush(&l0_node->tag, 8);
+    }
     {
       l0_node->next[0] = z->preds[0]->next[0];
-      clwb(&l0_node->next[0], 8);
-      _mm_sfence();
+      Persistence::Flush(&l0_node->next[0], 8);
+      Persistence::Fence();
       z->preds[0]->next[0] = z->node_paddr.dump();
-      clwb(&z->preds[0]->next[0], 8);
-      _mm_sfence();
+      Persistence::Flush(&z->preds[0]->next[0], 8);
+      Persistence::Fence();
       // uint64_t tag = l0_node->tag;
       // tag |= 0x100;
       // l0_node->tag = tag;
@@ -2030,9 +2693,12 @@ void ListDB::ZipperCompactionL0(CompactionWorkerData* td,
       l0_node->next[i] = z->preds[i]->next[i];
       z->preds[i]->next[i] = z->node_paddr.dump();
     }
+#ifdef LISTDB_DRAM_LAYERED_L1
+    l1_table->Add(pool_id_to_region_[z->node_paddr.pool_id()], z->node_paddr);
+#endif
 #ifdef LISTDB_L1_LRU
     if (l0_node->height() >= kMaxHeight - (kNumCachedLevels - 1)) {
-      int region = z->node_paddr.pool_id();
+      int region = pool_id_to_region_[z->node_paddr.pool_id()];
       // sorted_arr_[region][task->shard].emplace_back(l0_node->key,
       // z->node_paddr.dump()); int lru_height = l0_node->height() - (kMaxHeight
       // - kLruMaxHeight); lru_height = (lru_height + 1) / 2;
@@ -2057,6 +2723,10 @@ void ListDB::ZipperCompactionL0(CompactionWorkerData* td,
   }
   REPORT_DONE;  // Up report all remainings
 
+#ifdef LISTDB_L0_CACHE
+  EraseFromL0Cache(task->shard, merged_nodes);
+#endif
+
 #ifdef LISTDB_L1_LRU
   using MyType1 = std::pair<uint64_t, uint64_t>;
   for (int i = 0; i < kNumRegions; i++) {
@@ -2072,6 +2742,7 @@ void ListDB::ZipperCompactionL0(CompactionWorkerData* td,
 
   // Remove empty L0 from MemTableList
   // auto tl = ll_[task->shard]->GetTableList(0);
+  EpochGuard epoch_guard(&epoch_manager_);
   auto table = task->memtable_list->GetFront();
   while (true) {
     auto next_table = table->Next();
@@ -2085,6 +2756,7 @@ void ListDB::ZipperCompactionL0(CompactionWorkerData* td,
       break;
     }
   }
+  DropL0Filter(task->l0);
 #else
   // Insert N times
   // For Test
@@ -2098,6 +2770,7 @@ void ListDB::ZipperCompactionL0(CompactionWorkerData* td,
     auto l1_table =
         new PmemTable(std::numeric_limits<size_t>::max(), l0_skiplist);
     l1_tl->SetFront(l1_table);
+    EpochGuard epoch_guard(&epoch_manager_);
     auto table = task->memtable_list->GetFront();
     while (true) {
       auto next_table = table->Next();
@@ -2141,6 +2814,7 @@ void ListDB::ZipperCompactionL0(CompactionWorkerData* td,
   }
   // Remove empty L0 from MemTableList
   // auto tl = ll_[task->shard]->GetTableList(0);
+  EpochGuard epoch_guard(&epoch_manager_);
   auto table = task->memtable_list->GetFront();
   while (true) {
     auto next_table = table->Next();
@@ -2221,7 +2895,7 @@ void ListDB::L0CompactionCopyOnWrite(L0CompactionTask* task) {
       succs[0][0] = curr_paddr.dump();
     }
 
-    size_t node_size = sizeof(PmemNode) + (height - 1) * 8;
+    size_t node_size = l0_node->alloc_size();
     auto l1_node_paddr = l1_arena_[region][task->shard]->Allocate(node_size);
     auto l1_node = l1_node_paddr.get<Node>();
     l1_node->key = l0_node->key;
@@ -2231,6 +2905,9 @@ void ListDB::L0CompactionCopyOnWrite(L0CompactionTask* task) {
     for (int i = 1; i < height; i++) {
       l1_node->next[i] = succs[region][i];
     }
+    if (l0_node->type() == kTypeInlineValue) {
+      memcpy(l1_node->inline_value(), l0_node->inline_value(), l0_node->value);
+    }
     clwb(l1_node, node_size);
     _mm_sfence();
     preds[0][0]->next[0] = l1_node_paddr.dump();
@@ -2246,6 +2923,7 @@ void ListDB::L0CompactionCopyOnWrite(L0CompactionTask* task) {
 
   // Remove empty L0 from MemTableList
   // auto tl = ll_[task->shard]->GetTableList(0);
+  EpochGuard epoch_guard(&epoch_manager_);
   auto table = task->memtable_list->GetFront();
   while (true) {
     auto next_table = table->Next();
@@ -2259,9 +2937,11 @@ void ListDB::L0CompactionCopyOnWrite(L0CompactionTask* task) {
       break;
     }
   }
+  DropL0Filter(task->l0);
 }
 
 void ListDB::PrintDebugLsmState(int shard) {
+  EpochGuard epoch_guard(&epoch_manager_);
   auto tl = GetTableList(0, shard);
   auto table = tl->GetFront();
   int mem_cnt = 0;
@@ -2282,13 +2962,14 @@ int ListDB::GetStatString(const std::string& name, std::string* buf) {
   int rv = 0;
   std::stringstream ss;
   if (name == "l1_cache_size") {
-#ifdef LISTDB_SKIPLIST_CACHE
+#if defined(LISTDB_SKIPLIST_CACHE) || defined(LISTDB_L1_LRU)
+    // In bytes of DRAM
     size_t sum = 0;
     size_t max = 0;
-    for (int i = 0; i < kNumShards; i++) {
+    for (int i = 0; i < opts_.num_shards; i++) {
       size_t shard_size = 0;
       for (int j = 0; j < kNumRegions; j++) {
-        shard_size += cache_[i][j]->AcquireLoadSize();
+        shard_size += cache_[i][j]->MemoryUsage();
       }
       max = std::max<size_t>(max, shard_size);
       sum += shard_size;
@@ -2298,7 +2979,7 @@ int ListDB::GetStatString(const std::string& name, std::string* buf) {
     rv = 1;
 #endif
   } else if (name == "flush_stats") {
-    for (int i = 0; i < kNumWorkers; i++) {
+    for (int i = 0; i < opts_.num_workers; i++) {
       ss << "worker " << i << ": flush_cnt = " << worker_data_[i].flush_cnt
          << " flush_time_usec = " << worker_data_[i].flush_time_usec
          << std::endl;
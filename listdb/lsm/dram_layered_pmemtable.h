@@ -1,20 +1,142 @@
 #ifndef LISTDB_LSM_DRAM_LAYERED_PMEMTABLE_H_
 #define LISTDB_LSM_DRAM_LAYERED_PMEMTABLE_H_
 
+#include <cstdlib>
+
+#include "listdb/common.h"
 #include "listdb/index/braided_pmem_skiplist.h"
 #include "listdb/index/lockfree_skiplist.h"
-#include "listdb/lsm/table.h"
+#include "listdb/lib/epoch.h"
+#include "listdb/lsm/pmemtable.h"
 
-class DramLayeredPmemTable : public Table {
+// L1 table keeping DRAM copies of the upper layers of its braided skiplist.
+// A PMem node of height kDramLayerMinHeight or more has a DRAM node in the
+// skiplist of its region, shorter by kDramLayerMinHeight - 1 levels and
+// holding the PmemPtr of the PMem node as its value. A lookup descends the
+// DRAM layers to the PMem node preceding the key, so that only the bottom
+// kDramLayerMinHeight - 1 levels are read from PMem.
+// The layers are updated by the compaction of the shard, which is their only
+// writer. Readers must hold an epoch, as removed DRAM nodes are retired
+// through the epoch manager.
+class DramLayeredPmemTable : public PmemTable {
  public:
   using Node = BraidedPmemSkipList::Node;
   using DramNode = lockfree_skiplist::Node;
 
-  DramLayeredPmemTable(const size_t table_capacity, BraidedPmemSkipList* skiplist);
+  DramLayeredPmemTable(const size_t table_capacity, BraidedPmemSkipList* skiplist,
+                       EpochManager* epoch_manager);
+
+  ~DramLayeredPmemTable();
+
+  // Mirrors the nodes already linked in the upper layers of a region, whose
+  // head is in the given pool. Must run before the table is published.
+  void BuildLayers(const int region, const int pool_id);
+
+  // Mirrors a node that has been linked in every layer of its region
+  void Add(const int region, PmemPtr node_paddr);
+
+  // Drops the DRAM node of a node about to be unlinked from PMem
+  void Remove(const int region, PmemPtr node_paddr);
+
+  // Last node of the region with a key less than the key that has a DRAM
+  // node. nullptr if there is none, i.e. the search starts from the head.
+  Node* FindPred(const int region, const Key& key);
 
  private:
-  BraidedPmemSkipList* skiplist_;
-  lockfree_skiplist* cache_;
+  static int DramHeight(const int pmem_height) { return pmem_height - (kDramLayerMinHeight - 1); }
+
+  EpochManager* epoch_manager_;
+  lockfree_skiplist* cache_[kNumRegions];
 };
 
+DramLayeredPmemTable::DramLayeredPmemTable(const size_t table_capacity,
+                                           BraidedPmemSkipList* skiplist,
+                                           EpochManager* epoch_manager)
+    : PmemTable(table_capacity, skiplist), epoch_manager_(epoch_manager) {
+  for (int i = 0; i < kNumRegions; i++) {
+    cache_[i] = new lockfree_skiplist();
+  }
+}
+
+DramLayeredPmemTable::~DramLayeredPmemTable() {
+  for (int i = 0; i < kNumRegions; i++) {
+    DramNode* node = cache_[i]->head()->next[0].load();
+    while (node) {
+      DramNode* next = node->next[0].load();
+      free(node);
+      node = next;
+    }
+    delete cache_[i];
+  }
+}
+
+void DramLayeredPmemTable::BuildLayers(const int region, const int pool_id) {
+  // Every node on this layer is tall enough to be mirrored
+  const int l = kDramLayerMinHeight - 1;
+  PmemPtr node_paddr = skiplist()->head(pool_id)->next[l];
+  Node* node;
+  while ((node = node_paddr.get<Node>()) != nullptr) {
+    Add(region, node_paddr);
+    node_paddr = node->next[l];
+  }
+}
+
+void DramLayeredPmemTable::Add(const int region, PmemPtr node_paddr) {
+  Node* node = node_paddr.get<Node>();
+  if (node->height() < kDramLayerMinHeight) {
+    return;
+  }
+  const int height = DramHeight(node->height());
+  const size_t alloc_size = DramNode::compute_alloc_size(node->key, height);
+  DramNode* dram_node = DramNode::init_node((char*) aligned_alloc(8, alloc_size), node->key, 0,
+                                            ValueType(node->type()), height, node_paddr.dump());
+  cache_[region]->Insert(dram_node);
+}
+
+void DramLayeredPmemTable::Remove(const int region, PmemPtr node_paddr) {
+  Node* node = node_paddr.get<Node>();
+  if (node->height() < kDramLayerMinHeight) {
+    return;
+  }
+  const uint64_t value = node_paddr.dump();
+  DramNode* pred = cache_[region]->head();
+  DramNode* dram_node = nullptr;
+  for (int l = kMaxHeight - 1; l >= 0; l--) {
+    DramNode* curr = pred->next[l].load(std::memory_order_acquire);
+    while (curr && curr->key.Compare(node->key) < 0) {
+      pred = curr;
+      curr = pred->next[l].load(std::memory_order_acquire);
+    }
+    // Other versions of the key may precede the node
+    DramNode* upper_pred = pred;
+    while (curr && curr->key.Compare(node->key) == 0 && curr->value != value) {
+      upper_pred = curr;
+      curr = upper_pred->next[l].load(std::memory_order_acquire);
+    }
+    if (curr && curr->value == value) {
+      // Readers on the node still move on through its next pointers
+      upper_pred->next[l].store(curr->next[l].load(std::memory_order_relaxed),
+                                std::memory_order_release);
+      dram_node = curr;
+    }
+  }
+  if (dram_node) {
+    epoch_manager_->Retire([dram_node] { free(dram_node); });
+  }
+}
+
+inline DramLayeredPmemTable::Node* DramLayeredPmemTable::FindPred(const int region,
+                                                                  const Key& key) {
+  DramNode* head = cache_[region]->head();
+  DramNode* pred = head;
+  for (int l = kMaxHeight - 1; l >= 0; l--) {
+    DramNode* curr = pred->next[l].load(std::memory_order_acquire);
+    while (curr && curr->key.Compare(key) < 0) {
+      pred = curr;
+      curr = pred->next[l].load(std::memory_order_acquire);
+    }
+  }
+  return (pred == head) ? nullptr : PmemPtr::Decode<Node>(pred->value);
+}
+
 #endif  // LISTDB_LSM_DRAM_LAYERED_PMEMTABLE_H_
@@ -1,9 +1,11 @@
 #ifndef LISTDB_LSM_MEMTABLE_H_
 #define LISTDB_LSM_MEMTABLE_H_
 
+#include <algorithm>
 #include <cstdio>
 
 #include "listdb/index/lockfree_skiplist.h"
+#include "listdb/lib/arena.h"
 #include "listdb/index/braided_pmem_skiplist.h"
 #include "listdb/lsm/table.h"
 
@@ -18,6 +20,14 @@ class MemTable : public Table {
 
   virtual bool Get(const Key& key, void** value_out) override;
 
+  virtual Iterator* NewIterator(const Snapshot* snapshot = nullptr) override;
+
+  // Skiplist nodes are allocated from the arena of the table and are freed
+  // together with the table
+  char* AllocateNode(const size_t size) { return arena_.allocate(size); }
+
+  size_t ArenaMemoryUsage() const { return arena_.MemoryUsage(); }
+
   bool IsFlushed() { return (l0_ != nullptr); }
 
   void SetPersistentTable(Table* pmemtable) { l0_ = pmemtable; }
@@ -37,6 +47,9 @@ class MemTable : public Table {
   uint64_t l0_id() const { return l0_manifest_->id; }
 
  private:
+  static constexpr size_t kMinArenaBlockSize = 64 * 1024;
+
+  Arena arena_;
   lockfree_skiplist* skiplist_;
   BraidedPmemSkipList* l0_skiplist_ = nullptr;
   // TODO(wkim): use PmemTable*
@@ -44,7 +57,61 @@ class MemTable : public Table {
   pmem::obj::persistent_ptr<pmem_l0_info> l0_manifest_ = nullptr;
 };
 
-MemTable::MemTable(const size_t table_capacity) : Table(table_capacity, TableType::kMemTable) {
+// Iterates a MemTable concurrently with writers.
+// Node values point to IUL entries, from which the values are read.
+class MemTableIterator : public Iterator {
+ public:
+  using Node = lockfree_skiplist::Node;
+  using PmemNode = BraidedPmemSkipList::Node;
+
+  MemTableIterator(lockfree_skiplist* skiplist, const Snapshot* snapshot)
+      : skiplist_(skiplist), snapshot_(snapshot), node_(nullptr) { }
+
+  virtual bool Valid() const override { return node_ != nullptr; }
+
+  virtual void SeekToFirst() override {
+    node_ = skiplist_->head()->next[0].load(std::memory_order_acquire);
+    SkipInvisible();
+  }
+
+  virtual void Seek(const Key& key) override {
+    node_ = skiplist_->Lookup(key);
+    SkipInvisible();
+  }
+
+  virtual void Next() override {
+    node_ = node_->next[0].load(std::memory_order_acquire);
+    SkipInvisible();
+  }
+
+  virtual Key key() const override { return node_->key; }
+
+  virtual Value value() const override { return PmemPtr::Decode<PmemNode>(node_->value)->value; }
+
+  virtual std::string_view inline_value() const override {
+    auto iul_entry = PmemPtr::Decode<PmemNode>(node_->value);
+    return std::string_view(iul_entry->inline_value(), iul_entry->value);
+  }
+
+  virtual ValueType type() const override { return ValueType(node_->type()); }
+
+ private:
+  void SkipInvisible() {
+    while (snapshot_ && node_ && !SeqVisible(node_->seq(), snapshot_->seq())) {
+      node_ = node_->next[0].load(std::memory_order_acquire);
+    }
+  }
+
+  lockfree_skiplist* skiplist_;
+  const Snapshot* snapshot_;
+  Node* node_;
+};
+
+// The capacity counts key and value bytes, which are about half the size of
+// the nodes, so a table fills about 8 blocks
+MemTable::MemTable(const size_t table_capacity)
+    : Table(table_capacity, TableType::kMemTable),
+      arena_(std::max(kMinArenaBlockSize, table_capacity / 4)) {
   skiplist_ = new lockfree_skiplist();
 }
 
@@ -62,4 +129,8 @@ bool MemTable::Get(const Key& key, void** value_out) {
   return false;
 }
 
+Iterator* MemTable::NewIterator(const Snapshot* snapshot) {
+  return new MemTableIterator(skiplist_, snapshot);
+}
+
 #endif  // LISTDB_LSM_MEMTABLE_H_
@@ -4,55 +4,196 @@
 #include <condition_variable>
 #include <functional>
 
+#include "listdb/lib/epoch.h"
 #include "listdb/lsm/memtable.h"
 #include "listdb/lsm/table_list.h"
 
 class MemTableList : public TableList {
  public:
-  MemTableList(const size_t table_capacity, const int shard_id);
+  MemTableList(const size_t table_capacity, const int shard_id,
+               const int max_num_memtables = kMaxNumMemTables);
+
+  ~MemTableList();
 
   void BindEnqueueFunction(std::function<void(MemTable*)> enqueue_fn);
 
+  // The function is called to have PrepareStandby run in the background.
+  // Without it, every new table is built on rollover.
+  void BindPrepareFunction(std::function<void()> prepare_fn);
+
+  // Builds the next mutable table and its L0 manifest ahead of time, so that
+  // a rollover only links them
+  void PrepareStandby();
+
+  // Frees the standby table with its L0 manifest and heads, which are not
+  // linked to the shard manifest. Must run before the pools are released.
+  void DropStandby();
+
   void BindArena(int region, PmemLog* arena);
 
+  // Pool of the DB manifests
+  void BindRootPool(const int pool_id);
+
+  // Flushed immutables are freed through the epoch manager once no reader
+  // can reach them. They are kept if no manager is bound.
+  void BindEpochManager(EpochManager* epoch_manager);
+
   void CleanUpFlushedImmutables();
 
   void CreateNewFront();
 
+  virtual void WaitForMutable() override;
+
  protected:
   virtual Table* NewMutable(size_t table_capacity, Table* next_table) override;
 
+  virtual Table* TryNewMutable(size_t table_capacity, Table* next_table) override;
+
+  // Waits for the number of tables to drop below the limit if wait is set.
+  // Returns nullptr otherwise.
+  Table* LinkNewMutable(size_t table_capacity, Table* next_table, const bool wait);
+
   virtual Table* NewMutable(size_t table_capacity, Table* next_table,
                             PmemAllocator* allocator) override;
 
   virtual void EnqueueCompaction(Table* table) override;
 
+  // Allocates a table with an empty L0 skiplist and an unlinked manifest
+  MemTable* BuildMutable(size_t table_capacity);
+
+  void RequestStandby();
+
   const int shard_id_;
-  const int max_num_memtables_ = kMaxNumMemTables;
+  const int max_num_memtables_;
   int num_memtables_ = 0;
   std::function<void(MemTable*)> enqueue_fn_;
+  std::function<void()> prepare_fn_;
+  MemTable* standby_ = nullptr;
+  bool standby_requested_ = false;
 
   PmemLog* arena_[kNumRegions];
+  int root_pool_id_ = 0;
+  EpochManager* epoch_manager_ = nullptr;
 
   std::mutex mu_;
   std::condition_variable cv_;
 };
 
-MemTableList::MemTableList(const size_t table_capacity, const int shard_id)
-    : TableList(table_capacity), shard_id_(shard_id) {}
+MemTableList::MemTableList(const size_t table_capacity, const int shard_id,
+                           const int max_num_memtables)
+    : TableList(table_capacity),
+      shard_id_(shard_id),
+      max_num_memtables_(max_num_memtables) {}
+
+MemTableList::~MemTableList() {
+  DropStandby();
+}
 
 void MemTableList::BindEnqueueFunction(
     std::function<void(MemTable*)> enqueue_fn) {
   enqueue_fn_ = enqueue_fn;
 }
 
+void MemTableList::BindPrepareFunction(std::function<void()> prepare_fn) {
+  prepare_fn_ = prepare_fn;
+}
+
 void MemTableList::BindArena(int region, PmemLog* arena) {
   arena_[region] = arena;
 }
 
+void MemTableList::BindRootPool(const int pool_id) {
+  root_pool_id_ = pool_id;
+}
+
+void MemTableList::BindEpochManager(EpochManager* epoch_manager) {
+  epoch_manager_ = epoch_manager;
+}
+
+inline MemTable* MemTableList::BuildMutable(size_t table_capacity) {
+  MemTable* new_table =
+      new MemTable(table_capacity);  // TODO(wkim): a table must have an ID
+
+  pmem::obj::persistent_ptr<pmem_l0_info> l0_manifest;
+  auto db_pool = Pmem::pool<pmem_db>(root_pool_id_);
+  pmem::obj::make_persistent_atomic<pmem_l0_info>(db_pool, l0_manifest);
+  l0_manifest->status = Level0Status::kInitialized;
+  BraidedPmemSkipList* l0_skiplist =
+      new BraidedPmemSkipList(arena_[0]->pool_id());
+  for (int i = 0; i < kNumRegions; i++) {
+    l0_skiplist->BindArena(arena_[i]->pool_id(), arena_[i]);
+  }
+  l0_skiplist->Init();
+  for (int i = 0; i < kNumRegions; i++) {
+    int pool_id = arena_[i]->pool_id();
+    l0_manifest->head[i] = l0_skiplist->p_head(pool_id);
+  }
+  new_table->SetL0SkipList(l0_skiplist);
+  new_table->SetL0Manifest(l0_manifest);
+  return new_table;
+}
+
+void MemTableList::PrepareStandby() {
+  // Outside the lock, as this is the slow part of a rollover
+  MemTable* table = BuildMutable(table_capacity_);
+  std::lock_guard<std::mutex> lk(mu_);
+  assert(standby_ == nullptr);
+  standby_ = table;
+  standby_requested_ = false;
+}
+
+void MemTableList::DropStandby() {
+  std::lock_guard<std::mutex> lk(mu_);
+  if (standby_ == nullptr) {
+    return;
+  }
+  auto l0_manifest = standby_->l0_manifest();
+  const size_t head_size =
+      sizeof(BraidedPmemSkipList::Node) + (kMaxHeight - 1) * sizeof(uint64_t);
+  for (int i = 0; i < kNumRegions; i++) {
+    pmem::obj::delete_persistent_atomic<char[]>(l0_manifest->head[i], head_size);
+  }
+  pmem::obj::delete_persistent_atomic<pmem_l0_info>(l0_manifest);
+  delete standby_->l0_skiplist();
+  delete standby_;
+  standby_ = nullptr;
+}
+
+inline void MemTableList::RequestStandby() {
+  if (!prepare_fn_) {
+    return;
+  }
+  {
+    std::lock_guard<std::mutex> lk(mu_);
+    if (standby_ || standby_requested_) {
+      return;
+    }
+    standby_requested_ = true;
+  }
+  prepare_fn_();
+}
+
 inline Table* MemTableList::NewMutable(size_t table_capacity,
                                        Table* next_table) {
+  return LinkNewMutable(table_capacity, next_table, true);
+}
+
+inline Table* MemTableList::TryNewMutable(size_t table_capacity,
+                                          Table* next_table) {
+  return LinkNewMutable(table_capacity, next_table, false);
+}
+
+inline void MemTableList::WaitForMutable() {
+  std::unique_lock<std::mutex> lk(mu_);
+  cv_.wait(lk, [&] { return num_memtables_ < max_num_memtables_; });
+}
+
+inline Table* MemTableList::LinkNewMutable(size_t table_capacity,
+                                           Table* next_table, const bool wait) {
   std::unique_lock<std::mutex> lk(mu_);
+  if (!wait && num_memtables_ >= max_num_memtables_) {
+    return nullptr;
+  }
   cv_.wait(lk, [&] {
     if (num_memtables_ < max_num_memtables_) {
       return true;
@@ -62,9 +203,12 @@ inline Table* MemTableList::NewMutable(size_t table_capacity,
     }
   });
   num_memtables_++;
+  MemTable* new_table = standby_;
+  standby_ = nullptr;
   lk.unlock();
-  MemTable* new_table =
-      new MemTable(table_capacity);  // TODO(wkim): a table must have an ID
+  if (new_table == nullptr) {
+    new_table = BuildMutable(table_capacity);
+  }
 
   // Set the next table as full
   if (next_table) {
@@ -74,29 +218,17 @@ inline Table* MemTableList::NewMutable(size_t table_capacity,
     // call clwb
   }
 
-  // Init the new manifest for a new table
-  pmem::obj::persistent_ptr<pmem_l0_info> l0_manifest;
-  auto db_pool = Pmem::pool<pmem_db>(0);
-  pmem::obj::make_persistent_atomic<pmem_l0_info>(db_pool, l0_manifest);
-  auto db_root = db_pool.root();
+  // Link the manifest of the new table. Ids are taken here so that they
+  // follow the order of the tables.
+  auto l0_manifest = new_table->l0_manifest();
+  auto db_root = Pmem::pool<pmem_db>(root_pool_id_).root();
   auto shard_manifest = db_root->shard[shard_id_];
   l0_manifest->id = shard_manifest->l0_cnt++;
-  l0_manifest->status = Level0Status::kInitialized;
-  BraidedPmemSkipList* l0_skiplist =
-      new BraidedPmemSkipList(arena_[0]->pool_id());
-  for (int i = 0; i < kNumRegions; i++) {
-    l0_skiplist->BindArena(arena_[i]->pool_id(), arena_[i]);
-  }
-  l0_skiplist->Init();
-  for (int i = 0; i < kNumRegions; i++) {
-    int pool_id = arena_[i]->pool_id();
-    l0_manifest->head[i] = l0_skiplist->p_head(pool_id);
-  }
   l0_manifest->next = shard_manifest->l0_list_head->next;
   shard_manifest->l0_list_head->next = l0_manifest;
-  new_table->SetL0SkipList(l0_skiplist);
-  new_table->SetL0Manifest(l0_manifest);
   new_table->SetNext(next_table);
+
+  RequestStandby();
   return new_table;
 }
 
@@ -159,8 +291,10 @@ void MemTableList::CleanUpFlushedImmutables() {
 #if LISTDB_FLUSH_MEMTABLE_TO_L1 == 1
   std::unique_lock<std::mutex> lk(mu_);
   num_memtables_--;
-  cv_.notify_one();
+  cv_.notify_all();
 #else
+  // Flushes of the same shard may finish concurrently
+  std::unique_lock<std::mutex> lk(mu_);
   auto curr = GetFront();
   std::vector<Table*> tables;
   while (curr) {
@@ -168,6 +302,7 @@ void MemTableList::CleanUpFlushedImmutables() {
     curr = curr->Next();
   }
   int flushed_cnt = 0;
+  std::vector<MemTable*> unlinked;
 
   // std::vector<Table*> pmemtables;
   MemTable* pred = nullptr;
@@ -186,7 +321,7 @@ void MemTableList::CleanUpFlushedImmutables() {
         pred->SetNext(pmem);
 
         flushed_cnt++;
-        // TODO(wkim): free imm
+        unlinked.push_back(imm);
       } else {
         break;
       }
@@ -200,10 +335,18 @@ void MemTableList::CleanUpFlushedImmutables() {
   //   pred->SetNext(pmemtables.back());
   // }
 
-  std::unique_lock<std::mutex> lk(mu_);
   num_memtables_ -= flushed_cnt;
   lk.unlock();
-  cv_.notify_one();
+  // A waiter in WaitForMutable makes no table, so it must not take the only
+  // wakeup
+  cv_.notify_all();
+
+  if (epoch_manager_) {
+    for (auto& imm : unlinked) {
+      epoch_manager_->Retire([imm] { delete imm; });
+    }
+    epoch_manager_->Reclaim();
+  }
 #endif
 }
 
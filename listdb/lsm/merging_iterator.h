@@ -0,0 +1,136 @@
+#ifndef LISTDB_LSM_MERGING_ITERATOR_H_
+#define LISTDB_LSM_MERGING_ITERATOR_H_
+
+#include <algorithm>
+#include <functional>
+#include <vector>
+
+#include "listdb/common.h"
+#include "listdb/iterator.h"
+
+// K-way merge over sorted child iterators using a binary heap.
+// Children must be given in order from the newest to the oldest source. When
+// several children are positioned at the same key, only the entry of the
+// newest child is returned and the older versions are skipped. Keys whose
+// newest entry is a tombstone are skipped as a whole.
+class MergingIterator : public Iterator {
+ public:
+  explicit MergingIterator(std::vector<Iterator*>&& children);
+
+  ~MergingIterator();
+
+  virtual bool Valid() const override { return !heap_.empty(); }
+
+  virtual void SeekToFirst() override;
+
+  virtual void Seek(const Key& key) override;
+
+  virtual void Next() override;
+
+  virtual Key key() const override { return children_[heap_.front()]->key(); }
+
+  virtual Value value() const override { return children_[heap_.front()]->value(); }
+
+  virtual std::string_view inline_value() const override { return children_[heap_.front()]->inline_value(); }
+
+  virtual ValueType type() const override { return children_[heap_.front()]->type(); }
+
+  // The function is run when the iterator is deleted, after the children
+  void RegisterCleanup(std::function<void()> fn) { cleanups_.push_back(std::move(fn)); }
+
+ private:
+  // Returns true if child a comes after child b (min-heap ordering)
+  bool After(const int a, const int b) const;
+
+  void BuildHeap();
+
+  void PopAndAdvanceFront();
+
+  // Skips the current entry and every older version of the same key
+  void SkipCurrentKey();
+
+  void SkipDeletedKeys();
+
+  std::vector<Iterator*> children_;
+  std::vector<int> heap_;
+  std::vector<std::function<void()>> cleanups_;
+};
+
+MergingIterator::MergingIterator(std::vector<Iterator*>&& children)
+    : children_(std::move(children)) {
+  heap_.reserve(children_.size());
+}
+
+MergingIterator::~MergingIterator() {
+  for (auto& child : children_) {
+    delete child;
+  }
+  for (auto& fn : cleanups_) {
+    fn();
+  }
+}
+
+void MergingIterator::SeekToFirst() {
+  for (auto& child : children_) {
+    child->SeekToFirst();
+  }
+  BuildHeap();
+  SkipDeletedKeys();
+}
+
+void MergingIterator::Seek(const Key& key) {
+  for (auto& child : children_) {
+    child->Seek(key);
+  }
+  BuildHeap();
+  SkipDeletedKeys();
+}
+
+void MergingIterator::Next() {
+  assert(Valid());
+  SkipCurrentKey();
+  SkipDeletedKeys();
+}
+
+void MergingIterator::SkipCurrentKey() {
+  const Key curr_key = key();
+  while (!heap_.empty() && children_[heap_.front()]->key().Compare(curr_key) == 0) {
+    PopAndAdvanceFront();
+  }
+}
+
+void MergingIterator::SkipDeletedKeys() {
+  while (!heap_.empty() && type() == kTypeDeletion) {
+    SkipCurrentKey();
+  }
+}
+
+inline bool MergingIterator::After(const int a, const int b) const {
+  int cmp = children_[a]->key().Compare(children_[b]->key());
+  return (cmp > 0) || (cmp == 0 && a > b);
+}
+
+void MergingIterator::BuildHeap() {
+  auto after = [&](const int a, const int b) { return After(a, b); };
+  heap_.clear();
+  for (int i = 0; i < (int) children_.size(); i++) {
+    if (children_[i]->Valid()) {
+      heap_.push_back(i);
+    }
+  }
+  std::make_heap(heap_.begin(), heap_.end(), after);
+}
+
+void MergingIterator::PopAndAdvanceFront() {
+  auto after = [&](const int a, const int b) { return After(a, b); };
+  std::pop_heap(heap_.begin(), heap_.end(), after);
+  int front = heap_.back();
+  heap_.pop_back();
+  children_[front]->Next();
+  if (children_[front]->Valid()) {
+    heap_.push_back(front);
+    std::push_heap(heap_.begin(), heap_.end(), after);
+  }
+}
+
+#endif  // LISTDB_LSM_MERGING_ITERATOR_H_
@@ -2,6 +2,7 @@
 #define LISTDB_LSM_PMEMTABLE_H_
 
 #include "listdb/index/braided_pmem_skiplist.h"
+#include "listdb/lib/bloom_filter.h"
 #include "listdb/lsm/table.h"
 
 class PmemTable : public Table {
@@ -14,6 +15,11 @@ class PmemTable : public Table {
 
   virtual bool Get(const Key& key, void** value_out) override;
 
+  virtual Iterator* NewIterator(const Snapshot* snapshot = nullptr) override;
+
+  // Seeks through the upper layers local to the given pool
+  Iterator* NewIterator(const int pool_id, const Snapshot* snapshot = nullptr);
+
   BraidedPmemSkipList* skiplist() { return skiplist_; }
 
   void SetManifest(pmem::obj::persistent_ptr_base manifest) { manifest_ = manifest; }
@@ -21,9 +27,74 @@ class PmemTable : public Table {
   template <typename T>
   pmem::obj::persistent_ptr<T> manifest() { return manifest_.raw(); }
 
+  // DRAM filter over the keys of an L0 table. A table without one may hold
+  // any key.
+  void SetFilter(BloomFilter* filter) { filter_.store(filter, std::memory_order_release); }
+
+  // The caller retires the filter, as readers may still use it
+  BloomFilter* ReleaseFilter() { return filter_.exchange(nullptr); }
+
+  bool MayContain(const uint64_t key_hash) {
+    auto filter = filter_.load(std::memory_order_acquire);
+    return (filter == nullptr || filter->MayContain(key_hash));
+  }
+
  private:
   BraidedPmemSkipList* skiplist_;
   pmem::obj::persistent_ptr_base manifest_;
+  std::atomic<BloomFilter*> filter_{nullptr};
+};
+
+// Iterates the bottom layer of a braided skiplist.
+// Zipper compaction may splice L1 nodes after the current node of an L0
+// iterator. Those nodes are still in key order and never newer than the L0
+// nodes, so the iterator keeps returning valid results without blocking the
+// compaction.
+class PmemTableIterator : public Iterator {
+ public:
+  using Node = BraidedPmemSkipList::Node;
+
+  PmemTableIterator(BraidedPmemSkipList* skiplist, const int pool_id, const Snapshot* snapshot)
+      : skiplist_(skiplist), pool_id_(pool_id), snapshot_(snapshot), node_(nullptr) { }
+
+  virtual bool Valid() const override { return node_ != nullptr; }
+
+  virtual void SeekToFirst() override {
+    node_ = PmemPtr::Decode<Node>(skiplist_->head()->next[0]);
+    SkipInvisible();
+  }
+
+  virtual void Seek(const Key& key) override {
+    node_ = skiplist_->Lookup(key, pool_id_).get<Node>();
+    SkipInvisible();
+  }
+
+  virtual void Next() override {
+    node_ = PmemPtr::Decode<Node>(node_->next[0]);
+    SkipInvisible();
+  }
+
+  virtual Key key() const override { return node_->key; }
+
+  virtual Value value() const override { return node_->value; }
+
+  virtual std::string_view inline_value() const override {
+    return std::string_view(node_->inline_value(), node_->value);
+  }
+
+  virtual ValueType type() const override { return node_->type(); }
+
+ private:
+  void SkipInvisible() {
+    while (snapshot_ && node_ && !SeqVisible(node_->seq(), snapshot_->seq())) {
+      node_ = PmemPtr::Decode<Node>(node_->next[0]);
+    }
+  }
+
+  BraidedPmemSkipList* skiplist_;
+  const int pool_id_;
+  const Snapshot* snapshot_;
+  Node* node_;
 };
 
 PmemTable::PmemTable(const size_t table_capacity, BraidedPmemSkipList* skiplist)
@@ -40,4 +111,12 @@ bool PmemTable::Get(const Key& key, void** value_out) {
   return false;
 }
 
+Iterator* PmemTable::NewIterator(const Snapshot* snapshot) {
+  return new PmemTableIterator(skiplist_, skiplist_->primary_pool_id(), snapshot);
+}
+
+Iterator* PmemTable::NewIterator(const int pool_id, const Snapshot* snapshot) {
+  return new PmemTableIterator(skiplist_, pool_id, snapshot);
+}
+
 #endif  // LISTDB_LSM_PMEMTABLE_H_
@@ -1,6 +1,10 @@
 #ifndef LISTDB_LSM_PMEMTABLE_LIST_H_
 #define LISTDB_LSM_PMEMTABLE_LIST_H_
 
+#include "listdb/lib/epoch.h"
+#ifdef LISTDB_DRAM_LAYERED_L1
+#include "listdb/lsm/dram_layered_pmemtable.h"
+#endif
 #include "listdb/lsm/pmemtable.h"
 #include "listdb/lsm/table_list.h"
 
@@ -8,7 +12,10 @@ class PmemTableList : public TableList {
  public:
   PmemTableList(const size_t table_capacity, const int primary_region_pool_id);
 
-  void BindArena(int pool_id, PmemLog* arena);
+  void BindArena(int region, PmemLog* arena);
+
+  // Retires the DRAM layers of the tables, if any
+  void BindEpochManager(EpochManager* epoch_manager);
 
  protected:
   virtual Table* NewMutable(size_t table_capacity, Table* next_table) override;
@@ -17,7 +24,11 @@ class PmemTableList : public TableList {
                             PmemAllocator* allocator) override;
 
   const int primary_region_pool_id_;
-  std::map<int, PmemLog*> arena_;
+  PmemLog* arena_[kNumRegions] = {};
+  EpochManager* epoch_manager_ = nullptr;
+
+ private:
+  PmemTable* NewTable(size_t table_capacity);
 };
 
 PmemTableList::PmemTableList(const size_t table_capacity,
@@ -25,19 +36,31 @@ PmemTableList::PmemTableList(const size_t table_capacity,
     : TableList(table_capacity),
       primary_region_pool_id_(primary_region_pool_id) {}
 
-void PmemTableList::BindArena(const int pool_id, PmemLog* arena) {
-  arena_.emplace(pool_id, arena);
+void PmemTableList::BindArena(const int region, PmemLog* arena) {
+  arena_[region] = arena;
 }
 
-inline Table* PmemTableList::NewMutable(size_t table_capacity,
-                                        Table* next_table) {
+void PmemTableList::BindEpochManager(EpochManager* epoch_manager) {
+  epoch_manager_ = epoch_manager;
+}
+
+inline PmemTable* PmemTableList::NewTable(size_t table_capacity) {
   // Bind Arena
   auto skiplist = new BraidedPmemSkipList(primary_region_pool_id_);
-  for (auto& it : arena_) {
-    skiplist->BindArena(it.first, it.second);
+  for (int i = 0; i < kNumRegions; i++) {
+    skiplist->BindArena(arena_[i]->pool_id(), arena_[i]);
   }
   skiplist->Init();
-  PmemTable* new_table = new PmemTable(table_capacity, skiplist);
+#ifndef LISTDB_DRAM_LAYERED_L1
+  return new PmemTable(table_capacity, skiplist);
+#else
+  return new DramLayeredPmemTable(table_capacity, skiplist, epoch_manager_);
+#endif
+}
+
+inline Table* PmemTableList::NewMutable(size_t table_capacity,
+                                        Table* next_table) {
+  PmemTable* new_table = NewTable(table_capacity);
   new_table->SetNext(next_table);
   return new_table;
 }
@@ -45,13 +68,7 @@ inline Table* PmemTableList::NewMutable(size_t table_capacity,
 inline Table* PmemTableList::NewMutable(size_t table_capacity,
                                         Table* next_table,
                                         PmemAllocator* allocator) {
-  // Bind Arena
-  auto skiplist = new BraidedPmemSkipList(primary_region_pool_id_);
-  for (auto& it : arena_) {
-    skiplist->BindArena(it.first, it.second);
-  }
-  skiplist->Init();
-  PmemTable* new_table = new PmemTable(table_capacity, skiplist);
+  PmemTable* new_table = NewTable(table_capacity);
   new_table->SetNext(next_table);
   return new_table;
 }
@@ -1,13 +1,24 @@
 #ifndef LISTDB_LSM_TABLE_H_
 #define LISTDB_LSM_TABLE_H_
 
+#include <algorithm>
 #include <atomic>
+#include <functional>
 #include <map>
 
 #include "listdb/common.h"
+#include "listdb/iterator.h"
+#include "listdb/snapshot.h"
 
 class Table {
  public:
+  // Writers are accounted per client, on cache lines of their own. A client
+  // reserves capacity in bulk of kBulkSize bytes. Writers without a client
+  // index share kSharedClient and reserve exactly what they write.
+  static constexpr int kNumClients = 80;
+  static constexpr int kSharedClient = kNumClients;
+  static constexpr size_t kBulkSize = 10 * 16;
+
   Table(const size_t capacity, TableType type);
 
   virtual void* Put(const Key& key, const Value& value) = 0;
@@ -16,19 +27,26 @@ class Table {
 
   TableType type() { return type_; }
 
-  //virtual Iterator* NewIterator() = 0;
+  // Versions invisible to the snapshot are skipped if one is given
+  virtual Iterator* NewIterator(const Snapshot* snapshot = nullptr) = 0;
 
   void SetNext(Table* next, const std::memory_order mo = std::memory_order_seq_cst);
 
   Table* Next(const std::memory_order mo = std::memory_order_seq_cst);
 
-  void w_Ref(const std::memory_order mo = std::memory_order_seq_cst);
+  void w_Ref(const int client = kSharedClient);
+
+  void w_UnRef(const int client = kSharedClient);
 
-  void w_UnRef(const std::memory_order mo = std::memory_order_seq_cst);
+  // Must be called while holding a writer reference
+  bool HasRoom(const size_t size, const int client = kSharedClient);
 
-  bool HasRoom(const size_t size, const std::memory_order mo = std::memory_order_seq_cst);
+  int64_t w_RefCount();
 
-  int64_t w_RefCount () { return writer_ref_cnt_ - writer_unref_cnt_; }
+  // Runs fn once, when no writer holds a reference anymore. Either this
+  // thread or the last w_UnRef runs it. HasRoom fails after this, so
+  // writers referencing the table later leave without writing.
+  void SealWriters(std::function<void()> fn);
 
   void SetSize(const size_t size) { size_.store(size); }
 
@@ -41,9 +59,19 @@ class Table {
  protected:
   const size_t capacity_;
   TableType type_;
-  std::atomic<int64_t> writer_ref_cnt_ = 0;
+  struct alignas(64) ClientSlot {
+    std::atomic<int64_t> ref{0};
+    size_t reserved = 0;  // bytes reserved from size_
+    size_t used = 0;
+  };
+
+  void CheckWritersDone();
+
+  ClientSlot clients_[kNumClients + 1];
   std::atomic<size_t> size_;
-  std::atomic<int64_t> writer_unref_cnt_ = 0;
+  std::atomic<bool> sealed_ = false;
+  std::atomic<bool> writers_done_ = false;
+  std::function<void()> on_writers_done_;
   std::atomic<Table*> next_;
   //std::atomic<size_t> size_retired_;
 };
@@ -58,18 +86,61 @@ inline Table* Table::Next(const std::memory_order mo) {
   return next_.load(mo);
 }
 
-// XXX: fetch_add with relaxed memory order is effectively promoted to seq_cst for x86-64.
-inline void Table::w_Ref(const std::memory_order mo) {
-  writer_ref_cnt_.fetch_add(1, mo);
+inline void Table::w_Ref(const int client) {
+  clients_[client].ref.fetch_add(1);
+}
+
+inline void Table::w_UnRef(const int client) {
+  clients_[client].ref.fetch_sub(1);
+  if (sealed_.load()) {
+    CheckWritersDone();
+  }
+}
+
+inline bool Table::HasRoom(const size_t size, const int client) {
+  // Either the seal sees the reference taken before, or this sees the seal
+  if (sealed_.load()) {
+    return false;
+  }
+  if (client == kSharedClient) {
+    const size_t before = size_.fetch_add(size);
+    return (before + size <= capacity_);
+  }
+  auto& slot = clients_[client];
+  if (slot.used + size > slot.reserved) {
+    const size_t bulk = std::max(size, kBulkSize);
+    const size_t before = size_.fetch_add(bulk);
+    if (before + bulk > capacity_) {
+      return false;
+    }
+    slot.reserved += bulk;
+  }
+  slot.used += size;
+  return true;
+}
+
+inline int64_t Table::w_RefCount() {
+  int64_t cnt = 0;
+  for (auto& slot : clients_) {
+    cnt += slot.ref.load();
+  }
+  return cnt;
 }
 
-inline void Table::w_UnRef(const std::memory_order mo) {
-  writer_unref_cnt_.fetch_add(1, mo);
+inline void Table::SealWriters(std::function<void()> fn) {
+  on_writers_done_ = std::move(fn);
+  sealed_.store(true);
+  CheckWritersDone();
 }
 
-inline bool Table::HasRoom(const size_t size, const std::memory_order mo) {
-  const size_t before = size_.fetch_add(size, mo);
-  return (before + size <= capacity_);
+inline void Table::CheckWritersDone() {
+  if (w_RefCount() > 0) {
+    return;
+  }
+  // Writers that find the table sealed may drop the count to zero again
+  if (!writers_done_.exchange(true)) {
+    on_writers_done_();
+  }
 }
 
 #endif  // LISTDB_LSM_TABLE_H_
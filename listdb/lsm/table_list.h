@@ -7,7 +7,6 @@
 #include "listdb/common.h"
 #include "listdb/lsm/memtable.h"
 #include "listdb/lsm/table.h"
-//#include "listdb/lsm/table_v2.h"
 
 class TableList {
  public:
@@ -27,13 +26,28 @@ class TableList {
 
   Table* GetFront(PmemAllocator* allocator);
 
-  Table* GetMutable(const size_t size);
+  // Returns the front table with a writer reference of the client taken
+  Table* GetMutable(const size_t size, const int client = Table::kSharedClient);
+
+  // Same as GetMutable, but returns nullptr instead of waiting for a new
+  // table to be allowed
+  Table* TryGetMutable(const size_t size, const int client = Table::kSharedClient);
 
   Table* GetMutable(const size_t size, PmemAllocator* allocator);
 
+  // Waits until a new table can be made without stalling
+  virtual void WaitForMutable() { return; }
+
  protected:
+  Table* GetMutable(const size_t size, const int client, const bool wait);
+
   virtual Table* NewMutable(size_t table_capacity, Table* next_table) = 0;
 
+  // Returns nullptr if the new table would have to wait
+  virtual Table* TryNewMutable(size_t table_capacity, Table* next_table) {
+    return NewMutable(table_capacity, next_table);
+  }
+
   virtual Table* NewMutable(size_t table_capacity, Table* next_table,
                             PmemAllocator* allocator) = 0;
 
@@ -109,20 +123,31 @@ Table* TableList::GetFront(PmemAllocator* allocator) {
   return ret;
 }
 
-Table* TableList::GetMutable(const size_t size) {
+Table* TableList::GetMutable(const size_t size, const int client) {
+  return GetMutable(size, client, true);
+}
+
+Table* TableList::TryGetMutable(const size_t size, const int client) {
+  return GetMutable(size, client, false);
+}
+
+Table* TableList::GetMutable(const size_t size, const int client, const bool wait) {
   auto table = GetFront();
-  table->w_Ref(MO_RELAXED);
-  if (!table->HasRoom(size)) {
-    table->w_UnRef(MO_RELAXED);
+  table->w_Ref(client);
+  if (!table->HasRoom(size, client)) {
+    table->w_UnRef(client);
     // >>> IMPLICIT MFENCE
     std::unique_lock<std::mutex> lk(init_mu_);
     table = front_.load(MO_RELAXED);
-    table->w_Ref(MO_RELAXED);
-    if (!table->HasRoom(size)) {
-      table->w_UnRef(MO_RELAXED);
-      auto new_table = NewMutable(table_capacity_, table);
-      new_table->HasRoom(size);
-      new_table->w_Ref(MO_RELAXED);
+    table->w_Ref(client);
+    if (!table->HasRoom(size, client)) {
+      table->w_UnRef(client);
+      auto new_table = wait ? NewMutable(table_capacity_, table) : TryNewMutable(table_capacity_, table);
+      if (new_table == nullptr) {
+        return nullptr;
+      }
+      new_table->HasRoom(size, client);
+      new_table->w_Ref(client);
       front_.store(new_table, MO_RELAXED);
       lk.unlock();
       EnqueueCompaction(table);
@@ -135,18 +160,18 @@ Table* TableList::GetMutable(const size_t size) {
 
 Table* TableList::GetMutable(const size_t size, PmemAllocator* allocator) {
   auto table = GetFront(allocator);
-  table->w_Ref(MO_RELAXED);
+  table->w_Ref();
   if (!table->HasRoom(size)) {
-    table->w_UnRef(MO_RELAXED);
+    table->w_UnRef();
     // >>> IMPLICIT MFENCE
     std::unique_lock<std::mutex> lk(init_mu_);
     table = front_.load(MO_RELAXED);
-    table->w_Ref(MO_RELAXED);
+    table->w_Ref();
     if (!table->HasRoom(size)) {
-      table->w_UnRef(MO_RELAXED);
+      table->w_UnRef();
       auto new_table = NewMutable(table_capacity_, table, allocator);
       new_table->HasRoom(size);
-      new_table->w_Ref(MO_RELAXED);
+      new_table->w_Ref();
       front_.store(new_table, MO_RELAXED);
       lk.unlock();
       EnqueueCompaction(table);
@@ -0,0 +1,54 @@
+#ifndef LISTDB_PMEM_PERSISTENCE_H_
+#define LISTDB_PMEM_PERSISTENCE_H_
+
+#include <atomic>
+#include <cstddef>
+
+#include <immintrin.h>
+
+#include "listdb/lib/memory.h"
+
+// Where stores become durable, which decides what a write path has to do
+// to persist them in order.
+//   kADR: only the memory controller is durable. Lines are flushed by clwb
+//         and ordered by sfence.
+//   kEADR: CPU caches are durable too. Stores only have to be ordered.
+//   kVolatile: nothing is durable, e.g. DRAM or tmpfs. Neither is needed.
+enum class PersistenceMode { kADR, kEADR, kVolatile };
+
+// Persistence policies. Write paths are templated on these, so each mode
+// is compiled without checks of its own.
+struct AdrPersistence {
+  static constexpr PersistenceMode kMode = PersistenceMode::kADR;
+  static void Flush(const void* addr, const size_t size) { clwb(addr, size); }
+  static void Fence() { _mm_sfence(); }
+};
+
+struct EadrPersistence {
+  static constexpr PersistenceMode kMode = PersistenceMode::kEADR;
+  static void Flush(const void* addr, const size_t size) { }
+  static void Fence() { _mm_sfence(); }
+};
+
+struct VolatilePersistence {
+  static constexpr PersistenceMode kMode = PersistenceMode::kVolatile;
+  static void Flush(const void* addr, const size_t size) { }
+  // Keeps the compiler from reordering stores across it
+  static void Fence() { std::atomic_signal_fence(std::memory_order_seq_cst); }
+};
+
+// Calls fn with the policy of the mode, e.g. to pick the instantiation of a
+// write path once
+template <typename Fn>
+inline auto WithPersistence(const PersistenceMode mode, Fn&& fn) {
+  switch (mode) {
+    case PersistenceMode::kEADR:
+      return fn(EadrPersistence());
+    case PersistenceMode::kVolatile:
+      return fn(VolatilePersistence());
+    default:
+      return fn(AdrPersistence());
+  }
+}
+
+#endif  // LISTDB_PMEM_PERSISTENCE_H_
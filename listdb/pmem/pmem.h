@@ -1,24 +1,43 @@
 #ifndef LISTDB_PMEM_PMEM_H_
 #define LISTDB_PMEM_PMEM_H_
 
+#include <cstdint>
 #include <iostream>
 #include <libpmemobj++/p.hpp>
 #include <libpmemobj++/pool.hpp>
+#include <mutex>
 #include <vector>
 
+// Registry of the pools bound in the process. A pool id indexes both the
+// pool objects and a flat, cache-line-aligned array of their base
+// addresses, which PmemPtr decodes through. Ids of released pools are
+// reused, so that each DB can bind and release its own pools.
 class Pmem {
  public:
+  static constexpr int kMaxPools = 256;
+  // Binds a pool at the lowest free id
+  static constexpr int kAnyPoolId = -1;
+
+  // pool_id: the id to bind the pool at, for a pool whose id is persisted in
+  // PmemPtrs. Exits if the id is in use.
   template <typename T>
   static int BindPool(const std::string& path, const std::string& layout,
-                      const size_t size);
+                      const size_t size, const int pool_id = kAnyPoolId);
 
-  static int BindPoolSet(const std::string& path, const std::string& layout);
+  static int BindPoolSet(const std::string& path, const std::string& layout,
+                         const int pool_id = kAnyPoolId);
 
   template <typename T>
-  static int BindPoolSet(const std::string& path, const std::string& layout);
+  static int BindPoolSet(const std::string& path, const std::string& layout,
+                         const int pool_id = kAnyPoolId);
+
+  // Closes the pool and frees its id
+  static void Release(const int pool_base_id);
 
   static void Clear();
 
+  static uintptr_t base(const int pool_base_id) { return bases_[pool_base_id]; }
+
   static pmem::obj::pool_base pool(const int pool_base_id) {
     return *pool_bases_[pool_base_id];
   }
@@ -29,56 +48,101 @@ class Pmem {
   }
 
  private:
+  static int Register(pmem::obj::pool_base* pool, const int pool_id);
+
+  alignas(64) inline static uintptr_t bases_[kMaxPools] = {};
   inline static std::vector<pmem::obj::pool_base*> pool_bases_;
+  inline static std::mutex mu_;
 };
 
 template <typename T>
 int Pmem::BindPool(const std::string& path, const std::string& layout,
-                   const size_t size) {
+                   const size_t size, const int pool_id) {
   pmem::obj::pool<T> pop;
   if (pmem::obj::pool_base::check(path, layout) == 1) {
     pop = pmem::obj::pool<T>::open(path, layout);
   } else {
     pop = pmem::obj::pool<T>::create(path, layout, size, 0666);
   }
-  auto it = pool_bases_.insert(pool_bases_.end(), new pmem::obj::pool<T>(pop));
-  return std::distance(pool_bases_.begin(), it);
+  return Register(new pmem::obj::pool<T>(pop), pool_id);
 }
 
-int Pmem::BindPoolSet(const std::string& path, const std::string& layout) {
+int Pmem::BindPoolSet(const std::string& path, const std::string& layout,
+                      const int pool_id) {
   pmem::obj::pool_base pop;
   if (pmem::obj::pool_base::check(path, layout) == 1) {
     pop = pmem::obj::pool_base::open(path, layout);
   } else {
     pop = pmem::obj::pool_base::create(path, layout, 0, 0666);
   }
-  auto it =
-      pool_bases_.insert(pool_bases_.end(), new pmem::obj::pool_base(pop));
-  return std::distance(pool_bases_.begin(), it);
+  return Register(new pmem::obj::pool_base(pop), pool_id);
 }
 
 template <typename T>
-int Pmem::BindPoolSet(const std::string& path, const std::string& layout) {
+int Pmem::BindPoolSet(const std::string& path, const std::string& layout,
+                      const int pool_id) {
   pmem::obj::pool<T> pop;
   if (pmem::obj::pool_base::check(path, layout) == 1) {
     pop = pmem::obj::pool<T>::open(path, layout);
   } else {
     pop = pmem::obj::pool<T>::create(path, layout, 0, 0666);
   }
-  auto it = pool_bases_.insert(pool_bases_.end(), new pmem::obj::pool<T>(pop));
-  return std::distance(pool_bases_.begin(), it);
+  return Register(new pmem::obj::pool<T>(pop), pool_id);
+}
+
+int Pmem::Register(pmem::obj::pool_base* pool, const int pool_id) {
+  std::lock_guard<std::mutex> lk(mu_);
+  int id = 0;
+  if (pool_id == kAnyPoolId) {
+    while (id < (int) pool_bases_.size() && pool_bases_[id] != nullptr) {
+      id++;
+    }
+    if (id >= kMaxPools) {
+      std::cerr << "too many pmem pools (max: " << kMaxPools << ")\n";
+      exit(1);
+    }
+  } else {
+    id = pool_id;
+    if (id < 0 || id >= kMaxPools) {
+      std::cerr << "pmem pool id out of range (current: " << id << ")\n";
+      exit(1);
+    }
+    if (id < (int) pool_bases_.size() && pool_bases_[id] != nullptr) {
+      std::cerr << "pmem pool id already in use (current: " << id << ")\n";
+      exit(1);
+    }
+  }
+  if (id >= (int) pool_bases_.size()) {
+    pool_bases_.resize(id + 1, nullptr);
+  }
+  pool_bases_[id] = pool;
+  bases_[id] = (uintptr_t) pool->handle();
+  return id;
+}
+
+void Pmem::Release(const int pool_base_id) {
+  std::lock_guard<std::mutex> lk(mu_);
+  auto& pool_base = pool_bases_[pool_base_id];
+  if (pool_base == nullptr) {
+    return;
+  }
+  pool_base->close();
+  delete pool_base;
+  pool_base = nullptr;
+  bases_[pool_base_id] = 0;
 }
 
 void Pmem::Clear() {
-  for (auto& pool_base : pool_bases_) {
-    pool_base->close();
+  for (int i = 0; i < (int) pool_bases_.size(); i++) {
+    Release(i);
   }
+  std::lock_guard<std::mutex> lk(mu_);
   pool_bases_.clear();
 }
 
 /*
  * Keeps track of the pool/pool_base objects instantiated
- * for binding in NVM, within a vector
+ * for binding in NVM, within a vector, and of their base addresses.
  * Methods return index of the objects in the vector.
  */
 class PmemAllocator {
@@ -96,9 +160,7 @@ class PmemAllocator {
     } else {
       pop = pmem::obj::pool<T>::create(path, layout, size, 0666);
     }
-    auto it =
-        pool_bases_.insert(pool_bases_.end(), new pmem::obj::pool<T>(pop));
-    return std::distance(pool_bases_.begin(), it);
+    return Register(new pmem::obj::pool<T>(pop));
   }
 
   int BindPoolSet(const std::string& path, const std::string& layout) {
@@ -108,9 +170,7 @@ class PmemAllocator {
     } else {
       pop = pmem::obj::pool_base::create(path, layout, 0, 0666);
     }
-    auto it =
-        pool_bases_.insert(pool_bases_.end(), new pmem::obj::pool_base(pop));
-    return std::distance(pool_bases_.begin(), it);
+    return Register(new pmem::obj::pool_base(pop));
   };
 
   template <typename T>
@@ -121,18 +181,19 @@ class PmemAllocator {
     } else {
       pop = pmem::obj::pool<T>::create(path, layout, 0, 0666);
     }
-    auto it =
-        pool_bases_.insert(pool_bases_.end(), new pmem::obj::pool<T>(pop));
-    return std::distance(pool_bases_.begin(), it);
+    return Register(new pmem::obj::pool<T>(pop));
   };
 
   void Clear() {
-    for (auto& pool_base : pool_bases_) {
-      pool_base->close();
+    for (size_t i = 0; i < pool_bases_.size(); i++) {
+      pool_bases_[i]->close();
+      bases_[i] = 0;
     }
     pool_bases_.clear();
   };
 
+  uintptr_t base(const int pool_base_id) { return bases_[pool_base_id]; }
+
   pmem::obj::pool_base pool(const int pool_base_id) {
     return *pool_bases_[pool_base_id];
   }
@@ -143,6 +204,18 @@ class PmemAllocator {
   }
 
  private:
+  int Register(pmem::obj::pool_base* pool) {
+    const int id = pool_bases_.size();
+    if (id >= Pmem::kMaxPools) {
+      std::cerr << "too many pmem pools (max: " << Pmem::kMaxPools << ")\n";
+      exit(1);
+    }
+    pool_bases_.push_back(pool);
+    bases_[id] = (uintptr_t) pool->handle();
+    return id;
+  }
+
+  alignas(64) uintptr_t bases_[Pmem::kMaxPools] = {};
   std::vector<pmem::obj::pool_base*> pool_bases_;
 };
 
@@ -89,7 +89,7 @@ void PmemMgr::InitTableLists() {
       for (int j = 0; j < kNumRegions; ++j) {
         // Bind l1 table list to hot region first as well
         PmemLog* l1_pmem_log = hot_region_.GetL1PmemLog(j, i);
-        tl->BindArena(l1_pmem_log->pool_id(), l1_pmem_log);
+        tl->BindArena(j, l1_pmem_log);
       }
       ll_[i]->SetTableList(1, tl);
     }
@@ -101,7 +101,6 @@ void PmemMgr::StartThreads() {
 
   for (int i = 0; i < kNumWorkers; ++i) {
     worker_data_[i].id = i;
-    worker_data_[i].stop = false;
     worker_threads_[i] = std::thread(std::bind(
         &PmemMgr::CompactionWorkerThreadLoop, this, &worker_data_[i]));
   }
@@ -122,8 +121,6 @@ void PmemMgr::Clear() {
   }
 
   for (int i = 0; i < kNumWorkers; ++i) {
-    worker_data_[i].stop = true;
-    worker_data_[i].cv.notify_one();
     if (worker_threads_[i].joinable()) {
       worker_threads_[i].join();
     }
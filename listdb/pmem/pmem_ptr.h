@@ -39,11 +39,11 @@ class PmemPtr {
     if (offset == 0) {
       return nullptr;
     }
-    return (T*)((uintptr_t)Pmem::pool(pool_id).handle() + offset);
+    return (T*)(Pmem::base(pool_id) + offset);
   }
 
   static uint64_t OffsetOfVaddr(int16_t pool_id, void* vaddr) {
-    return (uintptr_t)vaddr - (uintptr_t)Pmem::pool(pool_id).handle();
+    return (uintptr_t)vaddr - Pmem::base(pool_id);
   }
 
  private:
@@ -54,7 +54,7 @@ PmemPtr::PmemPtr(const int16_t pool_id, const uint64_t offset)
     : data_(Encode(pool_id, offset)) {}
 
 PmemPtr::PmemPtr(int16_t pool_id, char* vaddr) {
-  uint64_t offset = (uintptr_t)vaddr - (uintptr_t)Pmem::pool(pool_id).handle();
+  uint64_t offset = (uintptr_t)vaddr - Pmem::base(pool_id);
   data_ = Encode(pool_id, offset);
 }
 
@@ -69,7 +69,7 @@ inline void* PmemPtr::get() {
   static const uintptr_t kMask = 0x0000ffffffffffff;
   const int16_t pool_id = (data_ >> 48);
   const uint64_t offset = (data_ & kMask);
-  return (void*)((uintptr_t)Pmem::pool(pool_id).handle() + offset);
+  return (void*)(Pmem::base(pool_id) + offset);
 }
 
 template <typename T>
@@ -84,7 +84,7 @@ inline void* PmemPtr::get(PmemAllocator* allocator) {
   static const uintptr_t kMask = 0x0000ffffffffffff;
   const int16_t pool_id = (data_ >> 48);
   const uint64_t offset = (data_ & kMask);
-  return (void*)((uintptr_t)allocator->pool(pool_id).handle() + offset);
+  return (void*)(allocator->base(pool_id) + offset);
 }
 
 template <typename T>
@@ -119,7 +119,7 @@ inline T* PmemPtr::Decode(const uint64_t dump) {
   static const uintptr_t kMask = 0x0000ffffffffffff;
   const int16_t pool_id = (dump >> 48);
   const uint64_t offset = (dump & kMask);
-  return (T*)((uintptr_t)Pmem::pool(pool_id).handle() + offset);
+  return (T*)(Pmem::base(pool_id) + offset);
 }
 
 #endif  // LISTDB_PMEM_PMEM_PTR_H_
@@ -106,7 +106,7 @@ void PmemSection::InitTableLists(LevelList** ll) {
       for (int j = 0; j < kNumRegions; ++j) {
         // Bind l1 table list to hot region first as well
         PmemLog* l1_pmem_log = hot_region_.GetL1PmemLog(j, i);
-        tl->BindArena(l1_pmem_log->pool_id(), l1_pmem_log);
+        tl->BindArena(j, l1_pmem_log);
       }
       ll[i]->SetTableList(1, tl);
     }
@@ -118,7 +118,6 @@ void PmemSection::StartThreads() {
 
   for (int i = 0; i < kNumWorkers; ++i) {
     worker_data_[i].id = i;
-    worker_data_[i].stop = false;
     worker_threads_[i] = std::thread(std::bind(
         &PmemSection::CompactionWorkerThreadLoop, this, &worker_data_[i]));
   }
@@ -139,8 +138,6 @@ void PmemSection::Clear() {
   }
 
   for (int i = 0; i < kNumWorkers; ++i) {
-    worker_data_[i].stop = true;
-    worker_data_[i].cv.notify_one();
     if (worker_threads_[i].joinable()) {
       worker_threads_[i].join();
     }
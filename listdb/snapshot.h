@@ -0,0 +1,18 @@
+#ifndef LISTDB_SNAPSHOT_H_
+#define LISTDB_SNAPSHOT_H_
+
+#include "listdb/common.h"
+
+// A consistent read view taken by ListDB::GetSnapshot.
+// Reads through a snapshot ignore versions written after it was taken.
+class Snapshot {
+ public:
+  explicit Snapshot(const uint64_t seq) : seq_(seq) { }
+
+  uint64_t seq() const { return seq_; }
+
+ private:
+  const uint64_t seq_;
+};
+
+#endif  // LISTDB_SNAPSHOT_H_
@@ -1,6 +1,9 @@
 #ifndef LISTDB_TASKS_TASK_H_
 #define LISTDB_TASKS_TASK_H_
 
+#include <deque>
+#include <mutex>
+
 #include "listdb/lsm/memtable_list.h"
 #include "listdb/lsm/pmemtable.h"
 #include "listdb/lsm/pmemtable_list.h"
@@ -21,13 +24,27 @@ struct L0CompactionTask : Task {
   MemTableList* memtable_list;
 };
 
+struct MemTablePrepareTask : Task {
+  MemTableList* memtable_list;
+};
+
+struct PmemLogRefillTask : Task {
+  PmemLog* log;
+};
+
+// Task queues of a NUMA node. Workers take tasks from the queues of their
+// own node first and steal from the other nodes when those are empty.
+// Flushes and other short tasks are taken before any L0 compaction.
+struct alignas(64) NodeTaskQueue {
+  std::mutex mu;
+  std::deque<Task*> flush_q;
+  std::deque<Task*> compaction_q;
+};
+
 struct alignas(64) CompactionWorkerData {
   int id;
-  bool stop;
+  int numa_node;
   Random rnd = Random(0);
-  std::queue<Task*> q;
-  std::mutex mu;
-  std::condition_variable cv;
   Task* current_task;
   uint64_t flush_cnt = 0;
   uint64_t flush_time_usec = 0;
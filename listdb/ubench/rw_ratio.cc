@@ -573,16 +573,13 @@ int main(int argc, char* argv[]) {
   {
     fprintf(stdout, "*** Cache Configurations ***\n");
 #if LISTDB_L0_CACHE == L0_CACHE_T_SIMPLE
-    fprintf(stdout, "L0_cache_size: %zu = %zu bytes (SimpleHashTable)\n",
-            kHTSize, kHTSize * sizeof(SimpleHashTable::Bucket));
+    fprintf(stdout, "L0_cache_budget: %zu bytes (SimpleHashTable)\n", kL0CacheBudget);
 #elif LISTDB_L0_CACHE == L0_CACHE_T_STATIC
-    fprintf(stdout, "L0_cache_size: %zu = %zu bytes (StaticHashTableCache)\n",
-            kHTSize, kHTSize * sizeof(StaticHashTableCache::Bucket));
+    fprintf(stdout, "L0_cache_budget: %zu bytes (StaticHashTableCache)\n", kL0CacheBudget);
 #elif LISTDB_L0_CACHE == L0_CACHE_T_DOUBLE_HASHING
-    fprintf(stdout, "L0_cache_size: %zu = %zu bytes (DoubleHashingCache)\n",
-            kHTSize, kHTSize * sizeof(DoubleHashingCache::Bucket));
+    fprintf(stdout, "L0_cache_budget: %zu bytes (DoubleHashingCache)\n", kL0CacheBudget);
 #else
-    fprintf(stdout, "L0_cache_size: 0\n");
+    fprintf(stdout, "L0_cache_budget: 0\n");
 #endif
 
 #ifdef LISTDB_SKIPLIST_CACHE
@@ -590,6 +587,8 @@ int main(int argc, char* argv[]) {
 
     std::cout << "kSkipListCacheCardinality: " << kSkipListCacheCardinality << std::endl;
     std::cout << "kSkipListCacheMinPmemHeight: " << kSkipListCacheMinPmemHeight << std::endl;
+#elif defined(LISTDB_L1_LRU)
+    fprintf(stdout, "L1_cache_size: %zu bytes (LruSkipList)\n", kLruCacheCapacity);
 #else
     fprintf(stdout, "L1_cache_size: disabled.\n");
 #endif
@@ -0,0 +1,69 @@
+#ifndef LISTDB_WRITE_BATCH_H_
+#define LISTDB_WRITE_BATCH_H_
+
+#include <cstring>
+#include <vector>
+
+#include "listdb/common.h"
+#include "listdb/index/braided_pmem_skiplist.h"
+#include "listdb/pmem/pmem_ptr.h"
+
+// A set of updates applied atomically by DBClient::Write.
+// Entries of the same key are applied in the order they were added.
+class WriteBatch {
+ public:
+  struct Entry {
+    Key key;
+    Value value;
+    ValueType type;
+  };
+
+  void Put(const Key& key, const Value& value) { entries_.push_back(Entry{key, value, kTypeValue}); }
+
+  void Delete(const Key& key) { entries_.push_back(Entry{key, 0, kTypeDeletion}); }
+
+  void Clear() { entries_.clear(); }
+
+  size_t Count() const { return entries_.size(); }
+
+  const std::vector<Entry>& entries() const { return entries_; }
+
+ private:
+  std::vector<Entry> entries_;
+};
+
+// A batch is logged as contiguous runs of IUL entries, at least one run per
+// shard. Each run starts with a header shaped like an IUL entry of height 1:
+//   key     : size of the run in bytes, including the header
+//   tag     : l0_id | kTypeBatchHeader | height 1
+//   value   : address of the commit header of the batch
+//   next[0] : commit mark, set only in the commit header
+// Recovery replays the entries of a run only if the batch has committed.
+namespace batch_log {
+
+using PmemNode = BraidedPmemSkipList::Node;
+
+constexpr size_t kHeaderSize = sizeof(PmemNode);
+
+inline void InitHeader(PmemNode* header, const uint64_t l0_id, const size_t run_size,
+                       PmemPtr commit_paddr) {
+  memset((void*) &header->key, 0, sizeof(Key));
+  memcpy((void*) &header->key, &run_size, sizeof(uint64_t));
+  header->tag = MakeTag(0, l0_id, kTypeBatchHeader, 1);
+  header->value = commit_paddr.dump();
+  header->next[0] = 0;
+}
+
+inline size_t RunSize(const PmemNode* header) {
+  uint64_t run_size;
+  memcpy(&run_size, (void*) &header->key, sizeof(uint64_t));
+  return run_size;
+}
+
+inline bool Committed(const PmemNode* header) {
+  return PmemPtr::Decode<PmemNode>(header->value)->next[0] != 0;
+}
+
+}  // namespace batch_log
+
+#endif  // LISTDB_WRITE_BATCH_H_